@@ -1,340 +1,1148 @@
-#include <unifex/task.hpp>
-#include <unifex/when_all.hpp>
-#include <unifex/sync_wait.hpp>
-#include "mainwq.h"
-#include "curl_workqueue.h"
-#include "gif.h"
-
-CurlWorkqueue* g_curlWQ;
-
-void SetImage(const std::vector<uint32_t>& image, int width, int height, int id);
-
-unifex::task<void> processImageBlock(CurlWorkqueue::CurlReader& reader, ImageDescriptor& descriptor, std::vector<uint8_t>& imageData, std::vector<uint8_t>& localColorTable)
-{
-	if (co_await reader.read(&descriptor, sizeof(descriptor)) != sizeof(descriptor)) {
-		printf("Failed to read Image Descriptor\n");
-		co_return;
-	}
-
-	printf("Image Descriptor: %dx%d at (%d, %d)\n",
-		descriptor.width, descriptor.height, descriptor.left, descriptor.top);
-
-	// [JJ[e[ȕ (KvȂ)
-	if (descriptor.packedFields & 0x80) {
-		size_t colorTableSize = 3 * (1 << ((descriptor.packedFields & 0x07) + 1));
-		localColorTable.resize(colorTableSize);
-		if (co_await reader.read(localColorTable.data(), colorTableSize) != colorTableSize) {
-			printf("Failed to read Local Color Table\n");
-			co_return;
-		}
-		printf("Local Color Table read successfully\n");
-	}
-	else {
-		localColorTable.clear(); // [JJ[e[uȂꍇ̓NA
-	}
-
-	// LZWŏR[hTCYǂݎ
-	uint8_t minCodeSize;
-	if (co_await reader.read(&minCodeSize, 1) != 1) {
-		printf("Failed to read LZW Minimum Code Size\n");
-		co_return;
-	}
-	printf("LZW Minimum Code Size: %d\n", minCodeSize);
-
-	// kf[^ǂݎ
-	std::vector<uint8_t> compressedData;
-	while (true) {
-		uint8_t blockSize;
-		if (co_await reader.read(&blockSize, 1) != 1) {
-			printf("Failed to read block size\n");
-			co_return;
-		}
-		if (blockSize == 0) {
-			break; // ubNI
-		}
-		std::vector<uint8_t> block(blockSize);
-		if (co_await reader.read(block.data(), blockSize) != blockSize) {
-			printf("Failed to read block data\n");
-			co_return;
-		}
-		compressedData.insert(compressedData.end(), block.begin(), block.end());
-	}
-
-	// LZWfR[h
-	try {
-		imageData = decodeLZW(compressedData, minCodeSize);
-		printf("Image data decoded successfully, size: %zu\n", imageData.size());
-	}
-	catch (const std::exception& e) {
-		printf("LZW decode error: %s\n", e.what());
-	}
-}
-
-unifex::task<void> readGraphicsControlExtension(CurlWorkqueue::CurlReader& reader, GraphicControlExtension& gce)
-{
-	// OtBbNgubNǂݎ
-	printf("Reading Graphic Control Extension Block\n");
-	uint8_t blockSize;
-	if ((co_await reader.read(&blockSize, 1)) != 1 || blockSize != 4) {
-		printf("Invalid Graphic Control Extension Block size\n");
-		co_return;
-	}
-	if ((co_await reader.read(&gce, sizeof(gce))) != sizeof(gce)) {
-		printf("Failed to read Graphic Control Extension\n");
-		co_return;
-	}
-	uint8_t terminator;
-	if ((co_await reader.read(&terminator, 1)) != 1 || terminator != 0) {
-		printf("Invalid Graphic Control Extension terminator\n");
-		co_return;
-	}
-	printf("Graphic Control Extension: delayTime=%d, transparentColorIndex=%d\n",
-		gce.delayTime, gce.transparentColorIndex);
-}
-
-unifex::task<void> readExtensionBlock(CurlWorkqueue::CurlReader& reader)
-{
-	// TuubNXLbv
-	while (true) {
-		uint8_t subBlockSize;
-		if ((co_await reader.read(&subBlockSize, 1)) != 1) {
-			printf("Failed to read sub-block size\n");
-			co_return;
-		}
-		if (subBlockSize == 0) {
-			break; // TuubNI
-		}
-		std::vector<char> subBlock(subBlockSize);
-		if ((co_await reader.read(subBlock.data(), subBlockSize)) != subBlockSize) {
-			printf("Failed to skip sub-block data\n");
-			co_return;
-		}
-	}
-}
-
-unifex::task<void> handlApplicationExtensionBlock(CurlWorkqueue::CurlReader& reader)
-{
-	// AvP[VgubN
-	printf("Application Extension Block found\n");
-
-	// ubNTCYǂݎ
-	uint8_t blockSize;
-	if ((co_await reader.read(&blockSize, 1)) != 1 || blockSize != 0x0B) {
-		printf("Invalid Application Extension Block size\n");
-		co_return;
-	}
-
-	// AvP[VʎqƔFR[hǂݎ
-	char appIdentifier[8 + 1] = { 0 };
-	char appAuthCode[3 + 1] = { 0 };
-	if ((co_await reader.read(appIdentifier, 8)) != 8 ||
-		(co_await reader.read(appAuthCode, 3)) != 3) {
-		printf("Failed to read Application Extension Block identifiers\n");
-		co_return;
-	}
-
-	printf("Application Identifier: %s\n", appIdentifier);
-	printf("Application Authentication Code: %s\n", appAuthCode);
-
-	// f[^TuubNǂݎ
-	std::vector<uint8_t> appData;
-	while (true) {
-		uint8_t subBlockSize;
-		if ((co_await reader.read(&subBlockSize, 1)) != 1) {
-			printf("Failed to read sub-block size\n");
-			co_return;
-		}
-		if (subBlockSize == 0) {
-			break; // TuubNI
-		}
-
-		std::vector<uint8_t> subBlock(subBlockSize);
-		if ((co_await reader.read(subBlock.data(), subBlockSize)) != subBlockSize) {
-			printf("Failed to read sub-block data\n");
-			co_return;
-		}
-		appData.insert(appData.end(), subBlock.begin(), subBlock.end());
-	}
-
-	printf("Application Extension Block data size: %zu bytes\n", appData.size());
-
-	// KvɉăAvP[Vf[^
-	// : "NETSCAPE2.0" ̏ꍇA[v񂪊܂܂
-	if (std::string(appIdentifier) == "NETSCAPE") {
-		printf("NETSCAPE Application Extension detected\n");
-		if (appData.size() >= 3 && appData[0] == 0x01) {
-			uint16_t loopCount = appData[1] | (appData[2] << 8);
-			if (loopCount == 0) {
-				printf("Loop Count: Infinite\n");
-			}
-			else {
-				printf("Loop Count: %d\n", loopCount);
-			}
-		}
-		else {
-			printf("Invalid NETSCAPE Application Extension data\n");
-		}
-	}
-}
-
-unifex::task<void> curl_task_once(const char* url, int taskIndex)
-{
-	// lbg[NXbhɃXPW[
-	co_await shedule(*g_curlWQ);
-
-	auto reader = CurlWorkqueue::CurlReader(url, *g_curlWQ);
-
-	GIFHeader header;
-	if ((co_await reader.read(&header, sizeof(header))) != sizeof(header)) {
-		printf("Failed to read GIF header\n");
-		co_return;
-	}
-
-	LogicalScreenDescriptor lsd;
-	if ((co_await reader.read(&lsd, sizeof(lsd))) != sizeof(lsd)) {
-		printf("Failed to read Logical Screen Descriptor\n");
-		co_return;
-	}
-
-	std::vector<uint32_t> image(lsd.width * lsd.height);
-
-	// O[oJ[e[ȗ݂mF
-	std::vector<uint8_t> globalColorTable;
-	if (lsd.packedFields & 0x80) { // O[oJ[e[u݂邩mF
-		size_t colorTableSize = 3 * (1 << ((lsd.packedFields & 0x07) + 1));
-		globalColorTable.resize(colorTableSize);
-		if ((co_await reader.read(globalColorTable.data(), colorTableSize)) != colorTableSize) {
-			printf("Failed to read Global Color Table\n");
-			co_return;
-		}
-	}
-
-	std::optional<GraphicControlExtension> gce;
-	while (true) {
-		uint8_t blockType;
-		if ((co_await reader.read(&blockType, 1)) != 1) {
-			printf("Failed to read block type\n");
-			co_return;
-		}
-
-		if (blockType == 0x3B) { // I[oCg
-			printf("End of GIF file\n");
-			break;
-		}
-		else if (blockType == 0x2C) { // 摜ubN
-			printf("Image block found\n");
-			ImageDescriptor descriptor;
-			std::vector<uint8_t> imageData;
-			std::vector<uint8_t> localColorTable;
-			co_await processImageBlock(reader, descriptor, imageData, localColorTable);
-			if (!imageData.empty()) {
-				printf("Image data size: %zu bytes\n", imageData.size());
-				uint8_t* colorTable = localColorTable.empty() ? globalColorTable.data() : localColorTable.data();
-				int colorTableSize = localColorTable.empty() ? globalColorTable.size() : localColorTable.size();
-
-				int transparentColorIndex = -1;
-				if (gce && (gce->packedFields & 0x1)) {
-					transparentColorIndex = gce->transparentColorIndex;
-				}
-				if (colorTableSize % 3 != 0) {
-					co_return;
-				}
-				for (size_t i = 0; i < imageData.size(); ++i) {
-					uint8_t index = imageData[i];
-					int imageIndex = (descriptor.left + (i % descriptor.width)) +
-						((descriptor.top + (i / descriptor.width)) * lsd.width);
-					if (imageIndex >= image.size()) {
-						printf("Image index out of bounds: %d\n", imageIndex);
-						continue; // AEgIuoEY͖
-					}
-					if (index == transparentColorIndex) {
-						continue;
-					}
-					else if (index < 0 || index >= 256) {
-						printf("Invalid color index: %d\n", index);
-						image[imageIndex] = 0xFF000000; // AEgIuoEY͓
-					}
-					if (index < colorTableSize) {
-						image[imageIndex] = 0xFF000000 |
-							(colorTable[index * 3 + 0] << 16) |
-							(colorTable[index * 3 + 1] << 8) |
-							colorTable[index * 3 + 2];
-					}
-					else {
-						image[imageIndex] = 0xFF000000; // AEgIuoEY͓
-					}
-				}
-				if (gce) {
-					co_await sheduleOnMainWQ(std::chrono::milliseconds(gce->delayTime * 10));
-					gce = std::nullopt;
-				}
-				else {
-					co_await sheduleOnMainWQ();
-				}
-				SetImage(image, lsd.width, lsd.height, taskIndex);
-			}
-			else {
-				printf("No image data found\n");
-			}
-		}
-		else if (blockType == 0x21) { // gubN
-			uint8_t label;
-			if ((co_await reader.read(&label, 1)) != 1) {
-				printf("Failed to read extension label\n");
-				co_return;
-			}
-			if (label == 0xF9) { // OtBbNg
-				GraphicControlExtension gce_;
-				co_await readGraphicsControlExtension(reader, gce_);
-				gce = gce_;
-			}
-			else if (label == 0xFE) { // Rgg
-				co_await readExtensionBlock(reader);
-			}
-			else if (label == 0x01) { // v[eLXgg
-				co_await readExtensionBlock(reader);
-			}
-			else if (label == 0xFF) { // AvP[Vg
-				co_await handlApplicationExtensionBlock(reader);
-			}
-			else {
-				co_await readExtensionBlock(reader);
-			}
-		}
-		else if (blockType == 0xFF) { // ApplicationgubN
-			co_await handlApplicationExtensionBlock(reader);
-		}
-		else {
-			printf("Unknown block type: 0x%02X\n", blockType);
-			co_return;
-		}
-	}
-}
-
-unifex::task<void> curl_task(const char* url, int taskIndex)
-{
-	while (true) {
-		co_await curl_task_once(url, taskIndex);
-	}
-}
-
-unifex::task<void> main_task()
-{
-	g_curlWQ = new CurlWorkqueue();
-	std::thread{ [&]() { g_curlWQ->run(); } }.detach();
-
-	const char* urls[] = {
-		"https://upload.wikimedia.org/wikipedia/commons/2/2c/Rotating_earth_%28large%29.gif",
-		"https://media3.giphy.com/media/v1.Y2lkPTc5MGI3NjExd3B1YTh4NzdrcXQ1MGd4Ymxld3c5eWk3MnBwdDdwemlrNXQxOXh0YSZlcD12MV9pbnRlcm5hbF9naWZfYnlfaWQmY3Q9Zw/BfbUe877N4xsUhpcPc/giphy.gif",
-		"https://media0.giphy.com/media/v1.Y2lkPTc5MGI3NjExbTliYmxnbWJtdDBtODI1djI0MnpydmljMmp5eXdrZWdvYjAzdXU4aiZlcD12MV9pbnRlcm5hbF9naWZfYnlfaWQmY3Q9Zw/AGzrIm03v0zQrIVI52/giphy.gif",
-		"https://media4.giphy.com/media/v1.Y2lkPTc5MGI3NjExanN4c3IyYW81OHl0N2VzbG0zcTNkcDdibWJubDFycjBtZWxlcng2NCZlcD12MV9pbnRlcm5hbF9naWZfYnlfaWQmY3Q9Zw/kaVe0g311RVYdGlibZ/giphy.gif",
-	};
-
-	unifex::sync_wait(unifex::when_all(
-		curl_task(urls[0], 0),
-		curl_task(urls[1], 1),
-		curl_task(urls[2], 2),
-		curl_task(urls[3], 3)
-	));
-	co_return;
+#include <unifex/task.hpp>
+#include <unifex/when_all.hpp>
+#include <unifex/inplace_stop_token.hpp>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include "app.h"
+#include "mainwq.h"
+#include "curl_workqueue.h"
+#include "curl_workqueue_pool.h"
+#include "byte_source.h"
+#include "frame_cache.h"
+#include "frame_governor.h"
+#include "memory_budget.h"
+#include "frame_queue.h"
+#include "gif.h"
+#include "gif_encoder.h"
+#include "indexed_image.h"
+#include "logger.h"
+#include "trace.h"
+
+CurlWorkqueuePool* g_curlPool;
+unifex::inplace_stop_source g_stopSource;
+
+// ストリームの打ち切り条件。stopToken が立つか deadline を過ぎると、待機中の読み込みや表示待ちから抜けて終了する
+struct StreamOptions {
+	unifex::inplace_stop_token stopToken;
+	std::chrono::milliseconds readTimeout{ 0 }; // 1回の読み込みで待つ上限 (0 なら無制限)
+	std::optional<std::chrono::steady_clock::time_point> deadline;
+	// 設定されていれば、デコードしたフレームを GIF に再エンコードしてここで開いた先に書き出す (1周ごとに呼ばれる)
+	std::function<std::unique_ptr<GifWriter>(int taskIndex)> openOutput;
+	// 表示より先にデコードしておくフレーム数。0 ならデコードしたフレームをその場で表示まで待つ。
+	// 先読みしていればループの終端に来た時点で次の周回の取得を始めるので、切れ目で止まらない
+	size_t lookahead = 0;
+	// 見えていないストリームは Background にすると、表示・デコードの順番と HTTP/2 の帯域で後回しになる
+	Priority priority = Priority::Foreground;
+	int64_t maxRecvSpeed = 0; // 受信速度の上限 (バイト/秒、0 なら無制限)
+	// 設定されていれば curl の代わりにこれで作ったものからデータを受け取る (ReplaySource など)
+	std::function<std::unique_ptr<ByteSource>(const char* url)> openSource;
+	// 設定されていればフレームを表示せず、ネットワークスレッドでこれに渡す (lookahead より優先)
+	FrameCallback onFrame;
+	// 設定されていれば、圧縮データが同じフレームは展開し直さずにこれに残っている結果を使う
+	FrameCache* frameCache = nullptr;
+	// インターレースのフレームは、パスが終わるたびに行を引き伸ばした途中の画像を表示する。
+	// フレームの残りがまだ届いておらず、表示を待っているフレームもないときだけ
+	bool progressive = false;
+	// 設定されていれば、表示が追いつかないときにこれの判断で表示するフレームを間引く (lookahead があるときだけ)
+	FrameGovernor* frameGovernor = nullptr;
+	FrameGovernor::Stream* governed = nullptr; // curl_task() が frameGovernor に登録したこのストリーム
+	MemoryBudget::Account* memory = nullptr;   // curl_task() や decode_gif() が作ったこのストリームの分
+
+	bool expired() const
+	{
+		return stopToken.stop_requested() || (deadline && mainWQClock().now() >= *deadline);
+	}
+};
+
+void SetImage(const IndexedImage& image, int id);
+
+// 表示の遅れ (予定の時刻から SetImage() までの時間) を優先度ごとに集計し、一定数ごとにログに出す。
+// Background の負荷で Foreground の表示が遅れていないかを見るためのもの。メインスレッドだけで使う
+class FrameLateness {
+public:
+	static constexpr int ReportInterval = 300;
+
+	void record(Priority priority, std::chrono::steady_clock::duration lateness)
+	{
+		Stats& stats = m_stats[static_cast<size_t>(priority)];
+		auto us = std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(lateness).count(), 0);
+		stats.totalUs += us;
+		stats.maxUs = std::max(stats.maxUs, us);
+		if (++stats.count == ReportInterval) {
+			LOGI("Frame lateness (%s): avg %.2f ms, max %.2f ms\n",
+				priority == Priority::Foreground ? "foreground" : "background",
+				stats.totalUs / 1000.0 / stats.count, stats.maxUs / 1000.0);
+			stats = Stats{};
+		}
+	}
+
+private:
+	struct Stats {
+		int count = 0;
+		int64_t totalUs = 0;
+		int64_t maxUs = 0;
+	};
+	Stats m_stats[PriorityCount];
+};
+static FrameLateness g_frameLateness;
+
+// 全ストリームで共有する。同じ GIF の周回や、同じ GIF を並べたストリームで展開を省く
+static FrameCache g_frameCache;
+
+static FrameGovernor g_frameGovernor;
+
+// 表示側が小さいサイズでしか使わない場合、そのサイズを返す (false ならフル解像度)。
+// width と height には GIF の論理画面の大きさが入って呼ばれる
+bool GetTargetImageSize(int id, int& width, int& height);
+
+// 縮小合成用の最近傍サンプリングの対応表。map[出力座標] が元画像の座標になる。
+static void buildScaleMap(int srcSize, int dstSize, std::vector<int>& map)
+{
+	map.resize(dstSize);
+	for (int i = 0; i < dstSize; ++i) {
+		map[i] = static_cast<int>((static_cast<int64_t>(i) * 2 + 1) * srcSize / (static_cast<int64_t>(dstSize) * 2));
+	}
+}
+
+// カラーテーブルを ARGB に展開する。テーブルにないインデックスは黒にする。
+static void buildPalette(const std::vector<uint8_t>& colorTable, uint32_t (&palette)[256])
+{
+	size_t count = std::min<size_t>(colorTable.size() / 3, 256);
+	for (size_t i = 0; i < count; ++i) {
+		palette[i] = 0xFF000000 |
+			(colorTable[i * 3 + 0] << 16) |
+			(colorTable[i * 3 + 1] << 8) |
+			colorTable[i * 3 + 2];
+	}
+	for (size_t i = count; i < 256; ++i) {
+		palette[i] = 0xFF000000;
+	}
+}
+
+// インデックスのまま合成するための共有パレットと、フレームのインデックスからキャンバスのインデックスへの対応表を作る。
+// 色数が 256 未満なら最後の要素を IndexedImage::EmptyIndex (未描画) に使い、テーブル外のインデックスは黒に寄せる。
+// 256 色あって未描画の画素を残さなければならないときは表せないので nullptr を返す。
+static std::shared_ptr<const Palette> internFramePalette(const uint32_t (&argb)[256], size_t colorCount, bool needsEmpty, uint8_t (&lut)[256])
+{
+	uint32_t colors[256];
+	std::copy(std::begin(argb), std::end(argb), colors);
+	for (int i = 0; i < 256; ++i) {
+		lut[i] = static_cast<uint8_t>(i);
+	}
+	if (colorCount <= 254) {
+		// buildPalette() でテーブル外は黒になっているので 254 は黒
+		colors[IndexedImage::EmptyIndex] = 0;
+		lut[IndexedImage::EmptyIndex] = 254;
+	}
+	else if (needsEmpty) {
+		return nullptr;
+	}
+	return PalettePool::instance().intern(colors);
+}
+
+// フレームの矩形をキャンバスに重ねる。Pixel は uint8_t (インデックス) か uint32_t (ARGB) で、colors[index] を書く
+template <class Pixel>
+static void compositeFrame(Pixel* canvas, int canvasWidth, const Pixel (&colors)[256], int transparentColorIndex,
+	const uint8_t* imageData, int imageWidth, int left, int top, int right, int bottom,
+	const std::vector<int>& xMap, const std::vector<int>& yMap)
+{
+	if (xMap.empty()) {
+		for (int y = top; y < bottom; ++y) {
+			const uint8_t* src = imageData + static_cast<size_t>(y - top) * imageWidth;
+			Pixel* dst = canvas + static_cast<size_t>(y) * canvasWidth;
+			for (int x = left; x < right; ++x) {
+				uint8_t index = src[x - left];
+				dst[x] = (index == transparentColorIndex) ? dst[x] : colors[index];
+			}
+		}
+	}
+	else {
+		// 元画像で [left, right) x [top, bottom) を参照する出力の範囲 (対応表は単調増加)
+		const int x0 = static_cast<int>(std::lower_bound(xMap.begin(), xMap.end(), left) - xMap.begin());
+		const int x1 = static_cast<int>(std::lower_bound(xMap.begin(), xMap.end(), right) - xMap.begin());
+		const int y0 = static_cast<int>(std::lower_bound(yMap.begin(), yMap.end(), top) - yMap.begin());
+		const int y1 = static_cast<int>(std::lower_bound(yMap.begin(), yMap.end(), bottom) - yMap.begin());
+		for (int y = y0; y < y1; ++y) {
+			const uint8_t* src = imageData + static_cast<size_t>(yMap[y] - top) * imageWidth;
+			Pixel* dst = canvas + static_cast<size_t>(y) * canvasWidth;
+			for (int x = x0; x < x1; ++x) {
+				uint8_t index = src[xMap[x] - left];
+				dst[x] = (index == transparentColorIndex) ? dst[x] : colors[index];
+			}
+		}
+	}
+}
+
+// インターレースの行順で rows 行まで展開された src を上から順に並べ直して dst に書く。
+// 終わっているパスの行だけを使い、まだ届いていない行はすぐ上の届いた行で埋める。並べられた行数を返す
+static size_t deinterlace(const uint8_t* src, size_t rows, int width, int height, std::vector<uint8_t>& dst)
+{
+	// 終わったパスまでで何行おきに揃っているか (最初のパスの途中なら届いた分だけ 8 行ずつ)
+	size_t step = 8;
+	size_t filled = std::min<size_t>(rows * 8, height);
+	for (int pass = 3; pass >= 0; --pass) {
+		if (rows >= interlacedRowsThroughPass(pass, height)) {
+			step = size_t(8) >> pass;
+			filled = height;
+			break;
+		}
+	}
+	dst.resize(static_cast<size_t>(width) * filled);
+	for (size_t y = 0; y < filled; ++y) {
+		size_t index = interlacedRowIndex(y - y % step, height);
+		memcpy(dst.data() + y * width, src + index * width, width);
+	}
+	return filled;
+}
+
+// デコードしたフレーム (descriptor.width 幅で rows 行) を image に重ねる。
+// 同じパレットが続く間は 8bit インデックスのまま合成し、混ざったら ARGB に切り替える
+static void composeFrame(IndexedImage& image, bool& imageHasEmpty, const ImageDescriptor& descriptor,
+	const uint8_t* imageData, size_t rows, const std::vector<uint8_t>& colorTable, int transparentColorIndex,
+	int screenWidth, int screenHeight, const std::vector<int>& xMap, const std::vector<int>& yMap)
+{
+	uint32_t palette[256];
+	buildPalette(colorTable, palette);
+
+	// フレームの矩形は論理画面でここで一度だけクリップし、内側のループでは範囲チェックしない
+	const int left = descriptor.left;
+	const int top = descriptor.top;
+	const int right = std::min<int>(left + descriptor.width, screenWidth);
+	const int bottom = static_cast<int>(std::min<size_t>(top + rows, screenHeight));
+
+	// 画面全体を不透明に覆うフレームなら、それまでの内容に関係なくパレットを切り替えられる
+	// (透明色が指定されていても実際に使われていなければ不透明)
+	bool coversAll = left == 0 && top == 0 && right == screenWidth && bottom == screenHeight;
+	if (coversAll && transparentColorIndex >= 0) {
+		coversAll = memchr(imageData, transparentColorIndex, static_cast<size_t>(descriptor.width) * (bottom - top)) == nullptr;
+	}
+	uint8_t lut[256];
+	auto shared = internFramePalette(palette, colorTable.size() / 3, imageHasEmpty && !coversAll, lut);
+	if (image.indexed()) {
+		if (!shared) {
+			image.convertToARGB();
+		}
+		else if (shared != image.palette()) {
+			if (coversAll || !image.palette()) {
+				image.setPalette(shared);
+			}
+			else {
+				image.convertToARGB();
+			}
+		}
+	}
+	else if (shared && coversAll) {
+		image.convertToIndexed(shared);
+	}
+
+	[[maybe_unused]] uint64_t compositeBegin = TRACE_NOW();
+	if (image.indexed()) {
+		compositeFrame(image.indices(), image.width(), lut, transparentColorIndex,
+			imageData, descriptor.width, left, top, right, bottom, xMap, yMap);
+	}
+	else {
+		compositeFrame(image.argb(), image.width(), palette, transparentColorIndex,
+			imageData, descriptor.width, left, top, right, bottom, xMap, yMap);
+	}
+	if (coversAll) {
+		imageHasEmpty = false;
+	}
+	TRACE_COMPLETE("composite", compositeBegin);
+}
+
+// 1本のストリームで周回をまたいで使い回すもの。
+// 2周目以降は easy ハンドルと各バッファの容量がそのまま残るので、定常状態では確保しない。
+// reader があるのでネットワークスレッドで作って破棄すること。
+struct StreamContext {
+	StreamContext(CurlWorkqueue& wq, unifex::inplace_stop_token stopToken, MemoryBudget::Account* memory = nullptr)
+		: reader(wq, stopToken)
+		, memory(memory)
+	{
+		reader.setMemoryAccount(memory);
+	}
+
+	~StreamContext()
+	{
+		if (memory) {
+			memory->update(MemoryCategory::Decode, 0);
+			memory->update(MemoryCategory::Canvas, 0);
+		}
+	}
+
+	// バッファの容量を memory に数え直す。フレームごとにネットワークスレッドで呼ぶ (受信バッファは reader が数える)
+	void updateMemory(FrameQueue* frames)
+	{
+		if (!memory) {
+			return;
+		}
+		memory->update(MemoryCategory::Decode, globalColorTable.capacity() + localColorTable.capacity() +
+			subBlock.capacity() + compressed.capacity() + sizeof(GifLZWDecoder) + imageData.capacity() + deinterlaced.capacity());
+		memory->update(MemoryCategory::Canvas, image.memoryUsage() + preview.memoryUsage() +
+			(xMap.capacity() + yMap.capacity()) * sizeof(int) + encoderCanvas.capacity() * sizeof(uint32_t));
+		if (frames) {
+			memory->update(MemoryCategory::Queue, frames->memoryUsage());
+		}
+	}
+
+	CurlWorkqueue::CurlReader reader;
+	IndexedImage image;
+	IndexedImage preview; // インターレースの途中のパスを重ねた画像
+	std::vector<uint8_t> globalColorTable;
+	std::vector<uint8_t> localColorTable;
+	std::vector<uint8_t> subBlock;
+	std::vector<uint8_t> compressed; // FrameCache を引くフレームの圧縮データ
+	GifLZWDecoder decoder;
+	std::vector<uint8_t> imageData;
+	std::vector<uint8_t> deinterlaced;
+	std::vector<int> xMap; // 縮小しないときは空
+	std::vector<int> yMap;
+	CanvasBuffer<uint32_t> encoderCanvas;
+	MemoryBudget::Account* memory;
+};
+
+// 画像記述子からLZW最小コードサイズまでを読む。読めなければ false
+unifex::task<bool> readImageHeader(CurlWorkqueue::CurlReader& reader, ImageDescriptor& descriptor,
+	std::vector<uint8_t>& localColorTable, uint8_t& minCodeSize)
+{
+	if (co_await reader.read(&descriptor, sizeof(descriptor)) != sizeof(descriptor)) {
+		LOGE("Failed to read Image Descriptor\n");
+		co_return false;
+	}
+
+	LOGD("Image Descriptor: %dx%d at (%d, %d)%s\n",
+		descriptor.width, descriptor.height, descriptor.left, descriptor.top,
+		(descriptor.packedFields & 0x40) ? " interlaced" : "");
+
+	// ローカルカラーテーブルの処理 (必要なら)
+	if (descriptor.packedFields & 0x80) {
+		size_t colorTableSize = 3 * (1 << ((descriptor.packedFields & 0x07) + 1));
+		localColorTable.resize(colorTableSize);
+		if (co_await reader.read(localColorTable.data(), colorTableSize) != colorTableSize) {
+			LOGE("Failed to read Local Color Table\n");
+			co_return false;
+		}
+		LOGD("Local Color Table read successfully\n");
+	}
+	else {
+		localColorTable.clear(); // ローカルカラーテーブルがない場合はクリア
+	}
+
+	// LZW最小コードサイズを読み取る
+	if (co_await reader.read(&minCodeSize, 1) != 1) {
+		LOGE("Failed to read LZW Minimum Code Size\n");
+		co_return false;
+	}
+	LOGD("LZW Minimum Code Size: %d\n", minCodeSize);
+	co_return true;
+}
+
+// 画像データのサブブロックを読んだそばから decoder で展開する。
+// decoder が untilSize バイトまで展開したら、ブロックの途中でも戻る (ended は false のまま)。
+// ブロックの終わりまで読んだら ended を true にする。decoder が nullptr なら展開せずに読み捨て、
+// 展開に失敗したら decoder を nullptr にして残りを読み捨てる。読めなくなったら false。
+// compressed があれば、サブブロックの中身をつなげて後ろに足していく (展開しない分も含む)
+unifex::task<bool> readImageData(CurlWorkqueue::CurlReader& reader, GifLZWDecoder*& decoder, std::vector<uint8_t>& subBlock,
+	bool& ended, size_t untilSize = SIZE_MAX, std::vector<uint8_t>* compressed = nullptr)
+{
+	subBlock.resize(255);
+	while (true) {
+		uint8_t blockSize;
+		if (co_await reader.read(&blockSize, 1) != 1) {
+			LOGE("Failed to read block size\n");
+			co_return false;
+		}
+		if (blockSize == 0) {
+			ended = true; // ブロック終了
+			co_return true;
+		}
+		const bool decode = decoder && !decoder->done();
+		if (!decode && !compressed) {
+			// 展開しないか、フレームの画素数を超える分
+			if (co_await reader.skip(blockSize) != blockSize) {
+				LOGE("Failed to skip block data\n");
+				co_return false;
+			}
+			continue;
+		}
+		uint8_t* data = subBlock.data();
+		if (compressed) {
+			size_t offset = compressed->size();
+			compressed->resize(offset + blockSize);
+			data = compressed->data() + offset;
+		}
+		if (co_await reader.read(data, blockSize) != blockSize) {
+			LOGE("Failed to read block data\n");
+			co_return false;
+		}
+		if (!decode) {
+			continue;
+		}
+		try {
+			decoder->feed(data, blockSize);
+		}
+		catch (const std::exception& e) {
+			LOGE("LZW decode error: %s\n", e.what());
+			decoder = nullptr;
+			continue;
+		}
+		if (decoder->size() >= untilSize) {
+			co_return true;
+		}
+	}
+}
+
+// 表示側にフレームを渡す。frames があれば積んで表示は play_frames() に任せ、
+// なければメインスレッドで delay だけ待って表示する。ネットワークスレッドで戻る。打ち切られたら false
+unifex::task<bool> presentFrame(const IndexedImage& image, std::optional<std::chrono::milliseconds> delay,
+	CurlWorkqueue& wq, FrameQueue* frames, int taskIndex, const StreamOptions& options)
+{
+	if (frames) {
+		// 表示側が追いつくまで待つ。表示側が止まっていれば打ち切る
+		if (!co_await frames->waitForSpace(wq)) {
+			co_return false;
+		}
+		FrameQueue::Frame& frame = frames->back();
+		frame.image = image;
+		frame.delay = delay;
+		frames->push();
+		co_return !options.expired();
+	}
+
+	auto due = mainWQClock().now();
+	if (delay) {
+		due += *delay;
+		co_await sheduleOnMainWQ(*delay, options.stopToken, options.priority);
+	}
+	else {
+		co_await sheduleOnMainWQ(options.priority);
+	}
+	if (!options.expired()) {
+		g_frameLateness.record(options.priority, mainWQClock().now() - due);
+		TRACE_SCOPE("SetImage");
+		SetImage(image, taskIndex);
+	}
+	// 読み込みはネットワークスレッドに戻ってから続ける
+	co_await shedule(wq, options.priority);
+	co_return !options.expired();
+}
+
+unifex::task<void> readGraphicsControlExtension(CurlWorkqueue::CurlReader& reader, GraphicControlExtension& gce)
+{
+	// グラフィック制御拡張ブロックを読み取る
+	LOGD("Reading Graphic Control Extension Block\n");
+	uint8_t blockSize;
+	if ((co_await reader.read(&blockSize, 1)) != 1 || blockSize != 4) {
+		LOGE("Invalid Graphic Control Extension Block size\n");
+		co_return;
+	}
+	if ((co_await reader.read(&gce, sizeof(gce))) != sizeof(gce)) {
+		LOGE("Failed to read Graphic Control Extension\n");
+		co_return;
+	}
+	uint8_t terminator;
+	if ((co_await reader.read(&terminator, 1)) != 1 || terminator != 0) {
+		LOGE("Invalid Graphic Control Extension terminator\n");
+		co_return;
+	}
+	LOGD("Graphic Control Extension: delayTime=%d, transparentColorIndex=%d\n",
+		gce.delayTime, gce.transparentColorIndex);
+}
+
+unifex::task<void> readExtensionBlock(CurlWorkqueue::CurlReader& reader)
+{
+	// サブブロックをスキップ (受信バッファから写さない)
+	while (true) {
+		uint8_t subBlockSize;
+		if ((co_await reader.read(&subBlockSize, 1)) != 1) {
+			LOGE("Failed to read sub-block size\n");
+			co_return;
+		}
+		if (subBlockSize == 0) {
+			break; // サブブロック終了
+		}
+		if ((co_await reader.skip(subBlockSize)) != subBlockSize) {
+			LOGE("Failed to skip sub-block data\n");
+			co_return;
+		}
+	}
+}
+
+// loopCount があれば NETSCAPE 拡張のループ回数を入れる
+unifex::task<void> handlApplicationExtensionBlock(CurlWorkqueue::CurlReader& reader, std::optional<uint16_t>* loopCount = nullptr)
+{
+	// アプリケーション拡張ブロック
+	LOGD("Application Extension Block found\n");
+
+	// ブロックサイズを読み取る
+	uint8_t blockSize;
+	if ((co_await reader.read(&blockSize, 1)) != 1 || blockSize != 0x0B) {
+		LOGE("Invalid Application Extension Block size\n");
+		co_return;
+	}
+
+	// アプリケーション識別子と認識コードを読み取る
+	char appIdentifier[8 + 1] = { 0 };
+	char appAuthCode[3 + 1] = { 0 };
+	if ((co_await reader.read(appIdentifier, 8)) != 8 ||
+		(co_await reader.read(appAuthCode, 3)) != 3) {
+		LOGE("Failed to read Application Extension Block identifiers\n");
+		co_return;
+	}
+
+	LOGD("Application Identifier: %s\n", appIdentifier);
+	LOGD("Application Authentication Code: %s\n", appAuthCode);
+
+	// データサブブロックを読み取る (解析に使うのは先頭の数バイトだけなので残りは数えるだけ)
+	uint8_t appData[3] = { 0 };
+	size_t appDataSize = 0;
+	while (true) {
+		uint8_t subBlockSize;
+		if ((co_await reader.read(&subBlockSize, 1)) != 1) {
+			LOGE("Failed to read sub-block size\n");
+			co_return;
+		}
+		if (subBlockSize == 0) {
+			break; // サブブロック終了
+		}
+
+		uint8_t subBlock[255];
+		if ((co_await reader.read(subBlock, subBlockSize)) != subBlockSize) {
+			LOGE("Failed to read sub-block data\n");
+			co_return;
+		}
+		for (size_t i = 0; i < subBlockSize && appDataSize + i < sizeof(appData); ++i) {
+			appData[appDataSize + i] = subBlock[i];
+		}
+		appDataSize += subBlockSize;
+	}
+
+	LOGD("Application Extension Block data size: %zu bytes\n", appDataSize);
+
+	// 必要に応じてアプリケーションデータを解析
+	// 例: "NETSCAPE2.0" の場合、ループ制御情報が含まれる
+	if (std::string(appIdentifier) == "NETSCAPE") {
+		LOGD("NETSCAPE Application Extension detected\n");
+		if (appDataSize >= 3 && appData[0] == 0x01) {
+			const uint16_t count = static_cast<uint16_t>(appData[1] | (appData[2] << 8));
+			if (loopCount) {
+				*loopCount = count;
+			}
+			if (count == 0) {
+				LOGD("Loop Count: Infinite\n");
+			}
+			else {
+				LOGD("Loop Count: %d\n", count);
+			}
+		}
+		else {
+			LOGE("Invalid NETSCAPE Application Extension data\n");
+		}
+	}
+}
+
+// 1周分を再生する。ctx を作ったネットワークスレッドで呼ぶこと。
+// frames があればフレームはそこに渡して表示は play_frames() に任せ、なければここで表示まで待つ
+// 終端まで読めたら true
+unifex::task<bool> curl_task_once(StreamContext& ctx, CurlWorkqueue& wq, const char* url, int taskIndex, const StreamOptions& options,
+	FrameQueue* frames = nullptr)
+{
+	auto& reader = ctx.reader;
+	reader.setPriority(options.priority);
+	reader.setMaxRecvSpeed(options.maxRecvSpeed);
+	reader.open(url);
+	if (options.readTimeout.count() > 0) {
+		reader.setReadTimeout(options.readTimeout);
+	}
+	if (options.deadline) {
+		reader.setDeadline(*options.deadline);
+	}
+
+	GIFHeader header;
+	if ((co_await reader.read(&header, sizeof(header))) != sizeof(header)) {
+		LOGE("Failed to read GIF header\n");
+		co_return false;
+	}
+
+	LogicalScreenDescriptor lsd;
+	if ((co_await reader.read(&lsd, sizeof(lsd))) != sizeof(lsd)) {
+		LOGE("Failed to read Logical Screen Descriptor\n");
+		co_return false;
+	}
+
+	if (lsd.width == 0 || lsd.height == 0) {
+		LOGE("Invalid Logical Screen size: %dx%d\n", lsd.width, lsd.height);
+		co_return false;
+	}
+
+	// 表示サイズが小さければ、パレット展開前にインデックスのまま縮小して合成する
+	int width = lsd.width;
+	int height = lsd.height;
+	int targetWidth = width;
+	int targetHeight = height;
+	if (GetTargetImageSize(taskIndex, targetWidth, targetHeight)) {
+		width = std::clamp(targetWidth, 1, width);
+		height = std::clamp(targetHeight, 1, height);
+	}
+	// 縮小しないときは対応表を空にしておく
+	std::vector<int>& xMap = ctx.xMap;
+	std::vector<int>& yMap = ctx.yMap;
+	if (width != lsd.width || height != lsd.height) {
+		buildScaleMap(lsd.width, width, xMap);
+		buildScaleMap(lsd.height, height, yMap);
+	}
+	else {
+		xMap.clear();
+		yMap.clear();
+	}
+
+	// 同じパレットが続く間は 8bit インデックスのまま合成し、混ざったら ARGB に切り替える
+	IndexedImage& image = ctx.image;
+	image.reset(width, height);
+	// 上限の判定が最初のフレームを待たないように、キャンバスを確保した時点で数える
+	ctx.updateMemory(frames);
+	bool imageHasEmpty = true; // まだ何も描かれていない画素が残っているかもしれない
+
+	// 再エンコードの出力段。表示と同じキャンバスを差分で書き出す。終端まで届かずに抜けたら、書きかけの出力は close() されずに捨てられる
+	std::unique_ptr<GifWriter> output;
+	std::optional<GifEncoder> encoder;
+	CanvasBuffer<uint32_t>& encoderCanvas = ctx.encoderCanvas;
+	if (options.openOutput) {
+		output = options.openOutput(taskIndex);
+		if (output) {
+			encoder.emplace(*output, width, height);
+		}
+	}
+
+	// グローバルカラーテーブルの存在を確認
+	std::vector<uint8_t>& globalColorTable = ctx.globalColorTable;
+	globalColorTable.clear();
+	if (lsd.packedFields & 0x80) { // グローバルカラーテーブルが存在するか確認
+		size_t colorTableSize = 3 * (1 << ((lsd.packedFields & 0x07) + 1));
+		globalColorTable.resize(colorTableSize);
+		if ((co_await reader.read(globalColorTable.data(), colorTableSize)) != colorTableSize) {
+			LOGE("Failed to read Global Color Table\n");
+			co_return false;
+		}
+	}
+
+	std::optional<GraphicControlExtension> gce;
+	while (true) {
+		uint8_t blockType;
+		if ((co_await reader.read(&blockType, 1)) != 1) {
+			if (reader.cancelled()) {
+				LOGI("Stream cancelled: %s\n", url);
+			}
+			else {
+				LOGE("Failed to read block type\n");
+			}
+			co_return false;
+		}
+
+		if (blockType == 0x3B) { // 終端バイト
+			LOGI("End of GIF file\n");
+			if (encoder) {
+				encoder->finish();
+				if (!output->close()) {
+					LOGE("Failed to write the re-encoded GIF\n");
+					co_return false;
+				}
+				LOGI("Re-encoded %zu frames, %zu bytes\n", encoder->frames(), encoder->bytesWritten());
+			}
+			break;
+		}
+		else if (blockType == 0x2C) { // 画像ブロック
+			LOGD("Image block found\n");
+			ImageDescriptor descriptor;
+			uint8_t minCodeSize;
+			std::vector<uint8_t>& localColorTable = ctx.localColorTable;
+			if (!co_await readImageHeader(reader, descriptor, localColorTable, minCodeSize)) {
+				co_return false;
+			}
+			const std::vector<uint8_t>& colorTable = localColorTable.empty() ? globalColorTable : localColorTable;
+			int transparentColorIndex = -1;
+			if (gce && (gce->packedFields & 0x1)) {
+				transparentColorIndex = gce->transparentColorIndex;
+			}
+			std::optional<std::chrono::milliseconds> delay;
+			if (gce) {
+				delay = std::chrono::milliseconds(gce->delayTime * 10);
+			}
+			// 表示の遅延は、このフレームで最初に表示するもの (プレビューか完成したフレーム) の前に待つ
+			std::optional<std::chrono::milliseconds> presentDelay = delay;
+
+			// 空のフレームはデコードせずに捨てる。フレームの画素数を超える出力も捨てる
+			const bool interlaced = (descriptor.packedFields & 0x40) != 0;
+			const size_t pixelCount = static_cast<size_t>(descriptor.width) * descriptor.height;
+			std::vector<uint8_t>& imageData = ctx.imageData;
+			GifLZWDecoder* decoder = nullptr;
+			if (pixelCount == 0) {
+				LOGW("Empty image: %dx%d\n", descriptor.width, descriptor.height);
+			}
+			else {
+				try {
+					ctx.decoder.reset(minCodeSize, pixelCount, imageData, pixelCount);
+					decoder = &ctx.decoder;
+				}
+				catch (const std::exception& e) {
+					LOGE("LZW decode error: %s\n", e.what());
+				}
+			}
+
+			// インターレースのフレームはパスが終わるたびに、残りがまだ届いていなければ途中の画像を表示する。
+			// 全部届いていれば途中の画像は出さないので、ふつうのフレームとして扱う
+			const bool progressive = interlaced && options.progressive && !options.onFrame && !reader.done();
+			// キャッシュを引くフレームは圧縮データを最後まで読んでから展開する (同じものがあれば展開しない)。
+			// 途中の画像を出すフレームは読みながら展開し、できたものを登録だけする
+			FrameCache* cache = decoder ? options.frameCache : nullptr;
+			std::vector<uint8_t>* compressed = cache ? &ctx.compressed : nullptr;
+			if (compressed) {
+				compressed->clear();
+			}
+			const bool deferred = cache && !progressive;
+			GifLZWDecoder* streaming = deferred ? nullptr : decoder;
+			bool ended = false;
+			for (int pass = 0; !ended; ++pass) {
+				size_t untilSize = SIZE_MAX;
+				if (progressive && pass < 3) {
+					untilSize = interlacedRowsThroughPass(pass, descriptor.height) * descriptor.width;
+				}
+				if (!co_await readImageData(reader, streaming, ctx.subBlock, ended, untilSize, compressed)) {
+					co_return false;
+				}
+				if (ended || !streaming || streaming->size() == 0 || reader.done() || (frames && frames->size() > 0)) {
+					continue;
+				}
+				// 残りがもう届いていそうなら、途中の画像は出さずにそのまま完成させる (ここまでの圧縮率で見積もる)
+				uint64_t remaining = static_cast<uint64_t>(streaming->inputSize()) * (pixelCount - streaming->size()) / streaming->size();
+				if (reader.available() >= remaining) {
+					continue;
+				}
+				TRACE_SCOPE("interlace preview");
+				size_t rows = deinterlace(imageData.data(), streaming->size() / descriptor.width,
+					descriptor.width, descriptor.height, ctx.deinterlaced);
+				bool previewHasEmpty = imageHasEmpty;
+				ctx.preview = image;
+				composeFrame(ctx.preview, previewHasEmpty, descriptor, ctx.deinterlaced.data(), rows,
+					colorTable, transparentColorIndex, lsd.width, lsd.height, xMap, yMap);
+				if (!co_await presentFrame(ctx.preview, std::exchange(presentDelay, std::nullopt), wq, frames, taskIndex, options)) {
+					LOGI("Stream cancelled: %s\n", url);
+					co_return false;
+				}
+			}
+
+			// ここから合成までは中断しないので、かかった時間をこのフレームの展開と合成のコストとする
+			const auto decodeStart = std::chrono::steady_clock::now();
+			uint64_t hash = 0;
+			std::shared_ptr<const DecodedFrame> cached;
+			// サブブロックがひとつもないフレームは展開しても何も出てこないので、キャッシュを引かずに登録もしない
+			if (cache && compressed->empty()) {
+				cache = nullptr;
+			}
+			if (cache) {
+				hash = FrameCache::hash(compressed->data(), compressed->size());
+			}
+			if (deferred) {
+				if (cache) {
+					cached = cache->find(*compressed, hash, minCodeSize, descriptor.width, descriptor.height, interlaced);
+				}
+				if (!cached) {
+					TRACE_SCOPE("decode");
+					try {
+						decoder->feed(compressed->data(), compressed->size());
+					}
+					catch (const std::exception& e) {
+						LOGE("LZW decode error: %s\n", e.what());
+						decoder = nullptr;
+					}
+				}
+			}
+			else {
+				decoder = streaming;
+			}
+			if (!cached && decoder) {
+				try {
+					decoder->finish();
+				}
+				catch (const std::exception& e) {
+					LOGE("LZW decode error: %s\n", e.what());
+					decoder = nullptr;
+				}
+			}
+			if (!cached && !decoder) {
+				LOGW("No image data found\n");
+				continue;
+			}
+
+			const uint8_t* pixels;
+			size_t rows;
+			if (cached) {
+				pixels = cached->pixels.data();
+				rows = cached->rows;
+			}
+			else {
+				LOGD("Image data size: %zu bytes\n", imageData.size());
+				pixels = imageData.data();
+				rows = imageData.size() / descriptor.width; // 途中で切れたデータは完全な行だけ使う
+				if (interlaced) {
+					rows = deinterlace(pixels, rows, descriptor.width, descriptor.height, ctx.deinterlaced);
+					pixels = ctx.deinterlaced.data();
+				}
+				if (cache) {
+					cache->insert(*compressed, hash, minCodeSize, descriptor.width, descriptor.height, interlaced, pixels, rows);
+				}
+			}
+			composeFrame(image, imageHasEmpty, descriptor, pixels, rows,
+				colorTable, transparentColorIndex, lsd.width, lsd.height, xMap, yMap);
+			if (encoder) {
+				TRACE_SCOPE("encode");
+				encoderCanvas.resize(static_cast<size_t>(width) * height);
+				image.toARGB(encoderCanvas.data());
+				encoder->addFrame(encoderCanvas.data(), gce ? gce->delayTime : 0);
+				if (!output->ok()) {
+					LOGE("Failed to write the re-encoded GIF\n");
+					co_return false;
+				}
+			}
+			if (options.governed) {
+				options.governed->recordDecode(std::chrono::steady_clock::now() - decodeStart, delay);
+			}
+			if (options.onFrame) {
+				options.onFrame(image, delay);
+			}
+			else if (!co_await presentFrame(image, presentDelay, wq, frames, taskIndex, options)) {
+				LOGI("Stream cancelled: %s\n", url);
+				co_return false;
+			}
+			gce = std::nullopt;
+			ctx.updateMemory(frames);
+			if (options.expired()) {
+				LOGI("Stream cancelled: %s\n", url);
+				co_return false;
+			}
+		}
+		else if (blockType == 0x21) { // 拡張ブロック
+			uint8_t label;
+			if ((co_await reader.read(&label, 1)) != 1) {
+				LOGE("Failed to read extension label\n");
+				co_return false;
+			}
+			if (label == 0xF9) { // グラフィック制御拡張
+				GraphicControlExtension gce_;
+				co_await readGraphicsControlExtension(reader, gce_);
+				gce = gce_;
+			}
+			else if (label == 0xFE) { // コメント拡張
+				co_await readExtensionBlock(reader);
+			}
+			else if (label == 0x01) { // プレーンテキスト拡張
+				co_await readExtensionBlock(reader);
+			}
+			else if (label == 0xFF) { // アプリケーション拡張
+				co_await handlApplicationExtensionBlock(reader);
+			}
+			else {
+				co_await readExtensionBlock(reader);
+			}
+		}
+		else if (blockType == 0xFF) { // Application拡張ブロック
+			co_await handlApplicationExtensionBlock(reader);
+		}
+		else {
+			LOGW("Unknown block type: 0x%02X\n", blockType);
+			co_return false;
+		}
+	}
+	co_return true;
+}
+
+// 画像ブロックを記述子ごと読み捨てる。descriptor には読んだ記述子が入る
+unifex::task<bool> skipImageBlock(CurlWorkqueue::CurlReader& reader, ImageDescriptor& descriptor)
+{
+	if (co_await reader.read(&descriptor, sizeof(descriptor)) != sizeof(descriptor)) {
+		LOGE("Failed to read Image Descriptor\n");
+		co_return false;
+	}
+	// ローカルカラーテーブルと LZW 最小コードサイズ
+	size_t headerSize = 1;
+	if (descriptor.packedFields & 0x80) {
+		headerSize += 3 * (1 << ((descriptor.packedFields & 0x07) + 1));
+	}
+	if (co_await reader.skip(headerSize) != headerSize) {
+		LOGE("Failed to skip Local Color Table\n");
+		co_return false;
+	}
+	while (true) {
+		uint8_t blockSize;
+		if (co_await reader.read(&blockSize, 1) != 1) {
+			LOGE("Failed to read block size\n");
+			co_return false;
+		}
+		if (blockSize == 0) {
+			co_return true;
+		}
+		if (co_await reader.skip(blockSize) != blockSize) {
+			LOGE("Failed to skip block data\n");
+			co_return false;
+		}
+	}
+}
+
+unifex::task<std::optional<GifInfo>> probe_gif(const char* url, ProbeMode mode, std::chrono::milliseconds timeout,
+	std::function<std::unique_ptr<ByteSource>(const char* url)> openSource)
+{
+	auto lease = g_curlPool->acquire(std::hash<std::string_view>{}(url));
+	co_await shedule(*lease);
+	// FirstFrame で途中で抜けると reader の破棄で転送も打ち切られる
+	CurlWorkqueue::CurlReader reader(*lease, g_stopSource.get_token());
+	if (openSource) {
+		reader.setSource(openSource(url));
+	}
+	// 応答が止まった相手で戻らなくならないように、全体に期限をつける。過ぎたらそこまでの値を返す
+	reader.setDeadline(reader.workqueue().clock().now() + timeout);
+	reader.open(url);
+
+	GIFHeader header;
+	if ((co_await reader.read(&header, sizeof(header))) != sizeof(header) || memcmp(header.signature, "GIF", 3) != 0) {
+		LOGE("Not a GIF: %s\n", url);
+		co_return std::nullopt;
+	}
+	LogicalScreenDescriptor lsd;
+	if ((co_await reader.read(&lsd, sizeof(lsd))) != sizeof(lsd)) {
+		LOGE("Failed to read Logical Screen Descriptor\n");
+		co_return std::nullopt;
+	}
+
+	GifInfo info;
+	info.width = lsd.width;
+	info.height = lsd.height;
+	if (lsd.packedFields & 0x80) {
+		size_t colorTableSize = 3 * (1 << ((lsd.packedFields & 0x07) + 1));
+		if ((co_await reader.skip(colorTableSize)) != colorTableSize) {
+			LOGE("Failed to skip Global Color Table\n");
+			co_return info;
+		}
+	}
+
+	// 途中で読めなくなったら、そこまでの値を complete = false で返す
+	std::optional<GraphicControlExtension> gce;
+	while (true) {
+		uint8_t blockType;
+		if ((co_await reader.read(&blockType, 1)) != 1) {
+			co_return info;
+		}
+
+		if (blockType == 0x3B) { // 終端バイト
+			info.complete = true;
+			co_return info;
+		}
+		else if (blockType == 0x2C) { // 画像ブロック
+			ImageDescriptor descriptor;
+			if (!co_await skipImageBlock(reader, descriptor)) {
+				co_return info;
+			}
+			++info.frameCount;
+			if (gce) {
+				info.duration += std::chrono::milliseconds(gce->delayTime * 10);
+				gce = std::nullopt;
+			}
+			if (mode == ProbeMode::FirstFrame) {
+				co_return info;
+			}
+		}
+		else if (blockType == 0x21) { // 拡張ブロック
+			uint8_t label;
+			if ((co_await reader.read(&label, 1)) != 1) {
+				co_return info;
+			}
+			if (label == 0xF9) { // グラフィック制御拡張
+				GraphicControlExtension gce_;
+				co_await readGraphicsControlExtension(reader, gce_);
+				gce = gce_;
+			}
+			else if (label == 0xFF) { // アプリケーション拡張
+				co_await handlApplicationExtensionBlock(reader, &info.loopCount);
+			}
+			else {
+				co_await readExtensionBlock(reader);
+			}
+		}
+		else {
+			LOGW("Unknown block type: 0x%02X\n", blockType);
+			co_return info;
+		}
+	}
+}
+
+// frames のフレームを遅延時間どおりにメインスレッドで表示する
+unifex::task<void> play_frames(FrameQueue& frames, int taskIndex, const StreamOptions& options)
+{
+	co_await sheduleOnMainWQ(options.priority);
+	// 間引いたフレームの遅延は次に表示するフレームの前に待つので、表示の時刻はずれない
+	std::chrono::milliseconds skippedDelay{ 0 };
+	while (FrameQueue::Frame* frame = co_await frames.waitForFrame()) {
+		if (options.governed && !options.governed->shouldPresent(frames.size() > 1)) {
+			skippedDelay += frame->delay.value_or(std::chrono::milliseconds(0));
+			frames.pop();
+			continue;
+		}
+		std::optional<std::chrono::milliseconds> delay = frame->delay;
+		if (skippedDelay.count() > 0) {
+			delay = delay.value_or(std::chrono::milliseconds(0)) + std::exchange(skippedDelay, std::chrono::milliseconds(0));
+		}
+		auto due = mainWQClock().now();
+		if (delay) {
+			due += *delay;
+			co_await sheduleOnMainWQ(*delay, options.stopToken, options.priority);
+		}
+		else {
+			co_await sheduleOnMainWQ(options.priority);
+		}
+		if (options.expired()) {
+			break;
+		}
+		auto lateness = mainWQClock().now() - due;
+		g_frameLateness.record(options.priority, lateness);
+		auto presentStart = std::chrono::steady_clock::now();
+		{
+			TRACE_SCOPE("SetImage");
+			SetImage(frame->image, taskIndex);
+		}
+		if (options.governed) {
+			options.governed->recordPresent(mainWQClock().now(), lateness, std::chrono::steady_clock::now() - presentStart);
+		}
+		frames.pop();
+	}
+	// デコード側が空き待ちなら起こして終わらせる
+	frames.close();
+}
+
+unifex::task<void> decode_loop(const char* url, int taskIndex, const StreamOptions& options, FrameQueue* frames)
+{
+	const size_t key = std::hash<std::string_view>{}(url);
+	std::optional<CurlWorkqueuePool::Lease> lease;
+	std::unique_ptr<StreamContext> ctx;
+	while (!options.expired()) {
+		// 空いているネットワークスレッドを選び、周回をまたいでそこで ctx を使い回す。
+		// 割り当て先が偏ってきたら周回の切れ目で ctx ごと作り直して移る
+		if (!lease || g_curlPool->saturated(**lease)) {
+			// curl_task_once() はネットワークスレッドで終わるので、前の ctx はここで破棄してよい
+			ctx.reset();
+			lease.reset();
+			lease.emplace(g_curlPool->acquire(key));
+			co_await shedule(**lease, options.priority);
+			ctx = std::make_unique<StreamContext>(**lease, options.stopToken, options.memory);
+			if (options.openSource) {
+				ctx->reader.setSource(options.openSource(url));
+			}
+		}
+		co_await curl_task_once(*ctx, **lease, url, taskIndex, options, frames);
+	}
+	ctx.reset();
+	if (frames) {
+		// 表示側は残りを出し切ってから終わる
+		frames->close();
+	}
+}
+
+// メモリの上限に収まらなければログに出して false
+static bool admit_stream(MemoryBudget::Account& memory, int taskIndex)
+{
+	MemoryBudget& budget = MemoryBudget::instance();
+	if (budget.admit(memory)) {
+		return true;
+	}
+	LOGW("Memory budget exceeded (%.1f of %.1f MB), rejecting stream %d\n",
+		budget.used() / (1024.0 * 1024.0), budget.limit() / (1024.0 * 1024.0), taskIndex);
+	return false;
+}
+
+unifex::task<void> curl_task(const char* url, int taskIndex, StreamOptions options)
+{
+	MemoryBudget::Account memory("stream", taskIndex);
+	if (!admit_stream(memory, taskIndex)) {
+		co_return;
+	}
+	options.memory = &memory;
+	if (options.lookahead == 0) {
+		co_await decode_loop(url, taskIndex, options, nullptr);
+		co_return;
+	}
+	FrameQueue frames(options.lookahead, options.priority);
+	std::optional<FrameGovernor::Stream> governed;
+	if (options.frameGovernor) {
+		governed.emplace(*options.frameGovernor, options.priority);
+		options.governed = &*governed;
+	}
+	co_await unifex::when_all(
+		decode_loop(url, taskIndex, options, &frames),
+		play_frames(frames, taskIndex, options)
+	);
+}
+
+unifex::task<bool> decode_gif(const char* url, int taskIndex, FrameCallback onFrame,
+	std::function<std::unique_ptr<ByteSource>(const char* url)> openSource, MemoryBudget::Account* memory,
+	std::function<std::unique_ptr<GifWriter>(int taskIndex)> openOutput)
+{
+	StreamOptions options;
+	options.stopToken = g_stopSource.get_token();
+	options.onFrame = std::move(onFrame);
+	options.openSource = std::move(openSource);
+	options.openOutput = std::move(openOutput);
+	std::optional<MemoryBudget::Account> ownMemory;
+	if (!memory) {
+		memory = &ownMemory.emplace("file", taskIndex);
+		if (!admit_stream(*memory, taskIndex)) {
+			co_return false;
+		}
+	}
+	options.memory = memory;
+
+	auto lease = g_curlPool->acquire(std::hash<std::string_view>{}(url));
+	co_await shedule(*lease);
+	auto ctx = std::make_unique<StreamContext>(*lease, options.stopToken, options.memory);
+	if (options.openSource) {
+		ctx->reader.setSource(options.openSource(url));
+	}
+	bool complete = co_await curl_task_once(*ctx, *lease, url, taskIndex, options);
+	// reader はネットワークスレッドで破棄する
+	ctx.reset();
+	co_return complete;
+}
+
+// 全ストリームを止める。待機中の読み込みと表示待ちはすぐに抜ける
+void StopStreams()
+{
+	g_stopSource.request_stop();
+}
+
+unifex::task<void> main_task()
+{
+	g_curlPool = new CurlWorkqueuePool();
+
+	const char* urls[] = {
+		"https://upload.wikimedia.org/wikipedia/commons/2/2c/Rotating_earth_%28large%29.gif",
+		"https://media3.giphy.com/media/v1.Y2lkPTc5MGI3NjExd3B1YTh4NzdrcXQ1MGd4Ymxld3c5eWk3MnBwdDdwemlrNXQxOXh0YSZlcD12MV9pbnRlcm5hbF9naWZfYnlfaWQmY3Q9Zw/BfbUe877N4xsUhpcPc/giphy.gif",
+		"https://media0.giphy.com/media/v1.Y2lkPTc5MGI3NjExbTliYmxnbWJtdDBtODI1djI0MnpydmljMmp5eXdrZWdvYjAzdXU4aiZlcD12MV9pbnRlcm5hbF9naWZfYnlfaWQmY3Q9Zw/AGzrIm03v0zQrIVI52/giphy.gif",
+		"https://media4.giphy.com/media/v1.Y2lkPTc5MGI3NjExanN4c3IyYW81OHl0N2VzbG0zcTNkcDdibWJubDFycjBtZWxlcng2NCZlcD12MV9pbnRlcm5hbF9naWZfYnlfaWQmY3Q9Zw/kaVe0g311RVYdGlibZ/giphy.gif",
+	};
+
+	StreamOptions options;
+	options.stopToken = g_stopSource.get_token();
+	options.readTimeout = std::chrono::seconds(30);
+	options.lookahead = 4;
+	options.progressive = true;
+	options.frameCache = &g_frameCache;
+	options.frameGovernor = &g_frameGovernor;
+
+	co_await unifex::when_all(
+		curl_task(urls[0], 0, options),
+		curl_task(urls[1], 1, options),
+		curl_task(urls[2], 2, options),
+		curl_task(urls[3], 3, options)
+	);
+	g_curlPool->stop();
 }
\ No newline at end of file
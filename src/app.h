@@ -1,6 +1,51 @@
-#pragma once
-
-#include <unifex/config.hpp>
-#include <unifex/task.hpp>
-
-unifex::task<void> main_task();
+#pragma once
+
+#include <unifex/config.hpp>
+#include <unifex/task.hpp>
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include "memory_budget.h"
+
+unifex::task<void> main_task();
+
+class IndexedImage;
+class ByteSource;
+class GifWriter;
+
+// デコードしたフレームと表示までの遅延 (GCE がなければ nullopt)
+using FrameCallback = std::function<void(const IndexedImage& image, std::optional<std::chrono::milliseconds> delay)>;
+
+// url を1周だけデコードし、フレームを表示せずに onFrame に渡す。onFrame はネットワークスレッドで呼ばれ、
+// image はその間だけ有効。g_curlPool を作ってから呼ぶこと。終端まで読めたら true (メモリの上限を超えていれば始めずに false)。
+// openSource があれば curl の代わりにそれが返す ByteSource から読む (ネットワークスレッドで呼ばれる)。
+// memory があれば呼び出し側で作って MemoryBudget::admit() を済ませたものとしてそれに数える。
+// openOutput があれば、デコードしたフレームを GIF に再エンコードしてそれが開いた先に書き出す (nullptr なら書き出さない)
+unifex::task<bool> decode_gif(const char* url, int taskIndex, FrameCallback onFrame,
+	std::function<std::unique_ptr<ByteSource>(const char* url)> openSource = {}, MemoryBudget::Account* memory = nullptr,
+	std::function<std::unique_ptr<GifWriter>(int taskIndex)> openOutput = {});
+
+// probe_gif() で分かる GIF の概要
+struct GifInfo {
+	int width = 0;
+	int height = 0;
+	size_t frameCount = 0;
+	std::chrono::milliseconds duration{ 0 }; // 1周分の遅延時間の合計
+	std::optional<uint16_t> loopCount;       // NETSCAPE 拡張のループ回数 (0 なら無限)。なければ1回だけ再生
+	bool complete = false;                   // 終端まで読んだ。false ならフレーム数と時間は途中までの値
+};
+
+enum class ProbeMode {
+	Full,       // 終端まで構造をたどる (画像データは読み捨てる)
+	FirstFrame, // 最初のフレームまでで転送を打ち切る
+};
+
+// LZW をデコードせずにブロック構造だけをたどって概要を調べる。GIF として読めなければ nullopt。
+// timeout を過ぎたら読むのをやめ、そこまでの値を complete = false で返す。
+// openSource があれば curl の代わりにそれが返す ByteSource から読む。ネットワークスレッドで終わる
+unifex::task<std::optional<GifInfo>> probe_gif(const char* url, ProbeMode mode = ProbeMode::Full,
+	std::chrono::milliseconds timeout = std::chrono::seconds(10),
+	std::function<std::unique_ptr<ByteSource>(const char* url)> openSource = {});
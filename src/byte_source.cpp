@@ -0,0 +1,49 @@
+#include "byte_source.h"
+
+#include <algorithm>
+
+ReplaySource::ReplaySource(std::shared_ptr<const Capture> capture)
+	: m_capture(std::move(capture))
+{
+}
+
+void ReplaySource::open(const char* url, CurlWorkqueue::CurlReader& reader)
+{
+	m_reader = &reader;
+	m_next = 0;
+	scheduleNext();
+}
+
+void ReplaySource::scheduleNext()
+{
+	if (m_next == m_capture->size()) {
+		m_reader->finish();
+		return;
+	}
+	// 期限だけで起こす。reader のハンドルに紐づけるので、reader の open() や破棄で一緒に取り消される
+	CurlWorkqueue& wq = m_reader->workqueue();
+	wq.enqueue([](bool) { return false; }, &ReplaySource::deliverNext, this, m_reader->handle(),
+		wq.clock().now() + (*m_capture)[m_next].delay, m_reader->priority());
+}
+
+void ReplaySource::deliverNext(void* context)
+{
+	auto self = static_cast<ReplaySource*>(context);
+	const CapturedChunk& chunk = (*self->m_capture)[self->m_next++];
+	self->m_reader->deliver(chunk.data.data(), chunk.data.size());
+	self->scheduleNext();
+}
+
+std::shared_ptr<const Capture> ReplaySource::split(const std::vector<std::byte>& data, size_t chunkSize,
+	std::chrono::microseconds interval, std::chrono::microseconds firstDelay)
+{
+	auto capture = std::make_shared<Capture>();
+	chunkSize = std::max<size_t>(chunkSize, 1);
+	for (size_t offset = 0; offset < data.size(); offset += chunkSize) {
+		size_t size = std::min(chunkSize, data.size() - offset);
+		capture->push_back(CapturedChunk{
+			offset == 0 ? firstDelay : interval,
+			std::vector<std::byte>(data.begin() + offset, data.begin() + offset + size) });
+	}
+	return capture;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "curl_workqueue.h"
+
+// 受信したチャンクの記録。delay は前のチャンク (最初は open()) からの間隔
+struct CapturedChunk {
+	std::chrono::microseconds delay;
+	std::vector<std::byte> data;
+};
+using Capture = std::vector<CapturedChunk>;
+
+// CurlReader に curl の代わりにデータを渡すもの。
+// open() で転送を始め、届いた分を reader.deliver() で渡し、最後に reader.finish() を呼ぶ。
+// 時刻はすべて reader のネットワークスレッドのクロックで測る。
+class ByteSource {
+public:
+	virtual ~ByteSource() = default;
+
+	// ネットワークスレッドで呼ばれる。前の転送の続きは reader 側で取り消してある
+	virtual void open(const char* url, CurlWorkqueue::CurlReader& reader) = 0;
+};
+
+// 記録したチャンクを同じ間隔で再生する。ソケットを使わないので、
+// SimulatedClock と組み合わせれば遅い回線や途切れる回線の再生を実時間を待たずに再現できる。
+// 1つの Capture を複数のストリームで共有してよい。
+class ReplaySource : public ByteSource {
+public:
+	explicit ReplaySource(std::shared_ptr<const Capture> capture);
+
+	void open(const char* url, CurlWorkqueue::CurlReader& reader) override;
+
+	// data を chunkSize バイトずつ interval おきに届くチャンクに分ける
+	static std::shared_ptr<const Capture> split(const std::vector<std::byte>& data, size_t chunkSize,
+		std::chrono::microseconds interval, std::chrono::microseconds firstDelay = {});
+
+private:
+	void scheduleNext();
+	static void deliverNext(void* context);
+
+	std::shared_ptr<const Capture> m_capture;
+	CurlWorkqueue::CurlReader* m_reader = nullptr;
+	size_t m_next = 0;
+};
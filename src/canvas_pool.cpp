@@ -0,0 +1,296 @@
+#include "canvas_pool.h"
+#include "logger.h"
+
+#include <bit>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+constexpr double MB = 1024.0 * 1024.0;
+constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+const char* const HugePagesNames[] = { "none", "transparent", "explicit" };
+
+size_t roundUpTo(size_t bytes, size_t unit)
+{
+	return (bytes + unit - 1) / unit * unit;
+}
+
+// プロセスのページフォルトの数。major が取れなければ -1
+void pageFaults(int64_t& minor, int64_t& major)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters = {};
+	minor = GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PageFaultCount : -1;
+	major = -1;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	minor = usage.ru_minflt;
+	major = usage.ru_majflt;
+#endif
+}
+
+}
+
+CanvasPool& CanvasPool::instance()
+{
+	// 静的な画像の破棄より先に消えないように破棄しない
+	static CanvasPool* pool = new CanvasPool();
+	return *pool;
+}
+
+CanvasPool::CanvasPool()
+	: m_account("canvas pool")
+{
+	if (const char* spec = getenv("TKF25_CANVAS_POOL")) {
+		configure(spec);
+	}
+}
+
+bool CanvasPool::configure(const char* spec)
+{
+	size_t limit;
+	HugePages hugePages;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		limit = m_limit;
+		hugePages = m_hugePages;
+	}
+
+	const char* p = spec;
+	while (*p) {
+		if (*p == ' ' || *p == ';') {
+			++p;
+			continue;
+		}
+		const char* end = p + strcspn(p, " ;");
+		const char* equals = static_cast<const char*>(memchr(p, '=', end - p));
+		bool valid = false;
+		if (equals) {
+			std::string key(p, equals);
+			std::string value(equals + 1, end);
+			if (key == "limit") {
+				valid = parseByteSize(value.c_str(), limit);
+			}
+			else if (key == "hugepages") {
+				for (size_t i = 0; i < std::size(HugePagesNames); ++i) {
+					if (value == HugePagesNames[i]) {
+						hugePages = static_cast<HugePages>(i);
+						valid = true;
+					}
+				}
+			}
+		}
+		if (!valid) {
+			LOGE("Invalid canvas pool: %s\n", spec);
+			return false;
+		}
+		p = end;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_limit = limit;
+	m_hugePages = hugePages;
+	trim(m_limit);
+	LOGI("Canvas pool: keeps up to %.1f MB, huge pages %s\n", limit / MB, HugePagesNames[static_cast<size_t>(hugePages)]);
+	return true;
+}
+
+void* CanvasPool::allocate(size_t bytes, size_t& capacity)
+{
+	// release() は capacity で見分けるので、切り上げたあとの大きさで決める
+	if (roundUpTo(bytes, Alignment) < MinPooledBytes) {
+		capacity = roundUpTo(bytes, Alignment);
+		return ::operator new(capacity, std::align_val_t(Alignment));
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	void* block = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		capacity = roundUp(bytes);
+		++m_stats.allocations;
+		auto it = m_free.find(capacity);
+		if (it != m_free.end() && !it->second.empty()) {
+			block = it->second.back();
+			it->second.pop_back();
+			m_stats.pooledBytes -= capacity;
+			++m_stats.reused;
+			m_account.update(MemoryCategory::Canvas, m_stats.pooledBytes);
+		}
+	}
+	bool fromSystem = !block;
+	bool huge = false;
+	if (fromSystem) {
+		// OS からの確保はロックの外で行う
+		block = systemAllocate(capacity, huge);
+	}
+
+	const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (fromSystem) {
+		++m_stats.systemAllocations;
+		m_stats.hugePageBlocks += huge;
+		m_stats.systemBytes += capacity;
+	}
+	m_stats.allocationNanoseconds += elapsed;
+	m_stats.maxAllocationNanoseconds = std::max(m_stats.maxAllocationNanoseconds, elapsed);
+	return block;
+}
+
+void CanvasPool::release(void* block, size_t capacity)
+{
+	if (capacity < MinPooledBytes) {
+		::operator delete(block, std::align_val_t(Alignment));
+		return;
+	}
+
+	// 取っておく分も MemoryBudget に数えるので、上限があればそれを超えない分だけ取っておく
+	MemoryBudget& budget = MemoryBudget::instance();
+	const bool withinBudget = budget.limit() == 0 || budget.used() + capacity <= budget.limit();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (withinBudget && m_stats.pooledBytes + capacity <= m_limit) {
+			m_free[capacity].push_back(block);
+			m_stats.pooledBytes += capacity;
+			m_account.update(MemoryCategory::Canvas, m_stats.pooledBytes);
+			return;
+		}
+	}
+	systemRelease(block, capacity);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_stats.systemReleases;
+	m_stats.systemBytes -= capacity;
+}
+
+CanvasPool::Stats CanvasPool::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+void CanvasPool::report()
+{
+	Stats stats = this->stats();
+	int64_t minorFaults, majorFaults;
+	pageFaults(minorFaults, majorFaults);
+	LOGI("Canvas pool: %llu allocations, %.1f%% reused, %llu from the system (%llu huge), %.1f us avg, %.1f us max\n",
+		static_cast<unsigned long long>(stats.allocations),
+		stats.allocations ? 100.0 * stats.reused / stats.allocations : 0.0,
+		static_cast<unsigned long long>(stats.systemAllocations), static_cast<unsigned long long>(stats.hugePageBlocks),
+		stats.allocations ? stats.allocationNanoseconds / 1000.0 / stats.allocations : 0.0,
+		stats.maxAllocationNanoseconds / 1000.0);
+	LOGI("Canvas pool: %.1f MB mapped, %.1f MB pooled; page faults %lld minor, %lld major\n",
+		stats.systemBytes / MB, stats.pooledBytes / MB, static_cast<long long>(minorFaults), static_cast<long long>(majorFaults));
+}
+
+void CanvasPool::trim(size_t limit)
+{
+	for (auto it = m_free.rbegin(); it != m_free.rend() && m_stats.pooledBytes > limit; ++it) {
+		while (!it->second.empty() && m_stats.pooledBytes > limit) {
+			systemRelease(it->second.back(), it->first);
+			it->second.pop_back();
+			m_stats.pooledBytes -= it->first;
+			m_stats.systemBytes -= it->first;
+			++m_stats.systemReleases;
+		}
+	}
+	m_account.update(MemoryCategory::Canvas, m_stats.pooledBytes);
+}
+
+size_t CanvasPool::roundUp(size_t bytes) const
+{
+	// 2 のべきの間を 4 つに分けるので、切り上げで増えるのは 25% まで
+	size_t capacity = roundUpTo(bytes, std::bit_floor(bytes) / 4);
+	if (m_hugePages != HugePages::None && capacity >= HugePageSize) {
+		capacity = roundUpTo(capacity, HugePageSize);
+	}
+	return capacity;
+}
+
+void* CanvasPool::systemAllocate(size_t bytes, bool& huge)
+{
+	HugePages hugePages;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		hugePages = m_hugePages;
+	}
+
+	void* block = nullptr;
+	huge = false;
+#ifdef _WIN32
+	if (hugePages == HugePages::Explicit) {
+		// SeLockMemoryPrivilege がなければ失敗するので普通のページにする
+		size_t largePage = GetLargePageMinimum();
+		if (largePage != 0 && bytes % largePage == 0) {
+			block = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			huge = block != nullptr;
+		}
+	}
+	if (!block) {
+		block = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+#else
+	if (hugePages == HugePages::Explicit && bytes % HugePageSize == 0) {
+		// 予約されたヒュージページが足りなければ失敗するので普通のページにする
+		void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mapped != MAP_FAILED) {
+			block = mapped;
+			huge = true;
+		}
+		else {
+			static std::once_flag warned;
+			std::call_once(warned, [] { LOGW("No explicit huge pages available, using normal pages\n"); });
+		}
+	}
+	if (!block && hugePages == HugePages::Transparent && bytes >= HugePageSize) {
+		// 透過的なヒュージページは 2MB 境界からしか使われないので、余分に取って境界にそろえる
+		void* mapped = mmap(nullptr, bytes + HugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped != MAP_FAILED) {
+			uint8_t* begin = static_cast<uint8_t*>(mapped);
+			uint8_t* aligned = reinterpret_cast<uint8_t*>(roundUpTo(reinterpret_cast<uintptr_t>(begin), HugePageSize));
+			if (aligned != begin) {
+				munmap(begin, aligned - begin);
+			}
+			munmap(aligned + bytes, begin + HugePageSize - aligned);
+			block = aligned;
+			huge = madvise(block, bytes, MADV_HUGEPAGE) == 0;
+		}
+	}
+	if (!block) {
+		void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapped != MAP_FAILED) {
+			block = mapped;
+		}
+	}
+#endif
+	if (!block) {
+		LOGE("Failed to allocate %.1f MB for a canvas\n", bytes / MB);
+		throw std::bad_alloc();
+	}
+	return block;
+}
+
+void CanvasPool::systemRelease(void* block, size_t bytes)
+{
+#ifdef _WIN32
+	VirtualFree(block, 0, MEM_RELEASE);
+#else
+	munmap(block, bytes);
+#endif
+}
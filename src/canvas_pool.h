@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "memory_budget.h"
+
+// 大きなバッファの裏付けに使うページ
+enum class HugePages {
+	None,        // 普通のページ
+	Transparent, // 2MB 以上のバッファに透過的なヒュージページを勧める (Linux の MADV_HUGEPAGE)
+	Explicit,    // 明示的なヒュージページ (MAP_HUGETLB / MEM_LARGE_PAGES)。確保できなければ普通のページ
+};
+
+// キャンバスやフレームの写しのような、画像 1 枚分の大きなバッファをストリームや周回をまたいで使い回す。
+// Alignment に切り上げて MinPooledBytes 以上になるものは、2 のべきを 4 つに分けたサイズクラスに切り上げ、OS から直接確保する。
+// 返されたバッファはクラスごとに取っておき、同じクラスの次の確保に渡すので、
+// 次のストリームやファイルでもページフォルトと mmap/munmap が起きない。
+// 取っておく量が limit を超える分は OS に返す。どのバッファも Alignment にそろえる。
+// 設定は "limit=64M hugepages=transparent" のように書く (hugepages は none, transparent, explicit)。
+// limit=0 なら取っておかない。環境変数 TKF25_CANVAS_POOL があれば最初に読む
+class CanvasPool {
+public:
+	static constexpr size_t Alignment = 64; // SIMD でまとめて読み書きできるように
+	static constexpr size_t MinPooledBytes = 64 * 1024; // これより小さいものは普通のヒープから取る
+
+	struct Stats {
+		uint64_t allocations = 0;       // MinPooledBytes 以上の確保
+		uint64_t reused = 0;            // そのうち取っておいたものを渡した数
+		uint64_t systemAllocations = 0; // OS から確保した数
+		uint64_t hugePageBlocks = 0;    // そのうちヒュージページを使った (勧めた) 数
+		uint64_t systemReleases = 0;    // OS に返した数
+		uint64_t allocationNanoseconds = 0; // 確保にかかった時間の合計
+		uint64_t maxAllocationNanoseconds = 0;
+		size_t pooledBytes = 0;         // 取っておいているバイト数
+		size_t systemBytes = 0;         // OS から確保して返していないバイト数
+	};
+
+	static CanvasPool& instance();
+
+	// spec を読んで以降の確保に使う。書式が正しくなければ何も変えずに false
+	bool configure(const char* spec);
+
+	// bytes 以上のバッファを確保して、実際の大きさを capacity に返す
+	void* allocate(size_t bytes, size_t& capacity);
+	// allocate() が返したバッファと capacity を返す
+	void release(void* block, size_t capacity);
+
+	Stats stats();
+	// stats() とプロセスのページフォルトの数をログに出す
+	void report();
+
+private:
+	CanvasPool();
+
+	// 取っておく量を limit 以下にして、あふれたものを OS に返す。m_mutex を持って呼ぶ
+	void trim(size_t limit);
+	size_t roundUp(size_t bytes) const;
+	// 以下は m_stats を数えない
+	void* systemAllocate(size_t bytes, bool& huge);
+	void systemRelease(void* block, size_t bytes);
+
+	std::mutex m_mutex; // 以下を守る
+	size_t m_limit = 64 * 1024 * 1024;
+	HugePages m_hugePages = HugePages::Transparent;
+	std::map<size_t, std::vector<void*>> m_free; // サイズクラスごとの返されたバッファ
+	Stats m_stats;
+	MemoryBudget::Account m_account; // 取っておいているバッファ
+};
+
+// CanvasPool から取る T の配列。std::vector と違い、大きくするときは中身を残さない。
+// 小さくしても容量は手放さないので、同じ大きさで使い回す間は確保が起きない
+template <class T>
+class CanvasBuffer {
+public:
+	CanvasBuffer() = default;
+	~CanvasBuffer()
+	{
+		if (m_data) {
+			CanvasPool::instance().release(m_data, m_capacity * sizeof(T));
+		}
+	}
+
+	CanvasBuffer(const CanvasBuffer&) = delete;
+	CanvasBuffer& operator=(const CanvasBuffer&) = delete;
+	CanvasBuffer(CanvasBuffer&& rhs) noexcept
+		: m_data(std::exchange(rhs.m_data, nullptr))
+		, m_size(std::exchange(rhs.m_size, 0))
+		, m_capacity(std::exchange(rhs.m_capacity, 0))
+	{
+	}
+	CanvasBuffer& operator=(CanvasBuffer&& rhs) noexcept
+	{
+		CanvasBuffer(std::move(rhs)).swap(*this);
+		return *this;
+	}
+
+	void swap(CanvasBuffer& rhs) noexcept
+	{
+		std::swap(m_data, rhs.m_data);
+		std::swap(m_size, rhs.m_size);
+		std::swap(m_capacity, rhs.m_capacity);
+	}
+
+	T* data() { return m_data; }
+	const T* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	size_t capacity() const { return m_capacity; }
+	bool empty() const { return m_size == 0; }
+
+	// 要素を size 個にする。容量が足りなければ取り直すので、中身は残らない
+	void resize(size_t size)
+	{
+		if (size > m_capacity) {
+			CanvasBuffer().swap(*this);
+			size_t bytes;
+			m_data = static_cast<T*>(CanvasPool::instance().allocate(size * sizeof(T), bytes));
+			m_capacity = bytes / sizeof(T);
+		}
+		m_size = size;
+	}
+	void assign(size_t size, T value)
+	{
+		resize(size);
+		std::fill(m_data, m_data + size, value);
+	}
+	void assign(const T* src, size_t size)
+	{
+		resize(size);
+		std::copy(src, src + size, m_data);
+	}
+	void clear() { m_size = 0; }
+
+private:
+	T* m_data = nullptr;
+	size_t m_size = 0;
+	size_t m_capacity = 0;
+};
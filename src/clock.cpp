@@ -0,0 +1,108 @@
+#include "clock.h"
+
+#include <algorithm>
+
+namespace {
+
+class SystemClock : public WorkqueueClock {
+public:
+	time_point now() const override
+	{
+		return std::chrono::steady_clock::now();
+	}
+
+	void waitUntil(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, time_point schedule) override
+	{
+		cond.wait_until(lock, schedule);
+	}
+};
+
+}
+
+WorkqueueClock& WorkqueueClock::system()
+{
+	// 切り離したスレッドが終了処理中も使うので破棄しない
+	static SystemClock* clock = new SystemClock();
+	return *clock;
+}
+
+SimulatedClock::SimulatedClock(time_point start)
+	: m_now(start.time_since_epoch().count())
+{
+}
+
+SimulatedClock::time_point SimulatedClock::now() const
+{
+	return time_point(duration(m_now.load()));
+}
+
+void SimulatedClock::waitUntil(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, time_point schedule)
+{
+	if (now() >= schedule) {
+		return;
+	}
+
+	Waiter waiter{ &cond, lock.mutex(), schedule };
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		m_waiters.push_back(&waiter);
+	}
+	// 登録より前に進められていたら待たない。登録後の advanceTo() は lock を取ってから起こすので取りこぼさない
+	if (now() < schedule) {
+		cond.wait(lock);
+	}
+
+	// advanceTo() が cond を起こしている途中なら、それが終わるまで Waiter と cond を残す。
+	// advanceTo() は lock を取って起こすので、待つ間は lock を離す (呼ぶ側は戻ったあと状態を見直す)
+	lock.unlock();
+	{
+		std::unique_lock<std::mutex> guard(m_mutex);
+		m_waiters.erase(std::find(m_waiters.begin(), m_waiters.end(), &waiter));
+		m_notified.wait(guard, [&] { return waiter.m_notifying == 0; });
+	}
+	lock.lock();
+}
+
+void SimulatedClock::advanceTo(time_point time)
+{
+	duration::rep current = m_now.load();
+	while (current < time.time_since_epoch().count() && !m_now.compare_exchange_weak(current, time.time_since_epoch().count())) {
+	}
+
+	// 起こし終わるまで待っている側が Waiter を破棄しないように、m_notifying で印を付けておく。
+	// 待っている側は lock を持って m_mutex を取るので、m_mutex を持ったまま lock は取らない
+	std::vector<Waiter*> expired;
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		for (Waiter* waiter : m_waiters) {
+			if (waiter->m_schedule <= now()) {
+				++waiter->m_notifying;
+				expired.push_back(waiter);
+			}
+		}
+	}
+	if (expired.empty()) {
+		return;
+	}
+	for (Waiter* waiter : expired) {
+		std::lock_guard<std::mutex> lock(*waiter->m_mutex);
+		waiter->m_cond->notify_all();
+	}
+	std::lock_guard<std::mutex> guard(m_mutex);
+	for (Waiter* waiter : expired) {
+		--waiter->m_notifying;
+	}
+	m_notified.notify_all();
+}
+
+std::optional<SimulatedClock::time_point> SimulatedClock::nextWakeup()
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	std::optional<time_point> next;
+	for (Waiter* waiter : m_waiters) {
+		if (!next || waiter->m_schedule < *next) {
+			next = waiter->m_schedule;
+		}
+	}
+	return next;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Workqueue と CurlWorkqueue が現在時刻を得て、次のスケジュールまで待つためのクロック。
+// 既定は steady_clock で、テストでは SimulatedClock に差し替えると実時間を待たずに時刻を進められる。
+// 時刻の型は steady_clock と同じなので、スケジュールを持つ側はクロックを差し替えても変わらない。
+class WorkqueueClock {
+public:
+	using time_point = std::chrono::steady_clock::time_point;
+	using duration = std::chrono::steady_clock::duration;
+
+	virtual ~WorkqueueClock() = default;
+
+	virtual time_point now() const = 0;
+	// schedule になるか cond が起こされるまで待つ。lock は cond と組になるもので、持ったまま呼ぶこと
+	virtual void waitUntil(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, time_point schedule) = 0;
+
+	// steady_clock をそのまま使うクロック
+	static WorkqueueClock& system();
+};
+
+// 明示的に進めるまで止まっているクロック。
+// waitUntil() で待っているスレッドは、advance() で時刻が待ち合わせの時刻を過ぎたときに起こされる。
+// 駆動する側は nextWakeup() を見て時刻を飛ばせば、待ち時間なしで何時間分でも再生できる。
+class SimulatedClock : public WorkqueueClock {
+public:
+	explicit SimulatedClock(time_point start = time_point{});
+
+	time_point now() const override;
+	void waitUntil(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, time_point schedule) override;
+
+	void advance(duration delta) { advanceTo(now() + delta); }
+	// 戻ることはない (time が now() より前なら何もしない)
+	void advanceTo(time_point time);
+
+	// 時刻を待っているスレッドの中で最も早い待ち合わせの時刻。誰も待っていなければ nullopt
+	std::optional<time_point> nextWakeup();
+
+private:
+	struct Waiter {
+		std::condition_variable* m_cond;
+		std::mutex* m_mutex;
+		time_point m_schedule;
+		int m_notifying = 0; // advanceTo() が起こしている途中の数。m_mutex で守る
+	};
+
+	std::atomic<duration::rep> m_now;
+	std::mutex m_mutex;
+	std::vector<Waiter*> m_waiters;
+	std::condition_variable m_notified; // advanceTo() が起こし終わった
+};
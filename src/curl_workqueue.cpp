@@ -1,106 +1,368 @@
-#include "curl_workqueue.h"
-
-#include <unordered_set>
-#include <curl/curl.h>
-
-CurlWorkqueue::CurlReader::CurlReader(const char* url, CurlWorkqueue& wq)
-	: m_wq(wq)
-{
-	m_curl = curl_easy_init();
-	curl_easy_setopt(m_curl, CURLOPT_URL, url);
-	curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write_callback);
-	curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
-	curl_easy_setopt(m_curl, CURLOPT_USERAGENT, "tkf/1.0");
-	curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_multi_add_handle(m_wq.multi(), m_curl);
-}
-
-CurlWorkqueue::CurlReader::~CurlReader()
-{
-	curl_multi_remove_handle(m_wq.multi(), m_curl);
-	curl_easy_cleanup(m_curl);
-}
-
-CurlWorkqueue::CurlWorkqueue()
-{
-	m_multi = curl_multi_init();
-}
-
-void CurlWorkqueue::enqueue(Work::Condition&& condition, Work::CoroutineHandle handle, CURL* curl)
-{
-	std::unique_lock<std::mutex> lock(m_mutex);
-	m_queue.emplace_back(std::move(condition), handle, curl);
-	wakeup();
-}
-
-void CurlWorkqueue::enqueue(Work::CoroutineHandle handle)
-{
-	enqueue([](bool) { return true; }, handle, nullptr);
-}
-
-void CurlWorkqueue::wakeup()
-{
-	m_cond.notify_all();
-}
-
-void CurlWorkqueue::run()
-{
-	int running_handles;
-	int numfds;
-	CURLMcode mcode;
-
-	decltype(m_queue) execQueue;
-	std::unordered_set<CURL*> doneHandles;
-
-	while (true) {
-		mcode = curl_multi_perform(m_multi, &running_handles);
-		if (running_handles != 0) {
-			mcode = curl_multi_wait(m_multi, nullptr, 0, 1000, &numfds);
-		}
-
-		struct CURLMsg* m;
-		do {
-			int msgq = 0;
-			m = curl_multi_info_read(m_multi, &msgq);
-			if (m && (m->msg == CURLMSG_DONE)) {
-				CURL* curl = m->easy_handle;
-				doneHandles.insert(curl);
-			}
-		} while (m);
-
-		bool wait = (running_handles == 0);
-		execQueue.clear();
-		{
-			std::unique_lock<std::mutex> lock(m_mutex);
-			if (wait) {
-				if (m_queue.empty()) {
-					// WorkȂ̂Ŗő҂
-					m_cond.wait(lock);
-				}
-			}
-
-			for (auto it = m_queue.begin(); it != m_queue.end();) {
-				bool done = (doneHandles.find(it->m_curl) != doneHandles.end());
-				if (it->m_condition(done)) {
-					execQueue.push_back(std::move(*it));
-					it = m_queue.erase(it);
-				}
-				else {
-					it++;
-				}
-			}
-		}
-
-		// execQueue ̂̂s
-		for (auto& work : execQueue) {
-			work.m_handle.resume();
-		}
-
-		execQueue.clear();
-		doneHandles.clear();
-	}
-}
-
-void CurlWorkqueue::executeExpired(bool wait)
-{
-}
+#include "curl_workqueue.h"
+#include "byte_source.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <curl/curl.h>
+
+CurlWorkqueue::CurlReader::CurlReader(const char* url, CurlWorkqueue& wq, unifex::inplace_stop_token stopToken)
+	: CurlReader(wq, stopToken)
+{
+	open(url);
+}
+
+CurlWorkqueue::CurlReader::CurlReader(CurlWorkqueue& wq, unifex::inplace_stop_token stopToken)
+	: m_wq(wq)
+	, m_stopToken(stopToken)
+{
+	m_curl = curl_easy_init();
+	m_stopCallback.emplace(m_stopToken, WakeUp{ &m_wq });
+}
+
+CurlWorkqueue::CurlReader::~CurlReader()
+{
+	m_stopCallback.reset();
+	// 待機中の Work が残っていると破棄後に this を参照するので取り除く
+	m_wq.cancel(m_curl);
+	std::erase(m_wq.m_resumeReaders, this);
+	if (m_added) {
+		curl_multi_remove_handle(m_wq.multi(), m_curl);
+	}
+	curl_easy_cleanup(m_curl);
+	if (m_account) {
+		m_account->update(MemoryCategory::Reader, 0);
+	}
+}
+
+void CurlWorkqueue::CurlReader::open(const char* url)
+{
+	m_wq.cancel(m_curl);
+	if (m_added) {
+		curl_multi_remove_handle(m_wq.multi(), m_curl);
+		curl_easy_reset(m_curl);
+		m_added = false;
+	}
+	m_paused = false;
+	m_buffer.clear();
+	m_readPos = 0;
+	m_done = false;
+	m_lastChunk = m_wq.clock().now();
+
+	if (m_source) {
+		m_source->open(url, *this);
+		return;
+	}
+
+	// libcurl の file:// は止めると書き込みエラーで終わってしまうので、メモリの上限でも止めない
+	m_pausable = strncmp(url, "file:", 5) != 0;
+	curl_easy_setopt(m_curl, CURLOPT_URL, url);
+	curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, write_callback);
+	curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
+	curl_easy_setopt(m_curl, CURLOPT_PRIVATE, this);
+	curl_easy_setopt(m_curl, CURLOPT_USERAGENT, "tkf/1.0");
+	curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
+	// HTTP/2 で同じ接続を共有しているストリームの間での帯域の配分
+	curl_easy_setopt(m_curl, CURLOPT_STREAM_WEIGHT, m_priority == Priority::Foreground ? 256L : 16L);
+	if (m_maxRecvSpeed > 0) {
+		curl_easy_setopt(m_curl, CURLOPT_MAX_RECV_SPEED_LARGE, static_cast<curl_off_t>(m_maxRecvSpeed));
+	}
+	curl_multi_add_handle(m_wq.multi(), m_curl);
+	m_added = true;
+}
+
+void CurlWorkqueue::CurlReader::setSource(std::unique_ptr<ByteSource> source)
+{
+	m_source = std::move(source);
+}
+
+void CurlWorkqueue::CurlReader::deliver(const void* data, size_t size)
+{
+	// 読み終わった分を詰めてから足す。容量が足りている限り確保しない
+	if (m_readPos == m_buffer.size()) {
+		m_buffer.clear();
+		m_readPos = 0;
+	}
+	else if (m_readPos > 0 && m_buffer.size() + size > m_buffer.capacity()) {
+		m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_readPos);
+		m_readPos = 0;
+	}
+	const std::byte* bytes = static_cast<const std::byte*>(data);
+	m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+	if (m_account && m_buffer.capacity() != m_accountedCapacity) {
+		m_accountedCapacity = m_buffer.capacity();
+		m_account->update(MemoryCategory::Reader, m_accountedCapacity);
+	}
+}
+
+size_t CurlWorkqueue::CurlReader::write(char* ptr, size_t size, size_t nmemb)
+{
+	size_t realSize = size * nmemb;
+	//printf("write:%zd\n", realSize);
+	if (m_account && m_pausable && available() >= PauseThreshold && MemoryBudget::instance().exceeded()) {
+		// curl は渡そうとした分を持ったまま止まり、再開したときにもう一度渡してくる
+		LOGD("Transfer paused: memory budget exceeded, %zu bytes unread\n", available());
+		m_paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	if (m_capture) {
+		capture(ptr, realSize);
+	}
+	deliver(ptr, realSize);
+	return realSize;
+}
+
+void CurlWorkqueue::CurlReader::resume()
+{
+	m_paused = false;
+	curl_easy_pause(m_curl, CURLPAUSE_CONT);
+}
+
+void CurlWorkqueue::CurlReader::setMemoryAccount(MemoryBudget::Account* account)
+{
+	if (m_account) {
+		m_account->update(MemoryCategory::Reader, 0);
+	}
+	m_account = account;
+	m_accountedCapacity = m_buffer.capacity();
+	if (m_account) {
+		m_account->update(MemoryCategory::Reader, m_accountedCapacity);
+	}
+}
+
+void CurlWorkqueue::CurlReader::finish()
+{
+	m_done = true;
+	// 待機中の read() に見直してもらう
+	m_wq.wakeup();
+}
+
+void CurlWorkqueue::CurlReader::capture(const void* data, size_t size)
+{
+	auto now = m_wq.clock().now();
+	const std::byte* bytes = static_cast<const std::byte*>(data);
+	m_capture->push_back(CapturedChunk{
+		std::chrono::duration_cast<std::chrono::microseconds>(now - m_lastChunk),
+		std::vector<std::byte>(bytes, bytes + size) });
+	m_lastChunk = now;
+}
+
+CurlWorkqueue::CurlWorkqueue(WorkqueueClock& clock)
+	: m_clock(&clock)
+{
+	m_multi = curl_multi_init();
+}
+
+void CurlWorkqueue::enqueue(Work::Condition&& condition, Work::CoroutineHandle handle, CURL* curl)
+{
+	enqueue(std::move(condition), &Work::resumeCoroutine, handle.address(), curl);
+}
+
+void CurlWorkqueue::enqueue(Work::Condition&& condition, Work::Function function, void* context, CURL* curl,
+	Work::Clock::time_point deadline, Priority priority)
+{
+	TRACE_FLOW_BEGIN(context);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_free.empty()) {
+		m_queue.splice(m_queue.end(), m_free, m_free.begin());
+		m_queue.back() = Work(std::move(condition), function, context, curl, deadline, priority);
+	}
+	else {
+		m_queue.emplace_back(std::move(condition), function, context, curl, deadline, priority);
+	}
+	if (deadline != Work::noDeadline() && (!m_nextDeadline || deadline < *m_nextDeadline)) {
+		m_nextDeadline = deadline;
+	}
+	wakeup();
+}
+
+void CurlWorkqueue::enqueue(Work::CoroutineHandle handle, Priority priority)
+{
+	enqueue([](bool) { return true; }, &Work::resumeCoroutine, handle.address(), nullptr, Work::noDeadline(), priority);
+}
+
+void CurlWorkqueue::cancel(CURL* curl)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_queue.remove_if([curl](const Work& work) { return work.m_curl == curl; });
+	}
+	// すでに取り出されたものは、実行中のループを崩さないように関数を消すだけにする
+	for (Work& work : m_execQueue) {
+		if (work.m_curl == curl) {
+			work.m_function = nullptr;
+		}
+	}
+}
+
+void CurlWorkqueue::addEventSource(EventSource* source)
+{
+	m_eventSources.push_back(source);
+}
+
+void CurlWorkqueue::removeEventSource(EventSource* source)
+{
+	m_eventSources.erase(std::remove(m_eventSources.begin(), m_eventSources.end(), source), m_eventSources.end());
+}
+
+void CurlWorkqueue::stop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_stopped = true;
+	wakeup();
+}
+
+void CurlWorkqueue::resumeLater(CurlReader& reader)
+{
+	if (std::find(m_resumeReaders.begin(), m_resumeReaders.end(), &reader) == m_resumeReaders.end()) {
+		m_resumeReaders.push_back(&reader);
+	}
+}
+
+void CurlWorkqueue::wakeup()
+{
+	m_pending.store(true);
+	m_cond.notify_all();
+	// curl_multi_poll() で待っている場合も起こす
+	curl_multi_wakeup(m_multi);
+}
+
+int CurlWorkqueue::pollTimeout()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_nextDeadline) {
+		return 1000;
+	}
+	auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(*m_nextDeadline - m_clock->now());
+	return static_cast<int>(std::clamp<int64_t>(timeout.count(), 0, 1000));
+}
+
+void CurlWorkqueue::run()
+{
+	int running_handles;
+	int numfds;
+	CURLMcode mcode;
+
+	std::vector<CURL*> doneHandles;
+	std::vector<curl_waitfd> extraFds;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_stopped) {
+				break;
+			}
+		}
+
+		mcode = curl_multi_perform(m_multi, &running_handles);
+		if (m_eventSources.empty()) {
+			if (running_handles != 0) {
+				mcode = curl_multi_poll(m_multi, nullptr, 0, pollTimeout(), &numfds);
+			}
+		}
+		else {
+			// 完了したものがあれば待たずに Work を見直す
+			bool progressed = false;
+			extraFds.clear();
+			for (EventSource* source : m_eventSources) {
+				progressed |= source->process();
+				extraFds.push_back(curl_waitfd{ source->fd(), CURL_WAIT_POLLIN, 0 });
+			}
+			if (!progressed && !m_pending.load()) {
+				mcode = curl_multi_poll(m_multi, extraFds.data(), static_cast<unsigned>(extraFds.size()), pollTimeout(), &numfds);
+				for (EventSource* source : m_eventSources) {
+					source->process();
+				}
+			}
+		}
+
+		struct CURLMsg* m;
+		do {
+			int msgq = 0;
+			m = curl_multi_info_read(m_multi, &msgq);
+			if (m && (m->msg == CURLMSG_DONE)) {
+				CURL* curl = m->easy_handle;
+				doneHandles.push_back(curl);
+
+				// 転送の終了は待機中の Work がなくても覚えておく
+				CurlReader* reader = nullptr;
+				curl_easy_getinfo(curl, CURLINFO_PRIVATE, &reader);
+				if (reader) {
+					reader->m_done = true;
+				}
+			}
+		} while (m);
+
+		// EventSource があるときは上の curl_multi_poll() で待つ
+		bool wait = (running_handles == 0 && m_eventSources.empty());
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			// 前回 Work を見直したあとに積まれたものや起こされたことがあれば、待たずに見直す
+			if (wait && !m_stopped && !m_pending.load()) {
+				if (m_queue.empty()) {
+					// Workがないので無条件で待つ
+					m_cond.wait(lock);
+				}
+				else if (m_nextDeadline) {
+					// 期限付きの Work があればその時刻まで待つ
+					m_clock->waitUntil(m_cond, lock, *m_nextDeadline);
+				}
+			}
+			m_pending.store(false);
+
+			auto now = m_clock->now();
+			m_nextDeadline = std::nullopt;
+			for (auto it = m_queue.begin(); it != m_queue.end();) {
+				bool done = (std::find(doneHandles.begin(), doneHandles.end(), it->m_curl) != doneHandles.end());
+				if (it->m_condition(done) || it->m_deadline <= now) {
+					auto next = std::next(it);
+					m_execQueue.splice(m_execQueue.end(), m_queue, it);
+					it = next;
+				}
+				else {
+					if (it->m_deadline != Work::noDeadline() && (!m_nextDeadline || it->m_deadline < *m_nextDeadline)) {
+						m_nextDeadline = it->m_deadline;
+					}
+					it++;
+				}
+			}
+		}
+
+		// Work の条件が頼んだ転送の再開。curl が持っていた分が届くので、次の周回で待たずに見直す
+		if (!m_resumeReaders.empty()) {
+			for (CurlReader* reader : m_resumeReaders) {
+				if (reader->m_paused) {
+					reader->resume();
+				}
+			}
+			m_resumeReaders.clear();
+			wakeup();
+		}
+
+		// m_execQueue のものを実行。Background のデコードが溜まっていても Foreground を先に進める
+		for (Priority priority : { Priority::Foreground, Priority::Background }) {
+			for (auto& work : m_execQueue) {
+				// 取り消されたものは飛ばす
+				if (work.m_priority != priority || !work.m_function) {
+					continue;
+				}
+				TRACE_SCOPE("network dispatch");
+				TRACE_FLOW_END(work.m_context);
+				work.execute();
+			}
+		}
+
+		{
+			// ノードは次の enqueue で使い回す
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_free.splice(m_free.end(), m_execQueue);
+		}
+		doneHandles.clear();
+	}
+}
+
+void CurlWorkqueue::executeExpired(bool wait)
+{
+}
@@ -1,213 +1,374 @@
-#pragma once
-
-#pragma once
-
-#include <chrono>
-#include <condition_variable>
-#include <coroutine>
-#include <functional>
-#include <mutex>
-#include <queue>
-
-typedef void CURLM;
-typedef void CURL;
-
-class CurlWorkqueue {
-public:
-	friend class CurlReader;
-	class CurlReader {
-	public:
-		using Buffer = std::vector<std::byte>;
-
-		CurlReader(const char* url, CurlWorkqueue& wq);
-		~CurlReader();
-
-		bool eof() const
-		{
-			return m_done && m_buffers.empty();
-		}
-
-		friend struct ReadAwaiter;
-		struct ReadAwaiter {
-			bool await_ready()
-			{
-				return tryRead();
-			}
-
-			bool await_suspend(std::coroutine_handle<> h)
-			{
-				if (tryRead()) {
-					return false;
-				}
-
-				m_reader.m_wq.enqueue([this](bool done) -> bool {
-					m_reader.m_done = done;
-					if (done) {
-						return true;
-					}
-					return tryRead();
-					}, h, m_reader.m_curl);
-
-				return true;
-			}
-
-			size_t await_resume()
-			{
-				return m_read;
-			}
-
-			bool tryRead()
-			{
-				if (m_reader.eof()) {
-					return true;
-				}
-				size_t read = m_reader.read(m_buf, m_size);
-				m_read += read;
-				m_size -= read;
-				m_buf += read;
-				return m_size == 0;
-			}
-
-			explicit ReadAwaiter(CurlReader& reader, std::byte* buf, size_t size)
-				: m_reader(reader)
-				, m_buf(buf)
-				, m_size(size)
-			{
-			}
-
-			CurlReader& m_reader;
-			std::byte* m_buf;
-			size_t m_size;
-			size_t m_read = 0;
-		};
-
-		auto read(void* buf, size_t size)
-		{
-			//printf("read:%zu\n", size);
-			return ReadAwaiter{ *this, static_cast<std::byte*>(buf), size };
-		}
-
-	private:
-		size_t write(char* ptr, size_t size, size_t nmemb)
-		{
-			size_t realSize = size * nmemb;
-			//printf("write:%zd\n", realSize);
-			m_buffers.emplace_back(realSize);
-			auto it = m_buffers.rbegin();
-			memcpy(it->data(), ptr, it->size());
-			return realSize;
-		}
-
-		static size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata)
-		{
-			return static_cast<CurlReader*>(userdata)->write(ptr, size, nmemb);
-		}
-
-		size_t read(std::byte* buf, size_t size)
-		{
-			if (eof()) {
-				return 0;
-			}
-			size_t read = 0;
-			while (size > 0 && !m_buffers.empty()) {
-				auto it = m_buffers.begin();
-				if (size <= it->size()) {
-					size_t remaining = it->size() - size;
-					memcpy(buf, it->data(), size);
-					memmove(it->data(), it->data() + size, remaining);
-					it->resize(remaining);
-					read += size;
-					break;
-				}
-				else {
-					memcpy(buf, it->data(), it->size());
-					read += it->size();
-					buf += it->size();
-					size -= it->size();
-					m_buffers.pop_front();
-				}
-			}
-			return read;
-		}
-
-		CurlWorkqueue& m_wq;
-		CURL* m_curl;
-		std::list<Buffer> m_buffers;
-		bool m_done = false;
-	};
-
-	struct Work {
-		using Condition = std::function<bool(bool done)>;
-		using CoroutineHandle = std::coroutine_handle<>;
-		Work(Condition&& condition, CoroutineHandle handle, CURL* curl)
-			: m_condition(std::move(condition))
-			, m_handle(handle)
-			, m_curl(curl)
-		{
-		}
-		Work(const Work&& rhs)
-			: m_condition(std::move(rhs.m_condition))
-			, m_handle(rhs.m_handle)
-			, m_curl(rhs.m_curl)
-		{
-		}
-		Work& operator=(const Work&& rhs)
-		{
-			m_condition = std::move(rhs.m_condition);
-			m_handle = rhs.m_handle;
-			m_curl = rhs.m_curl;
-			return *this;
-		}
-
-		Work() = delete;
-		Work(const Work&) = delete;
-		Work& operator=(const Work&) = delete;
-
-		Condition m_condition;
-		CoroutineHandle m_handle;
-		CURL* m_curl;
-	};
-	using Queue = std::list<Work>;
-
-	CurlWorkqueue();
-	~CurlWorkqueue() = default;
-
-	void enqueue(Work::Condition&& condition, Work::CoroutineHandle handle, CURL* curl);
-	void enqueue(Work::CoroutineHandle handle);
-
-	virtual void run();
-
-
-protected:
-	void wakeup();
-	void executeExpired(bool wait);
-
-	CURLM* multi() { return m_multi; }
-
-	Queue m_queue;
-
-	std::mutex m_mutex;
-	std::condition_variable m_cond;
-	CURLM* m_multi;
-};
-
-[[nodiscard]]
-inline auto shedule(CurlWorkqueue& wq)
-{
-	struct Awaitable {
-	public:
-		bool await_ready() { return false; }
-		bool await_suspend(std::coroutine_handle<> h)
-		{
-			wq.enqueue(h);
-			return true;
-		}
-		void await_resume() {}
-
-		explicit Awaitable(CurlWorkqueue& wq) : wq(wq) {}
-	private:
-		CurlWorkqueue& wq;
-	};
-
-	return Awaitable{ wq };
-}
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <vector>
+#include <unifex/inplace_stop_token.hpp>
+#include "memory_budget.h"
+#include "trace.h"
+#include "workqueue.h"
+
+typedef void CURLM;
+typedef void CURL;
+
+class ByteSource;
+struct CapturedChunk;
+
+class CurlWorkqueue {
+public:
+	friend class CurlReader;
+	class CurlReader {
+	public:
+		using Buffer = std::vector<std::byte>;
+		using Clock = std::chrono::steady_clock;
+
+		// ストップトークンが立つと待機中の read() はすぐに戻り、以降の read() は 0 を返す。
+		// ネットワークスレッド以外で破棄しないこと。
+		CurlReader(const char* url, CurlWorkqueue& wq, unifex::inplace_stop_token stopToken = {});
+		// open() するまで転送しない
+		explicit CurlReader(CurlWorkqueue& wq, unifex::inplace_stop_token stopToken = {});
+		~CurlReader();
+
+		// 転送を (やり直して) 始める。easy ハンドルと受信バッファは使い回すので、
+		// 同じホストへの接続やセッションもそのまま再利用される。ネットワークスレッドで呼ぶこと。
+		void open(const char* url);
+
+		bool eof() const
+		{
+			return m_done && m_readPos == m_buffer.size();
+		}
+		// 転送が終わって、残りはすべて受信バッファにある
+		bool done() const { return m_done; }
+		// 待たずに読めるバイト数
+		size_t available() const { return m_buffer.size() - m_readPos; }
+
+		// 1回の read() で待つ上限 (0 なら無制限)
+		void setReadTimeout(Clock::duration timeout) { m_readTimeout = timeout; }
+		// ストリーム全体の期限。過ぎると以降の read() は打ち切られる
+		void setDeadline(Clock::time_point deadline) { m_deadline = deadline; }
+		// 待機中の read() を再開する順番と、HTTP/2 のストリームの重み。次の open() から効く
+		void setPriority(Priority priority) { m_priority = priority; }
+		// 受信速度の上限 (バイト/秒、0 なら無制限)。次の open() から効く
+		void setMaxRecvSpeed(int64_t bytesPerSecond) { m_maxRecvSpeed = bytesPerSecond; }
+		// curl の代わりに source からデータを受け取る。次の open() から効く
+		void setSource(std::unique_ptr<ByteSource> source);
+		// 受信したチャンクを届いた間隔とともに capture に足していく (ReplaySource で再生できる)。nullptr でやめる
+		void setCapture(std::vector<CapturedChunk>* capture) { m_capture = capture; }
+		// 受信バッファの容量を account の Reader に数える。メモリの上限を超えている間は、
+		// 読まれていないデータが PauseThreshold 以上溜まった curl の転送を止め、読まれて減ったら再開する
+		void setMemoryAccount(MemoryBudget::Account* account);
+
+		static constexpr size_t PauseThreshold = 256 * 1024;
+
+		// ByteSource 用。受信したデータを足す / 転送の終わりを知らせる
+		void deliver(const void* data, size_t size);
+		void finish();
+		CurlWorkqueue& workqueue() const { return m_wq; }
+		CURL* handle() const { return m_curl; }
+		Priority priority() const { return m_priority; }
+
+		bool cancelled() const
+		{
+			return m_stopToken.stop_requested() || m_wq.clock().now() >= m_deadline;
+		}
+
+		// 読み込み要求。co_await 用の ReadAwaiter が使う
+		friend struct ReadRequest;
+		struct ReadRequest {
+			// deferResume なら止めていた転送をその場で再開せず、run() に頼む (Work の条件は m_mutex を持って呼ばれる)
+			bool tryRead(bool deferResume = false)
+			{
+				if (m_reader.eof() || m_reader.cancelled()) {
+					return true;
+				}
+				readAvailable();
+				if (m_reader.m_paused && (m_size > 0 || m_reader.available() < PauseThreshold / 2)) {
+					if (deferResume) {
+						m_reader.m_wq.resumeLater(m_reader);
+					}
+					else {
+						// 止めていた転送を再開する。curl が持っていた分はその場で届く
+						m_reader.resume();
+						readAvailable();
+					}
+				}
+				return m_size == 0;
+			}
+
+			void readAvailable()
+			{
+				size_t read = m_reader.read(m_buf, m_size);
+				m_read += read;
+				m_size -= read;
+				if (m_buf) {
+					m_buf += read;
+				}
+			}
+
+			// 要求サイズが揃うか、転送の終了・キャンセル・タイムアウトまでネットワークスレッドで待ち、function(context) を呼ぶ
+			void wait(void (*function)(void* context), void* context)
+			{
+				auto deadline = m_reader.m_deadline;
+				if (m_reader.m_readTimeout != Clock::duration::zero()) {
+					deadline = std::min(deadline, m_reader.m_wq.clock().now() + m_reader.m_readTimeout);
+				}
+				m_reader.m_wq.enqueue([this](bool) -> bool {
+					return tryRead(true);
+					}, function, context, m_reader.m_curl, deadline, m_reader.m_priority);
+			}
+
+			explicit ReadRequest(CurlReader& reader, std::byte* buf, size_t size)
+				: m_reader(reader)
+				, m_buf(buf)
+				, m_size(size)
+			{
+			}
+
+			CurlReader& m_reader;
+			std::byte* m_buf;
+			size_t m_size;
+			size_t m_read = 0;
+		};
+
+		struct ReadAwaiter : ReadRequest {
+			bool await_ready()
+			{
+				return tryRead();
+			}
+
+			bool await_suspend(std::coroutine_handle<> h)
+			{
+				if (tryRead()) {
+					return false;
+				}
+
+				m_suspendTime = TRACE_NOW();
+				wait(&Work::resumeCoroutine, h.address());
+				return true;
+			}
+
+			size_t await_resume()
+			{
+				if (m_suspendTime) {
+					TRACE_COMPLETE("network wait", *m_suspendTime);
+				}
+				return m_read;
+			}
+
+			using ReadRequest::ReadRequest;
+
+			std::optional<uint64_t> m_suspendTime;
+		};
+
+		auto read(void* buf, size_t size)
+		{
+			//printf("read:%zu\n", size);
+			return ReadAwaiter{ *this, static_cast<std::byte*>(buf), size };
+		}
+		// size バイトを読み捨てる。受信バッファから写さずに読み位置を進めるだけ。co_await で読み捨てたバイト数を返す
+		auto skip(size_t size)
+		{
+			return ReadAwaiter{ *this, nullptr, size };
+		}
+
+	private:
+		friend class CurlWorkqueue;
+
+		// ストップ要求が来たらネットワークスレッドを起こして待機中の read() を戻す
+		struct WakeUp {
+			void operator()() noexcept { m_wq->wakeup(); }
+			CurlWorkqueue* m_wq;
+		};
+
+		size_t write(char* ptr, size_t size, size_t nmemb);
+		void capture(const void* data, size_t size);
+		void resume();
+
+		static size_t write_callback(char* ptr, size_t size, size_t nmemb, void* userdata)
+		{
+			return static_cast<CurlReader*>(userdata)->write(ptr, size, nmemb);
+		}
+
+		size_t read(std::byte* buf, size_t size)
+		{
+			if (eof()) {
+				return 0;
+			}
+			size_t read = std::min(size, m_buffer.size() - m_readPos);
+			if (buf) {
+				memcpy(buf, m_buffer.data() + m_readPos, read);
+			}
+			m_readPos += read;
+			return read;
+		}
+
+		CurlWorkqueue& m_wq;
+		CURL* m_curl;
+		bool m_added = false; // multi に登録済み
+		Buffer m_buffer;      // 受信したデータ。m_readPos より前は読み終わっている
+		size_t m_readPos = 0;
+		bool m_done = false;
+		unifex::inplace_stop_token m_stopToken;
+		std::optional<unifex::inplace_stop_token::callback_type<WakeUp>> m_stopCallback;
+		Clock::duration m_readTimeout = Clock::duration::zero();
+		Clock::time_point m_deadline = (Clock::time_point::max)();
+		Priority m_priority = Priority::Foreground;
+		int64_t m_maxRecvSpeed = 0;
+		std::unique_ptr<ByteSource> m_source;
+		std::vector<CapturedChunk>* m_capture = nullptr;
+		Clock::time_point m_lastChunk; // capture 用
+		MemoryBudget::Account* m_account = nullptr;
+		size_t m_accountedCapacity = 0;
+		bool m_pausable = false; // 転送を止められるプロトコル
+		bool m_paused = false;   // メモリの上限で curl の転送を止めている
+	};
+
+	struct Work {
+		using Condition = std::function<bool(bool done)>;
+		using CoroutineHandle = std::coroutine_handle<>;
+		using Function = void (*)(void* context);
+		using Clock = std::chrono::steady_clock;
+		Work(Condition&& condition, Function function, void* context, CURL* curl, Clock::time_point deadline,
+			Priority priority = Priority::Foreground)
+			: m_condition(std::move(condition))
+			, m_function(function)
+			, m_context(context)
+			, m_curl(curl)
+			, m_deadline(deadline)
+			, m_priority(priority)
+		{
+		}
+		Work(const Work&& rhs)
+			: m_condition(std::move(rhs.m_condition))
+			, m_function(rhs.m_function)
+			, m_context(rhs.m_context)
+			, m_curl(rhs.m_curl)
+			, m_deadline(rhs.m_deadline)
+			, m_priority(rhs.m_priority)
+		{
+		}
+		Work& operator=(const Work&& rhs)
+		{
+			m_condition = std::move(rhs.m_condition);
+			m_function = rhs.m_function;
+			m_context = rhs.m_context;
+			m_curl = rhs.m_curl;
+			m_deadline = rhs.m_deadline;
+			m_priority = rhs.m_priority;
+			return *this;
+		}
+
+		Work() = delete;
+		Work(const Work&) = delete;
+		Work& operator=(const Work&) = delete;
+
+		void execute() const { m_function(m_context); }
+
+		// コルーチンは handle.address() を context として再開する
+		static void resumeCoroutine(void* address) { CoroutineHandle::from_address(address).resume(); }
+
+		static Clock::time_point noDeadline() { return (Clock::time_point::max)(); }
+
+		Condition m_condition;
+		Function m_function;
+		void* m_context;
+		CURL* m_curl;
+		Clock::time_point m_deadline; // condition を満たさなくてもこの時刻になったら実行する
+		Priority m_priority;          // 同時に実行できるようになったものの中での順番
+	};
+	using Queue = std::list<Work>;
+
+	// curl 以外の完了通知 (io_uring など) をネットワークスレッドのループで処理するもの。
+	// 登録している間、ループは curl_multi_poll() で fd() も待ち、待つ前と起きたあとに process() を呼ぶ。
+	// process() で reader に deliver() すれば、同じ周回で待機中の read() が再開する
+	class EventSource {
+	public:
+		virtual ~EventSource() = default;
+		virtual int fd() const = 0;
+		// 溜まっている要求を出し、完了したものを処理する。何か処理したら true
+		virtual bool process() = 0;
+	};
+
+	// 期限は clock で見た時刻で判定する
+	explicit CurlWorkqueue(WorkqueueClock& clock = WorkqueueClock::system());
+	~CurlWorkqueue() = default;
+
+	WorkqueueClock& clock() const { return *m_clock; }
+
+	void enqueue(Work::Condition&& condition, Work::CoroutineHandle handle, CURL* curl);
+	void enqueue(Work::Condition&& condition, Work::Function function, void* context, CURL* curl,
+		Work::Clock::time_point deadline = Work::noDeadline(), Priority priority = Priority::Foreground);
+	void enqueue(Work::CoroutineHandle handle, Priority priority = Priority::Foreground);
+
+	// curl に紐づく待機中の Work を実行せずに取り除く。ネットワークスレッドで呼ぶこと。
+	// Work の実行中に呼ばれたら、同じ周回で実行を待っている Work も実行しない
+	void cancel(CURL* curl);
+
+	// ネットワークスレッドで呼ぶこと
+	void addEventSource(EventSource* source);
+	void removeEventSource(EventSource* source);
+
+	virtual void run();
+	// run() を抜けさせる
+	void stop();
+
+	// このキューに割り当てられているストリームの数 (CurlWorkqueuePool の振り分けに使う)
+	int streams() const { return m_streams.load(std::memory_order_relaxed); }
+	void addStream() { m_streams.fetch_add(1, std::memory_order_relaxed); }
+	void removeStream() { m_streams.fetch_sub(1, std::memory_order_relaxed); }
+
+
+protected:
+	void wakeup();
+	// reader の止めていた転送を、run() が m_mutex を離してから再開する。ネットワークスレッドで呼ぶこと
+	void resumeLater(CurlReader& reader);
+	int pollTimeout();
+	void executeExpired(bool wait);
+
+	CURLM* multi() { return m_multi; }
+
+	Queue m_queue;
+	Queue m_execQueue; // run() がこの周回で実行する Work。ネットワークスレッドだけが触る
+	Queue m_free; // 実行し終わった Work のノード。enqueue で使い回す
+	std::optional<Work::Clock::time_point> m_nextDeadline;
+
+	WorkqueueClock* m_clock;
+	std::atomic<bool> m_pending{ false }; // wakeup() されてからまだ Work を見直していない
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	CURLM* m_multi;
+	bool m_stopped = false;
+	std::atomic<int> m_streams{ 0 };
+	std::vector<EventSource*> m_eventSources; // ネットワークスレッドだけが触る
+	std::vector<CurlReader*> m_resumeReaders; // resumeLater() されたもの。ネットワークスレッドだけが触る
+};
+
+[[nodiscard]]
+inline auto shedule(CurlWorkqueue& wq, Priority priority = Priority::Foreground)
+{
+	struct Awaitable {
+	public:
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			wq.enqueue(h, priority);
+			return true;
+		}
+		void await_resume() {}
+
+		explicit Awaitable(CurlWorkqueue& wq, Priority priority) : wq(wq), priority(priority) {}
+	private:
+		CurlWorkqueue& wq;
+		Priority priority;
+	};
+
+	return Awaitable{ wq, priority };
+}
@@ -0,0 +1,68 @@
+#include "curl_workqueue_pool.h"
+#include "logger.h"
+#include "thread_topology.h"
+
+#include <algorithm>
+#include <thread>
+
+CurlWorkqueuePool::CurlWorkqueuePool(size_t threads, Placement placement, WorkqueueClock& clock)
+	: m_placement(placement)
+{
+	if (threads == 0) {
+		// TLS の復号が重いので半分ほど。表示側にコアを残す
+		threads = std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+	}
+
+	m_threadNames.reserve(threads);
+	for (size_t i = 0; i < threads; ++i) {
+		m_shards.push_back(std::make_unique<CurlWorkqueue>(clock));
+		m_threadNames.push_back("network " + std::to_string(i));
+	}
+	for (size_t i = 0; i < threads; ++i) {
+		CurlWorkqueue* wq = m_shards[i].get();
+		[[maybe_unused]] const char* name = m_threadNames[i].c_str();
+		std::thread{ [wq, i, name]() {
+			ThreadTopology::instance().enter(ThreadRole::Network, i, name);
+			wq->run();
+		} }.detach();
+	}
+	LOGI("CurlWorkqueuePool: %zu network threads\n", threads);
+}
+
+bool CurlWorkqueuePool::saturated(const CurlWorkqueue& shard) const
+{
+	// 平均より 2 本以上多ければ飽和とみなす
+	int total = 0;
+	for (auto& s : m_shards) {
+		total += s->streams();
+	}
+	int average = (total + static_cast<int>(m_shards.size()) - 1) / static_cast<int>(m_shards.size());
+	return shard.streams() >= average + 2;
+}
+
+CurlWorkqueuePool::Lease CurlWorkqueuePool::acquire(size_t key)
+{
+	const size_t count = m_shards.size();
+	const size_t home = key % count;
+
+	if (m_placement == Placement::Hash && !saturated(*m_shards[home])) {
+		return Lease{ *m_shards[home] };
+	}
+
+	// key の位置から探すので、負荷が同じなら同じシャードに戻る
+	size_t best = home;
+	for (size_t i = 1; i < count; ++i) {
+		size_t index = (home + i) % count;
+		if (m_shards[index]->streams() < m_shards[best]->streams()) {
+			best = index;
+		}
+	}
+	return Lease{ *m_shards[best] };
+}
+
+void CurlWorkqueuePool::stop()
+{
+	for (auto& shard : m_shards) {
+		shard->stop();
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "curl_workqueue.h"
+
+// 複数のネットワークスレッドにストリームを振り分ける。
+// シャードごとに CurlWorkqueue (curl_multi とイベントループ) を持ち、互いに共有するものはない。
+// ストリームは開始時に1つのシャードに割り当てられ、終わるまでそのシャードから動かない。
+// 再接続のたびに割り当て直すので、偏ったシャードからはストリームの切れ目で移っていく。
+class CurlWorkqueuePool {
+public:
+	enum class Placement {
+		LeastLoaded, // 実行中のストリームが最も少ないシャード (同数なら key で決める)
+		Hash,        // key で固定。ただし飽和していれば LeastLoaded に切り替える
+	};
+
+	// threads が 0 ならハードウェアスレッド数から決める。各シャードの期限は clock で判定する
+	explicit CurlWorkqueuePool(size_t threads = 0, Placement placement = Placement::LeastLoaded,
+		WorkqueueClock& clock = WorkqueueClock::system());
+	~CurlWorkqueuePool() = default;
+
+	CurlWorkqueuePool(const CurlWorkqueuePool&) = delete;
+	CurlWorkqueuePool& operator=(const CurlWorkqueuePool&) = delete;
+
+	// ストリームの割り当て。破棄されるまでシャードの負荷として数える
+	class Lease {
+	public:
+		explicit Lease(CurlWorkqueue& wq) : m_wq(&wq) { m_wq->addStream(); }
+		Lease(Lease&& rhs) noexcept : m_wq(std::exchange(rhs.m_wq, nullptr)) {}
+		~Lease()
+		{
+			if (m_wq) {
+				m_wq->removeStream();
+			}
+		}
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+
+		CurlWorkqueue& operator*() const { return *m_wq; }
+
+	private:
+		CurlWorkqueue* m_wq;
+	};
+
+	// key は URL のハッシュなど、同じストリームで変わらない値
+	[[nodiscard]]
+	Lease acquire(size_t key);
+
+	size_t size() const { return m_shards.size(); }
+	CurlWorkqueue& shard(size_t index) { return *m_shards[index]; }
+
+	// 全シャードの run() を抜けさせる
+	void stop();
+
+	// shard に他より明らかに多く割り当たっていれば true。長く続くストリームが移る目安にする
+	bool saturated(const CurlWorkqueue& shard) const;
+
+private:
+	Placement m_placement;
+	std::vector<std::unique_ptr<CurlWorkqueue>> m_shards;
+	std::vector<std::string> m_threadNames; // トレースのスレッド名は寿命の間残っている必要がある
+};
@@ -0,0 +1,128 @@
+#include "frame_cache.h"
+#include "logger.h"
+
+#include <bit>
+#include <cstring>
+
+FrameCache::FrameCache(size_t budget)
+	: m_budget(budget)
+	, m_account("frame cache")
+{
+}
+
+uint64_t FrameCache::hash(const uint8_t* data, size_t size)
+{
+	// 空のデータは data が nullptr のことがあるので読まない
+	if (size == 0) {
+		return 0;
+	}
+	// 8 バイトずつ混ぜる。衝突は find() で中身を比べるので、速さを優先する
+	constexpr uint64_t k0 = 0x9E3779B97F4A7C15ull;
+	constexpr uint64_t k1 = 0xC2B2AE3D27D4EB4Full;
+	uint64_t h = size * k0;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		h = std::rotl(h ^ (word * k1), 31) * k0;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, data + i, size - i);
+	h = std::rotl(h ^ (tail * k1), 31) * k0;
+	h ^= h >> 29;
+	return h;
+}
+
+std::shared_ptr<const DecodedFrame> FrameCache::find(const std::vector<uint8_t>& compressed, uint64_t hash,
+	uint8_t minCodeSize, int width, int height, bool interlaced)
+{
+	std::shared_ptr<const DecodedFrame> found;
+	Stats stats;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_stats.lookups;
+		auto range = m_index.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			const DecodedFrame& frame = **it->second;
+			if (frame.minCodeSize == minCodeSize && frame.width == width && frame.height == height &&
+				frame.interlaced == interlaced && frame.compressed == compressed) {
+				m_entries.splice(m_entries.begin(), m_entries, it->second);
+				found = *it->second;
+				++m_stats.hits;
+				m_stats.bytesSaved += found->pixels.size();
+				break;
+			}
+		}
+		if (m_stats.lookups % ReportInterval != 0) {
+			return found;
+		}
+		stats = m_stats;
+	}
+
+	LOGI("Frame cache: hit rate %.1f%%, saved %.1f MB, %zu entries (%.1f MB), %llu evicted\n",
+		100.0 * stats.hits / stats.lookups, stats.bytesSaved / (1024.0 * 1024.0),
+		stats.entries, stats.residentBytes / (1024.0 * 1024.0), static_cast<unsigned long long>(stats.evictions));
+	return found;
+}
+
+std::shared_ptr<const DecodedFrame> FrameCache::insert(const std::vector<uint8_t>& compressed, uint64_t hash,
+	uint8_t minCodeSize, int width, int height, bool interlaced, const uint8_t* pixels, size_t rows)
+{
+	const size_t pixelBytes = rows * width;
+	if (compressed.size() + pixelBytes > m_budget) {
+		return nullptr;
+	}
+
+	// コピーはロックの外で済ませる
+	auto frame = std::make_shared<DecodedFrame>();
+	frame->hash = hash;
+	frame->minCodeSize = minCodeSize;
+	frame->width = width;
+	frame->height = height;
+	frame->interlaced = interlaced;
+	frame->compressed = compressed;
+	frame->pixels.assign(pixels, pixels + pixelBytes);
+	frame->rows = rows;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// 同じフレームを別のストリームが先に登録していたらそちらを使う
+	auto range = m_index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		const DecodedFrame& other = **it->second;
+		if (other.minCodeSize == minCodeSize && other.width == width && other.height == height &&
+			other.interlaced == interlaced && other.compressed == compressed) {
+			return *it->second;
+		}
+	}
+	m_entries.push_front(frame);
+	m_index.emplace(hash, m_entries.begin());
+	++m_stats.entries;
+	m_stats.residentBytes += frame->bytes();
+	evict();
+	m_account.update(MemoryCategory::Cache, m_stats.residentBytes);
+	return frame;
+}
+
+FrameCache::Stats FrameCache::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+void FrameCache::evict()
+{
+	while (m_stats.residentBytes > m_budget && !m_entries.empty()) {
+		auto last = std::prev(m_entries.end());
+		auto range = m_index.equal_range((*last)->hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == last) {
+				m_index.erase(it);
+				break;
+			}
+		}
+		m_stats.residentBytes -= (*last)->bytes();
+		--m_stats.entries;
+		++m_stats.evictions;
+		m_entries.erase(last);
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "memory_budget.h"
+
+// 展開済みのフレームのインデックス。FrameCache で共有するので作ったあとは変更しない
+struct DecodedFrame {
+	uint64_t hash;
+	uint8_t minCodeSize;
+	int width;
+	int height;
+	bool interlaced;
+	std::vector<uint8_t> compressed; // キーの圧縮データ (ハッシュが衝突したときの比較用)
+	std::vector<uint8_t> pixels;     // インターレースは並べ替え済み
+	size_t rows;                     // pixels の完全な行の数
+
+	size_t bytes() const { return compressed.capacity() + pixels.capacity(); }
+};
+
+// 同じ圧縮データのフレームを、ストリームや周回をまたいで展開し直さずに使い回す。
+// キーは LZW の圧縮データ + 最小コードサイズ + 大きさ + インターレースの有無。
+// 展開結果はパレットや位置によらないので、それらはキーに含めない (色や位置だけ違うフレームも共有する)。
+// 最近使ったものから budget バイトまでを持ち、あふれたら古いものから手放す。
+// 使っている側が持っている間は手放されても生きている
+class FrameCache {
+public:
+	static constexpr size_t DefaultBudget = 64 * 1024 * 1024;
+	static constexpr uint64_t ReportInterval = 1000;
+
+	struct Stats {
+		uint64_t lookups = 0;
+		uint64_t hits = 0;
+		uint64_t bytesSaved = 0; // 展開せずに済んだバイト数
+		uint64_t evictions = 0;
+		size_t entries = 0;
+		size_t residentBytes = 0;
+	};
+
+	explicit FrameCache(size_t budget = DefaultBudget);
+
+	FrameCache(const FrameCache&) = delete;
+	FrameCache& operator=(const FrameCache&) = delete;
+
+	static uint64_t hash(const uint8_t* data, size_t size);
+
+	// 同じフレームを展開したものがあれば返す。なければ nullptr
+	std::shared_ptr<const DecodedFrame> find(const std::vector<uint8_t>& compressed, uint64_t hash,
+		uint8_t minCodeSize, int width, int height, bool interlaced);
+	// 展開したフレームを登録する。budget に収まらない大きさなら登録せずに nullptr
+	std::shared_ptr<const DecodedFrame> insert(const std::vector<uint8_t>& compressed, uint64_t hash,
+		uint8_t minCodeSize, int width, int height, bool interlaced, const uint8_t* pixels, size_t rows);
+
+	Stats stats();
+
+private:
+	using Entries = std::list<std::shared_ptr<const DecodedFrame>>;
+
+	void evict();
+
+	const size_t m_budget;
+	MemoryBudget::Account m_account; // residentBytes を Cache に数える
+
+	std::mutex m_mutex; // 以下を守る
+	Entries m_entries;  // 最近使った順
+	std::unordered_multimap<uint64_t, Entries::iterator> m_index;
+	Stats m_stats;
+};
@@ -0,0 +1,406 @@
+#include "frame_export.h"
+#include "indexed_image.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t Alignment = 64;
+
+size_t alignUp(size_t size)
+{
+	return (size + Alignment - 1) / Alignment * Alignment;
+}
+
+const SharedFrameStream* streams(const SharedFrameHeader* header)
+{
+	return reinterpret_cast<const SharedFrameStream*>(reinterpret_cast<const uint8_t*>(header) + header->streamOffset);
+}
+
+const SharedFrameSlot* slot(const SharedFrameHeader* header, uint32_t stream, uint64_t frame)
+{
+	size_t index = static_cast<size_t>(stream) * header->slotCount + frame % header->slotCount;
+	return reinterpret_cast<const SharedFrameSlot*>(
+		reinterpret_cast<const uint8_t*>(header) + header->slotOffset + index * header->slotSize);
+}
+
+bool makeAddress(const char* path, sockaddr_un& address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		LOGE("Socket path too long: %s\n", path);
+		return false;
+	}
+	strcpy(address.sun_path, path);
+	return true;
+}
+
+int64_t nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+SharedFrameExporter::SharedFrameExporter(const char* socketPath, uint32_t streamCount, uint32_t maxWidth, uint32_t maxHeight,
+	uint32_t slotCount)
+	: m_socketPath(socketPath)
+	, m_frameCounts(streamCount, 0)
+{
+	const size_t streamOffset = alignUp(sizeof(SharedFrameHeader));
+	const size_t slotOffset = streamOffset + sizeof(SharedFrameStream) * streamCount;
+	const size_t slotSize = alignUp(sizeof(SharedFrameSlot) + static_cast<size_t>(maxWidth) * maxHeight * sizeof(uint32_t));
+	const size_t size = slotOffset + slotSize * streamCount * std::max(slotCount, 1u);
+
+	// 確保するのは触ったページだけなので、使わないストリームやスロットの分はメモリを食わない
+	m_memFd = memfd_create("gif-frames", MFD_CLOEXEC);
+	if (m_memFd < 0 || ftruncate(m_memFd, size) != 0) {
+		LOGE("Failed to create shared memory: %s\n", strerror(errno));
+		closeFds();
+		return;
+	}
+	void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memFd, 0);
+	if (mapped == MAP_FAILED) {
+		LOGE("Failed to map shared memory: %s\n", strerror(errno));
+		closeFds();
+		return;
+	}
+	m_mappedSize = size;
+
+	sockaddr_un address;
+	if (!makeAddress(socketPath, address)) {
+		munmap(mapped, size);
+		closeFds();
+		return;
+	}
+	unlink(socketPath);
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_listenFd < 0 || bind(m_listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+		listen(m_listenFd, 8) != 0) {
+		LOGE("Failed to listen on %s: %s\n", socketPath, strerror(errno));
+		munmap(mapped, size);
+		closeFds();
+		return;
+	}
+	m_stopFd = eventfd(0, EFD_CLOEXEC);
+	if (m_stopFd < 0) {
+		LOGE("Failed to create eventfd: %s\n", strerror(errno));
+		munmap(mapped, size);
+		closeFds();
+		return;
+	}
+
+	// 中身は ftruncate で 0 になっているので、ヘッダだけ書けばよい
+	auto header = static_cast<SharedFrameHeader*>(mapped);
+	memcpy(header->magic, SharedFrameHeader::Magic, sizeof(header->magic));
+	header->streamCount = streamCount;
+	header->slotCount = std::max(slotCount, 1u);
+	header->maxWidth = maxWidth;
+	header->maxHeight = maxHeight;
+	header->slotSize = slotSize;
+	header->streamOffset = streamOffset;
+	header->slotOffset = slotOffset;
+	m_header = header;
+
+	m_thread = std::thread([this]() { serve(); });
+	LOGI("Exporting frames on %s (%u streams, %u slots, up to %ux%u)\n", socketPath, streamCount, header->slotCount,
+		maxWidth, maxHeight);
+}
+
+SharedFrameExporter::~SharedFrameExporter()
+{
+	if (m_thread.joinable()) {
+		uint64_t one = 1;
+		write(m_stopFd, &one, sizeof(one));
+		m_thread.join();
+	}
+	if (m_header) {
+		munmap(m_header, m_mappedSize);
+		m_header = nullptr;
+		unlink(m_socketPath.c_str());
+	}
+	closeFds();
+}
+
+void SharedFrameExporter::closeFds()
+{
+	for (int* fd : { &m_listenFd, &m_memFd, &m_stopFd }) {
+		if (*fd >= 0) {
+			::close(*fd);
+			*fd = -1;
+		}
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_sockets.size(); ++i) {
+		::close(m_sockets[i]);
+		::close(m_eventFds[i]);
+	}
+	m_sockets.clear();
+	m_eventFds.clear();
+}
+
+bool SharedFrameExporter::publish(uint32_t stream, const IndexedImage& image)
+{
+	if (!m_header || stream >= m_header->streamCount) {
+		return false;
+	}
+	const uint32_t width = image.width();
+	const uint32_t height = image.height();
+	if (width > m_header->maxWidth || height > m_header->maxHeight) {
+		LOGW("Frame %ux%u exceeds shared slot size %ux%u\n", width, height, m_header->maxWidth, m_header->maxHeight);
+		return false;
+	}
+
+	const uint64_t frame = ++m_frameCounts[stream];
+	auto target = const_cast<SharedFrameSlot*>(slot(m_header, stream, frame));
+	const uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+	target->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	// 読む側が展開できるよう、インデックスのものはそのまま写す (ARGB の 1/4 で済む)
+	const size_t pixelCount = static_cast<size_t>(width) * height;
+	target->frame = frame;
+	target->width = width;
+	target->height = height;
+	if (image.indexed()) {
+		target->format = SharedFrameFormat::Indexed;
+		if (image.palette()) {
+			memcpy(target->palette, image.palette()->colors, sizeof(target->palette));
+		}
+		else {
+			memset(target->palette, 0, sizeof(target->palette));
+		}
+		memcpy(target->pixels(), image.indices(), pixelCount);
+	}
+	else {
+		target->format = SharedFrameFormat::ARGB;
+		memcpy(target->pixels(), image.argb(), pixelCount * sizeof(uint32_t));
+	}
+	target->publishNs = nowNs();
+
+	target->sequence.store(sequence + 2, std::memory_order_release);
+	auto state = const_cast<SharedFrameStream*>(streams(m_header)) + stream;
+	state->latest.store(frame, std::memory_order_release);
+
+	uint64_t one = 1;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (int eventFd : m_eventFds) {
+		write(eventFd, &one, sizeof(one));
+	}
+	return true;
+}
+
+size_t SharedFrameExporter::clientCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_sockets.size();
+}
+
+void SharedFrameExporter::serve()
+{
+	std::vector<pollfd> fds;
+	while (true) {
+		fds.clear();
+		fds.push_back({ m_stopFd, POLLIN, 0 });
+		fds.push_back({ m_listenFd, POLLIN, 0 });
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (int socket : m_sockets) {
+				fds.push_back({ socket, POLLIN, 0 });
+			}
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOGE("poll failed: %s\n", strerror(errno));
+			return;
+		}
+		if (fds[0].revents) {
+			return;
+		}
+
+		// 相手からは何も送られてこないので、読めるようになったら切断とみなす
+		for (size_t i = 2; i < fds.size(); ++i) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = std::find(m_sockets.begin(), m_sockets.end(), fds[i].fd);
+			size_t index = it - m_sockets.begin();
+			::close(m_sockets[index]);
+			::close(m_eventFds[index]);
+			m_sockets.erase(it);
+			m_eventFds.erase(m_eventFds.begin() + index);
+			LOGI("Frame client disconnected\n");
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int socket = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (socket < 0) {
+				continue;
+			}
+			int eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+			if (eventFd < 0) {
+				::close(socket);
+				continue;
+			}
+
+			int passed[2] = { m_memFd, eventFd };
+			char control[CMSG_SPACE(sizeof(passed))] = {};
+			char byte = 0;
+			iovec iov = { &byte, 1 };
+			msghdr message = {};
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(passed));
+			memcpy(CMSG_DATA(cmsg), passed, sizeof(passed));
+			if (sendmsg(socket, &message, MSG_NOSIGNAL) != 1) {
+				LOGW("Failed to pass shared memory to client: %s\n", strerror(errno));
+				::close(eventFd);
+				::close(socket);
+				continue;
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_sockets.push_back(socket);
+			m_eventFds.push_back(eventFd);
+			LOGI("Frame client connected (%zu)\n", m_sockets.size());
+		}
+	}
+}
+
+SharedFrameClient::SharedFrameClient(const char* socketPath)
+{
+	sockaddr_un address;
+	if (!makeAddress(socketPath, address)) {
+		return;
+	}
+	m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_socket < 0 || connect(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+		LOGE("Failed to connect to %s: %s\n", socketPath, strerror(errno));
+		return;
+	}
+
+	int passed[2];
+	char control[CMSG_SPACE(sizeof(passed))] = {};
+	char byte;
+	iovec iov = { &byte, 1 };
+	msghdr message = {};
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	if (recvmsg(m_socket, &message, MSG_CMSG_CLOEXEC) != 1) {
+		LOGE("Failed to receive shared memory: %s\n", strerror(errno));
+		return;
+	}
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(passed))) {
+		LOGE("Unexpected handshake from %s\n", socketPath);
+		return;
+	}
+	memcpy(passed, CMSG_DATA(cmsg), sizeof(passed));
+	m_memFd = passed[0];
+	m_eventFd = passed[1];
+
+	struct stat st;
+	if (fstat(m_memFd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SharedFrameHeader)) {
+		LOGE("Invalid shared memory\n");
+		return;
+	}
+	void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, m_memFd, 0);
+	if (mapped == MAP_FAILED) {
+		LOGE("Failed to map shared memory: %s\n", strerror(errno));
+		return;
+	}
+	m_mappedSize = st.st_size;
+	auto header = static_cast<const SharedFrameHeader*>(mapped);
+	const size_t required = header->slotOffset + header->slotSize * header->streamCount * header->slotCount;
+	if (memcmp(header->magic, SharedFrameHeader::Magic, sizeof(header->magic)) != 0 || required > m_mappedSize) {
+		LOGE("Invalid shared memory header\n");
+		munmap(mapped, m_mappedSize);
+		return;
+	}
+	m_header = header;
+}
+
+SharedFrameClient::~SharedFrameClient()
+{
+	if (m_header) {
+		munmap(const_cast<SharedFrameHeader*>(m_header), m_mappedSize);
+	}
+	for (int fd : { m_socket, m_memFd, m_eventFd }) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+bool SharedFrameClient::wait(int timeoutMs)
+{
+	pollfd fds[2] = { { m_eventFd, POLLIN, 0 }, { m_socket, POLLIN, 0 } };
+	if (poll(fds, 2, timeoutMs) < 0) {
+		return errno == EINTR;
+	}
+	if (fds[1].revents) {
+		// 書き出す側からは何も送られてこないので、読めるようになったら切断された
+		return false;
+	}
+	if (fds[0].revents & POLLIN) {
+		uint64_t count;
+		read(m_eventFd, &count, sizeof(count));
+	}
+	return true;
+}
+
+std::optional<SharedFrameClient::FrameView> SharedFrameClient::latest(uint32_t stream, uint64_t lastFrame) const
+{
+	if (stream >= m_header->streamCount) {
+		return std::nullopt;
+	}
+	const uint64_t frame = streams(m_header)[stream].latest.load(std::memory_order_acquire);
+	if (frame <= lastFrame) {
+		return std::nullopt;
+	}
+	const SharedFrameSlot* target = slot(m_header, stream, frame);
+	const uint64_t sequence = target->sequence.load(std::memory_order_acquire);
+	if (sequence & 1) {
+		return std::nullopt;
+	}
+
+	FrameView view;
+	view.stream = stream;
+	view.frame = target->frame;
+	view.publishNs = target->publishNs;
+	view.width = std::min(target->width, m_header->maxWidth);
+	view.height = std::min(target->height, m_header->maxHeight);
+	view.format = target->format;
+	view.palette = target->palette;
+	view.pixels = target->pixels();
+	view.slot = target;
+	view.sequence = sequence;
+	return view;
+}
+
+bool SharedFrameClient::validate(const FrameView& view) const
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return view.slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
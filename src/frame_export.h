@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class IndexedImage;
+
+// 表示用のフレームを共有メモリ (memfd) に書き出し、別のプロセスの表示側からコピーなしで読めるようにする (Linux 専用)。
+//
+// 書き出す側 (SharedFrameExporter) は UNIX ドメインソケットで待ち受け、つないできた相手に
+// memfd とその相手専用の eventfd を SCM_RIGHTS で渡す。以降はソケットを使わず、
+// フレームを書くたびに eventfd を鳴らすだけになる。ソケットが閉じたら eventfd も閉じる。
+//
+// 共有メモリの並び:
+//   SharedFrameHeader
+//   SharedFrameStream * streamCount
+//   スロット * (streamCount * slotCount)   ストリーム s の i 番目は slotOffset + (s * slotCount + i) * slotSize
+// 各スロットは SharedFrameSlot のあとに画素が続く。
+// フレーム番号 n (1 から) はストリームの n % slotCount 番目のスロットに書く。
+// スロットの sequence は書いている間だけ奇数になる (seqlock)。読む側は画素をその場で使い、
+// 使い終わってから sequence が変わっていないことを確かめる。変わっていたら上書きされていたので捨てる
+
+// 画素の形式
+enum class SharedFrameFormat : uint32_t {
+	ARGB,    // width * height の uint32_t (0xAARRGGBB)
+	Indexed, // width * height バイトのインデックス。色は palette
+};
+
+struct SharedFrameHeader {
+	static constexpr char Magic[8] = { 'G', 'I', 'F', 'S', 'H', 'M', '0', '1' };
+
+	char magic[8];
+	uint32_t streamCount;
+	uint32_t slotCount; // ストリームごと
+	uint32_t maxWidth;
+	uint32_t maxHeight;
+	uint64_t slotSize; // SharedFrameSlot と画素を合わせた大きさ (64 の倍数)
+	uint64_t streamOffset;
+	uint64_t slotOffset;
+};
+
+struct alignas(64) SharedFrameStream {
+	std::atomic<uint64_t> latest; // 最後に書き終えたフレームの番号 (0 ならまだない)
+};
+
+struct alignas(64) SharedFrameSlot {
+	std::atomic<uint64_t> sequence;
+	uint64_t frame;
+	int64_t publishNs; // 書き終えた時刻 (steady_clock = CLOCK_MONOTONIC)
+	uint32_t width;
+	uint32_t height;
+	SharedFrameFormat format;
+	uint32_t reserved;
+	uint32_t palette[256]; // Indexed のときだけ使う
+
+	const uint8_t* pixels() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+	uint8_t* pixels() { return reinterpret_cast<uint8_t*>(this + 1); }
+};
+
+// プロセスをまたいで使うので、ロックを使わない実装でなければならない
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+class SharedFrameExporter {
+public:
+	static constexpr uint32_t DefaultSlotCount = 3;
+
+	// socketPath で待ち受ける。失敗したら ok() が false になり、publish() は何もしない
+	SharedFrameExporter(const char* socketPath, uint32_t streamCount, uint32_t maxWidth, uint32_t maxHeight,
+		uint32_t slotCount = DefaultSlotCount);
+	~SharedFrameExporter();
+
+	SharedFrameExporter(const SharedFrameExporter&) = delete;
+	SharedFrameExporter& operator=(const SharedFrameExporter&) = delete;
+
+	bool ok() const { return m_header != nullptr; }
+
+	// stream のフレームとして image を書き、つないでいる相手に知らせる。
+	// 同じ stream には1つのスレッドから書くこと。大きさが maxWidth x maxHeight を超えるものは書かずに false
+	bool publish(uint32_t stream, const IndexedImage& image);
+
+	size_t clientCount();
+
+private:
+	void serve();
+	void closeFds();
+
+	std::string m_socketPath;
+	int m_listenFd = -1;
+	int m_memFd = -1;
+	int m_stopFd = -1; // serve() を抜けさせる eventfd
+	size_t m_mappedSize = 0;
+	SharedFrameHeader* m_header = nullptr;
+	std::vector<uint64_t> m_frameCounts; // ストリームごとの書いたフレーム数
+	std::thread m_thread;
+
+	std::mutex m_mutex;            // 以下を守る
+	std::vector<int> m_eventFds;   // つないでいる相手ごと (m_sockets と同じ順)
+	std::vector<int> m_sockets;
+};
+
+// SharedFrameExporter につないでフレームを読む側
+class SharedFrameClient {
+public:
+	// 共有メモリの中を指す。validate() が true を返すまで中身は確定していない
+	struct FrameView {
+		uint32_t stream;
+		uint64_t frame;
+		int64_t publishNs;
+		uint32_t width;
+		uint32_t height;
+		SharedFrameFormat format;
+		const uint32_t* palette;
+		const uint8_t* pixels;
+
+		const SharedFrameSlot* slot;
+		uint64_t sequence;
+	};
+
+	// socketPath につなぐ。失敗したら ok() が false
+	explicit SharedFrameClient(const char* socketPath);
+	~SharedFrameClient();
+
+	SharedFrameClient(const SharedFrameClient&) = delete;
+	SharedFrameClient& operator=(const SharedFrameClient&) = delete;
+
+	bool ok() const { return m_header != nullptr; }
+	const SharedFrameHeader& header() const { return *m_header; }
+
+	// 新しいフレームが書かれるか timeoutMs が過ぎるまで待つ。切断されたら false
+	bool wait(int timeoutMs);
+	// stream の最新のフレームが lastFrame より新しければ返す。書き込み中なら nullopt
+	std::optional<FrameView> latest(uint32_t stream, uint64_t lastFrame) const;
+	// view を使い終わったあとに呼ぶ。その間に上書きされていたら false
+	bool validate(const FrameView& view) const;
+
+private:
+	int m_socket = -1;
+	int m_memFd = -1;
+	int m_eventFd = -1;
+	size_t m_mappedSize = 0;
+	const SharedFrameHeader* m_header = nullptr;
+};
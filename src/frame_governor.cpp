@@ -0,0 +1,150 @@
+#include "frame_governor.h"
+#include "logger.h"
+
+#include <algorithm>
+
+namespace {
+
+// 指数移動平均 (新しい値の重み 1/8)。最初の値はそのまま使う
+int64_t smooth(int64_t average, int64_t sample)
+{
+	return average == 0 ? sample : average + (sample - average) / 8;
+}
+
+int64_t toUs(FrameGovernor::Clock::duration duration)
+{
+	return std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), 0);
+}
+
+}
+
+FrameGovernor::Stream::Stream(FrameGovernor& governor, Priority priority)
+	: m_governor(governor)
+	, m_priority(priority)
+{
+	std::lock_guard<std::mutex> lock(m_governor.m_mutex);
+	m_governor.m_streams.push_back(this);
+}
+
+FrameGovernor::Stream::~Stream()
+{
+	std::lock_guard<std::mutex> lock(m_governor.m_mutex);
+	auto& streams = m_governor.m_streams;
+	streams.erase(std::remove(streams.begin(), streams.end(), this), streams.end());
+}
+
+void FrameGovernor::Stream::recordDecode(Clock::duration cost, std::optional<std::chrono::milliseconds> delay)
+{
+	// ブラウザと同じく 10ms 未満の遅延は 10ms とみなす
+	int64_t intervalUs = std::max<int64_t>(delay ? delay->count() * 1000 : 0, 10000);
+	m_decodeUs.store(smooth(m_decodeUs.load(std::memory_order_relaxed), toUs(cost)), std::memory_order_relaxed);
+	m_intervalUs.store(smooth(m_intervalUs.load(std::memory_order_relaxed), intervalUs), std::memory_order_relaxed);
+}
+
+bool FrameGovernor::Stream::shouldPresent(bool nextReady)
+{
+	std::lock_guard<std::mutex> lock(m_governor.m_mutex);
+	if (m_divisor > 1 && nextReady && ++m_skipped < m_divisor) {
+		++m_governor.m_stats.skipped;
+		return false;
+	}
+	m_skipped = 0;
+	++m_governor.m_stats.presented;
+	return true;
+}
+
+void FrameGovernor::Stream::recordPresent(Clock::time_point now, Clock::duration lateness, Clock::duration cost)
+{
+	m_presentUs = smooth(m_presentUs, toUs(cost));
+	m_governor.record(now, lateness);
+}
+
+double FrameGovernor::Stream::load() const
+{
+	int64_t intervalUs = m_intervalUs.load(std::memory_order_relaxed);
+	if (intervalUs == 0) {
+		return 0;
+	}
+	double cost = static_cast<double>(m_decodeUs.load(std::memory_order_relaxed) + m_presentUs);
+	return cost * 1e6 / intervalUs / m_divisor;
+}
+
+FrameGovernor::Stats FrameGovernor::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Stats stats = m_stats;
+	stats.latenessMs = m_latenessUs / 1000.0;
+	stats.throttled = std::count_if(m_streams.begin(), m_streams.end(), [](const Stream* stream) { return stream->m_divisor > 1; });
+	return stats;
+}
+
+void FrameGovernor::record(Clock::time_point now, Clock::duration lateness)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_latenessUs += (toUs(lateness) - m_latenessUs) / 8;
+	if (!m_lastAdjust) {
+		m_lastAdjust = now;
+	}
+	else if (now - *m_lastAdjust >= AdjustInterval) {
+		m_lastAdjust = now;
+		adjust(now);
+	}
+}
+
+void FrameGovernor::adjust(Clock::time_point now)
+{
+	// 遅れが大きいほど一度に多くのストリームを間引く。
+	// 戻すのは1ストリームずつで、最後に間引いてから RecoverDelay は待つ (戻したらすぐにまた溢れないように)
+	int steps = 0;
+	bool overloaded = m_latenessUs > toUs(HighWater);
+	if (overloaded) {
+		steps = static_cast<int>(std::min<double>(m_latenessUs / toUs(HighWater), m_streams.size()));
+		m_lastThrottle = now;
+	}
+	else if (m_latenessUs < toUs(LowWater) && (!m_lastThrottle || now - *m_lastThrottle >= RecoverDelay)) {
+		steps = 1;
+	}
+
+	int changed = 0;
+	for (int step = 0; step < steps; ++step) {
+		// 間引くなら Background の重いものから、戻すなら Foreground の軽いものから選ぶ
+		const Priority first = overloaded ? Priority::Background : Priority::Foreground;
+		Stream* target = nullptr;
+		for (Stream* stream : m_streams) {
+			if (overloaded ? stream->m_divisor >= MaxDivisor : stream->m_divisor == 1) {
+				continue;
+			}
+			if (!target) {
+				target = stream;
+			}
+			else if (stream->m_priority != target->m_priority) {
+				if (stream->m_priority == first) {
+					target = stream;
+				}
+			}
+			else if (overloaded ? stream->load() > target->load() : stream->load() < target->load()) {
+				target = stream;
+			}
+		}
+		if (!target) {
+			break;
+		}
+		++changed;
+
+		if (overloaded) {
+			target->m_divisor *= 2;
+		}
+		else {
+			target->m_divisor /= 2;
+		}
+	}
+	if (changed > 0) {
+		size_t throttled[PriorityCount] = {};
+		for (const Stream* stream : m_streams) {
+			throttled[static_cast<size_t>(stream->m_priority)] += stream->m_divisor > 1;
+		}
+		LOGI("Frame governor: lateness %.1f ms, %s %d streams, throttling %zu foreground and %zu background of %zu\n",
+			m_latenessUs / 1000.0, overloaded ? "throttled" : "relaxed", changed,
+			throttled[static_cast<size_t>(Priority::Foreground)], throttled[static_cast<size_t>(Priority::Background)], m_streams.size());
+	}
+}
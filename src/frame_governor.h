@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "workqueue.h"
+
+// 表示が追いつかないときに、ストリームごとに表示するフレームを間引いてメインスレッドの負荷を下げる。
+// メインキューの遅れ (予定の時刻から SetImage() までの時間) を平滑化して見て、
+// HighWater を超えていれば AdjustInterval ごとにストリームの表示の間隔を倍にする (遅れが大きいほど多くのストリームを)。
+// LowWater を下回り、最後に間引いてから RecoverDelay 経っていれば、AdjustInterval ごとに1ストリームずつ半分に戻す。
+// 間引くのは Background が先で、同じ優先度の中では1秒あたりのコスト (展開と合成、表示) が大きいものから。
+// 戻すのは Foreground が先で、軽いものから。
+// 合成は前のフレームに重ねるのでデコードは間引けない。省けるのは表示待ちのスケジュールと SetImage() だけ
+class FrameGovernor {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr std::chrono::milliseconds AdjustInterval{ 250 };
+	static constexpr std::chrono::milliseconds HighWater{ 20 };
+	static constexpr std::chrono::milliseconds LowWater{ 4 };
+	static constexpr std::chrono::milliseconds RecoverDelay{ 1000 };
+	static constexpr int MaxDivisor = 8; // 最も間引いたときに表示する割合 (1/MaxDivisor)
+
+	// 間引きの対象になる1ストリーム。生きている間だけ登録される
+	class Stream {
+	public:
+		Stream(FrameGovernor& governor, Priority priority);
+		~Stream();
+
+		Stream(const Stream&) = delete;
+		Stream& operator=(const Stream&) = delete;
+
+		// ネットワークスレッドで呼ぶ。1フレームの展開と合成にかかった時間と、そのフレームの遅延
+		void recordDecode(Clock::duration cost, std::optional<std::chrono::milliseconds> delay);
+
+		// 以下はメインスレッドで呼ぶ。
+		// このフレームを表示するか。false なら SetImage() を省いて遅延を次のフレームに回す。
+		// nextReady は次のフレームがもう届いているか (届いていなければ間引かない)
+		bool shouldPresent(bool nextReady);
+		// 表示したフレームの遅れと、SetImage() にかかった時間
+		void recordPresent(Clock::time_point now, Clock::duration lateness, Clock::duration cost);
+
+	private:
+		friend class FrameGovernor;
+
+		// 1秒あたりにこのストリームの表示で使う時間 (マイクロ秒)
+		double load() const;
+
+		FrameGovernor& m_governor;
+		const Priority m_priority;
+		std::atomic<int64_t> m_decodeUs{ 0 };   // 1フレームの展開と合成 (平滑化)
+		std::atomic<int64_t> m_intervalUs{ 0 }; // フレームの間隔 (平滑化)
+		int64_t m_presentUs = 0;                // 1フレームの SetImage() (平滑化)
+		int m_divisor = 1;                      // m_divisor フレームに1つ表示する
+		int m_skipped = 0;                      // 最後に表示してから間引いた数
+	};
+
+	struct Stats {
+		uint64_t presented = 0;
+		uint64_t skipped = 0;
+		double latenessMs = 0; // 平滑化した遅れ
+		size_t throttled = 0;  // 間引いているストリームの数
+	};
+
+	FrameGovernor() = default;
+
+	FrameGovernor(const FrameGovernor&) = delete;
+	FrameGovernor& operator=(const FrameGovernor&) = delete;
+
+	Stats stats();
+
+private:
+	void record(Clock::time_point now, Clock::duration lateness);
+	void adjust(Clock::time_point now);
+
+	std::mutex m_mutex; // 以下を守る
+	std::vector<Stream*> m_streams;
+	Stats m_stats;
+	double m_latenessUs = 0;
+	std::optional<Clock::time_point> m_lastAdjust;
+	std::optional<Clock::time_point> m_lastThrottle; // 最後に間引きを増やした時刻
+};
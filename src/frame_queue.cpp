@@ -0,0 +1,117 @@
+#include "frame_queue.h"
+#include "mainwq.h"
+
+#include <algorithm>
+#include <utility>
+
+FrameQueue::FrameQueue(size_t capacity, Priority priority)
+	: m_frames(std::max<size_t>(capacity, 1))
+	, m_priority(priority)
+{
+}
+
+FrameQueue::Frame& FrameQueue::back()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_frames[(m_head + m_count) % m_frames.size()];
+}
+
+void FrameQueue::push()
+{
+	bool consumer;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_count;
+		consumer = std::exchange(m_consumerWaiting, false);
+	}
+	// 再開させた時点で別スレッドで動きだすので、ロックの外で渡す
+	if (consumer) {
+		enqueueWork(m_consumerNode);
+	}
+}
+
+void FrameQueue::pop()
+{
+	std::coroutine_handle<> producer;
+	CurlWorkqueue* wq;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_head = (m_head + 1) % m_frames.size();
+		--m_count;
+		producer = std::exchange(m_producer, nullptr);
+		wq = m_producerWQ;
+	}
+	if (producer) {
+		wq->enqueue(producer, m_priority);
+	}
+}
+
+size_t FrameQueue::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_count;
+}
+
+size_t FrameQueue::memoryUsage()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t bytes = 0;
+	for (const Frame& frame : m_frames) {
+		bytes += frame.image.memoryUsage();
+	}
+	return bytes;
+}
+
+void FrameQueue::close()
+{
+	std::coroutine_handle<> producer;
+	bool consumer;
+	CurlWorkqueue* wq;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		producer = std::exchange(m_producer, nullptr);
+		consumer = std::exchange(m_consumerWaiting, false);
+		wq = m_producerWQ;
+	}
+	if (producer) {
+		wq->enqueue(producer, m_priority);
+	}
+	if (consumer) {
+		enqueueWork(m_consumerNode);
+	}
+}
+
+bool FrameQueue::suspendProducer(std::coroutine_handle<> h, CurlWorkqueue& wq)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_closed || m_count < m_frames.size()) {
+		return false;
+	}
+	m_producer = h;
+	m_producerWQ = &wq;
+	return true;
+}
+
+bool FrameQueue::suspendConsumer(std::coroutine_handle<> h)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_closed || m_count > 0) {
+		return false;
+	}
+	m_consumerNode = Workqueue::Node{ &Workqueue::Work::resumeCoroutine, h.address(), m_priority };
+	m_consumerWaiting = true;
+	return true;
+}
+
+bool FrameQueue::acceptsFrames()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return !m_closed;
+}
+
+FrameQueue::Frame* FrameQueue::frontOrNull()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_count > 0 ? &m_frames[m_head] : nullptr;
+}
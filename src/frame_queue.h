@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "curl_workqueue.h"
+#include "indexed_image.h"
+
+// デコード済みフレームの有限キュー。ネットワークスレッドが書き込み、メインスレッドが表示する。
+// デコードが表示より先に進めるので、ループの切れ目でも次の周回の接続とデコードが再生と重なる。
+// スロットの画像は使い回すので、容量が決まったあとは確保しない。
+class FrameQueue {
+public:
+	struct Frame {
+		IndexedImage image;
+		std::optional<std::chrono::milliseconds> delay; // なければすぐに表示する
+	};
+
+	// 待っている側は priority で再開する
+	explicit FrameQueue(size_t capacity, Priority priority = Priority::Foreground);
+
+	FrameQueue(const FrameQueue&) = delete;
+	FrameQueue& operator=(const FrameQueue&) = delete;
+
+	// 書き込み側。空きができるまで待って wq で再開する。close() されていれば false
+	[[nodiscard]]
+	auto waitForSpace(CurlWorkqueue& wq)
+	{
+		struct Awaitable {
+			bool await_ready() { return false; }
+			bool await_suspend(std::coroutine_handle<> h) { return queue->suspendProducer(h, *wq); }
+			bool await_resume() { return queue->acceptsFrames(); }
+
+			FrameQueue* queue;
+			CurlWorkqueue* wq;
+		};
+		return Awaitable{ this, &wq };
+	}
+	// waitForSpace() が true を返したあとに書き込むスロット
+	Frame& back();
+	// back() に書いたフレームを表示側に渡す
+	void push();
+
+	// 表示側。フレームが来るまで待ってメインスレッドで再開する。
+	// close() されて残りもなければ nullptr
+	[[nodiscard]]
+	auto waitForFrame()
+	{
+		struct Awaitable {
+			bool await_ready() { return false; }
+			bool await_suspend(std::coroutine_handle<> h) { return queue->suspendConsumer(h); }
+			Frame* await_resume() { return queue->frontOrNull(); }
+
+			FrameQueue* queue;
+		};
+		return Awaitable{ this };
+	}
+	// 表示し終わった先頭のフレームを返す
+	void pop();
+
+	// どちらの側からも呼んでよい。待っている側を起こし、以降の書き込みを断る
+	void close();
+
+	size_t capacity() const { return m_frames.size(); }
+	// 表示を待っているフレームの数
+	size_t size();
+	// スロットの画像が使っているバイト数
+	size_t memoryUsage();
+
+private:
+	// 待つ必要がなければ false (中断しない)
+	bool suspendProducer(std::coroutine_handle<> h, CurlWorkqueue& wq);
+	bool suspendConsumer(std::coroutine_handle<> h);
+	bool acceptsFrames();
+	Frame* frontOrNull();
+
+	std::mutex m_mutex;
+	std::vector<Frame> m_frames;
+	size_t m_head = 0;
+	size_t m_count = 0;
+	bool m_closed = false;
+	Priority m_priority;
+	std::coroutine_handle<> m_producer; // 空き待ち
+	CurlWorkqueue* m_producerWQ = nullptr;
+	// フレーム待ち。フレームごとに起こすので、メインキューにはこのノードをつなぐ
+	Workqueue::Node m_consumerNode;
+	bool m_consumerWaiting = false;
+};
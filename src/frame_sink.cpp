@@ -0,0 +1,173 @@
+#include "frame_sink.h"
+#include "indexed_image.h"
+#include "logger.h"
+
+#include <bit>
+#include <cstring>
+
+// 索引は構造体をそのまま書き出す
+static_assert(std::endian::native == std::endian::little);
+
+// ARGB (0xAARRGGBB) を R, G, B, A のバイト列にする
+static void storeRGBA(const uint32_t* argb, size_t count, uint8_t* dst)
+{
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t c = argb[i];
+		dst[i * 4 + 0] = static_cast<uint8_t>(c >> 16);
+		dst[i * 4 + 1] = static_cast<uint8_t>(c >> 8);
+		dst[i * 4 + 2] = static_cast<uint8_t>(c);
+		dst[i * 4 + 3] = static_cast<uint8_t>(c >> 24);
+	}
+}
+
+FrameFormat FrameSink::encode(const IndexedImage& image, FrameFormat format, std::vector<uint8_t>& buffer)
+{
+	const size_t pixelCount = static_cast<size_t>(image.width()) * image.height();
+	if (format == FrameFormat::Indexed && image.indexed() && image.palette()) {
+		buffer.resize(256 * 4 + pixelCount);
+		storeRGBA(image.palette()->colors, 256, buffer.data());
+		memcpy(buffer.data() + 256 * 4, image.indices(), pixelCount);
+		return FrameFormat::Indexed;
+	}
+
+	buffer.resize(pixelCount * 4);
+	if (image.indexed()) {
+		// ARGB の一時バッファを作らずにパレットから直接並べる。パレットがなければまだ何も描かれていない
+		static const uint32_t empty[256] = {};
+		const uint32_t* colors = image.palette() ? image.palette()->colors : empty;
+		const uint8_t* indices = image.indices();
+		uint8_t* dst = buffer.data();
+		for (size_t i = 0; i < pixelCount; ++i) {
+			storeRGBA(&colors[indices[i]], 1, dst + i * 4);
+		}
+	}
+	else {
+		storeRGBA(image.argb(), pixelCount, buffer.data());
+	}
+	return FrameFormat::RGBA;
+}
+
+RawFrameSink::RawFrameSink(std::string directory, std::vector<std::string> names, FrameFormat format)
+	: m_directory(std::move(directory))
+	, m_names(std::move(names))
+	, m_format(format)
+{
+}
+
+bool RawFrameSink::write(size_t fileIndex, size_t frameIndex, const IndexedImage& image,
+	std::optional<std::chrono::milliseconds> delay)
+{
+	// ネットワークスレッドごとに使い回す
+	thread_local std::vector<uint8_t> buffer;
+	FrameFormat format = encode(image, m_format, buffer);
+
+	char name[64];
+	snprintf(name, sizeof(name), "_%04zu_%dx%d.%s", frameIndex, image.width(), image.height(),
+		format == FrameFormat::Indexed ? "idx" : "rgba");
+	std::string path = m_directory + "/" + m_names[fileIndex] + name;
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		LOGE("Failed to open %s\n", path.c_str());
+		return false;
+	}
+	const size_t written = fwrite(buffer.data(), 1, buffer.size(), file);
+	// fclose() で残りが書き出されるので、その失敗も書けなかったことになる
+	if (fclose(file) != 0 || written != buffer.size()) {
+		LOGE("Failed to write %s\n", path.c_str());
+		remove(path.c_str());
+		return false;
+	}
+	m_bytes += written;
+	return true;
+}
+
+PackFrameSink::PackFrameSink(const char* path, std::vector<std::string> names, FrameFormat format)
+	: m_path(path)
+	, m_names(std::move(names))
+	, m_format(format)
+{
+	m_file = fopen(path, "wb");
+	if (m_file) {
+		m_failed = fwrite(Magic, 1, sizeof(Magic), m_file) != sizeof(Magic);
+		m_offset = sizeof(Magic);
+	}
+}
+
+PackFrameSink::~PackFrameSink()
+{
+	if (m_file) {
+		fclose(m_file);
+	}
+}
+
+bool PackFrameSink::write(size_t fileIndex, size_t frameIndex, const IndexedImage& image,
+	std::optional<std::chrono::milliseconds> delay)
+{
+	// 並べ替えはロックの外で済ませ、追記だけを直列にする
+	thread_local std::vector<uint8_t> buffer;
+	FrameFormat format = encode(image, m_format, buffer);
+
+	PackEntry entry = {};
+	entry.file = static_cast<uint32_t>(fileIndex);
+	entry.frame = static_cast<uint32_t>(frameIndex);
+	entry.width = static_cast<uint16_t>(image.width());
+	entry.height = static_cast<uint16_t>(image.height());
+	entry.format = static_cast<uint8_t>(format);
+	entry.hasDelay = delay.has_value();
+	entry.delayMs = delay ? static_cast<uint32_t>(delay->count()) : 0;
+	entry.size = buffer.size();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_file || m_failed) {
+		return false;
+	}
+	entry.offset = m_offset;
+	if (fwrite(buffer.data(), 1, buffer.size(), m_file) != buffer.size()) {
+		// どこまで書けたか分からず索引と合わなくなるので、以降は書かずに finish() で捨てる
+		LOGE("Failed to write a frame to %s\n", m_path.c_str());
+		m_failed = true;
+		return false;
+	}
+	m_offset += buffer.size();
+	m_bytes += buffer.size();
+	m_entries.push_back(entry);
+	return true;
+}
+
+bool PackFrameSink::finish()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_file) {
+		return false;
+	}
+
+	PackFooter footer = {};
+	footer.indexOffset = m_offset;
+	footer.entryCount = static_cast<uint32_t>(m_entries.size());
+	footer.fileCount = static_cast<uint32_t>(m_names.size());
+	memcpy(footer.magic, Magic, sizeof(Magic));
+
+	uint64_t size = fwrite(m_entries.data(), sizeof(PackEntry), m_entries.size(), m_file) * sizeof(PackEntry);
+	uint64_t expected = m_entries.size() * sizeof(PackEntry);
+	for (const std::string& name : m_names) {
+		uint32_t length = static_cast<uint32_t>(name.size());
+		size += fwrite(&length, 1, sizeof(length), m_file);
+		size += fwrite(name.data(), 1, name.size(), m_file);
+		expected += sizeof(length) + name.size();
+	}
+	size += fwrite(&footer, 1, sizeof(footer), m_file);
+	expected += sizeof(footer);
+	m_bytes += size;
+
+	if (fclose(m_file) != 0 || size != expected) {
+		m_failed = true;
+	}
+	m_file = nullptr;
+	// 索引まで揃っていないパックは読めないので残さない
+	if (m_failed) {
+		LOGE("Failed to write %s\n", m_path.c_str());
+		remove(m_path.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+class IndexedImage;
+
+// フレームの書き出し形式
+enum class FrameFormat {
+	RGBA,    // width * height * 4 バイト (R, G, B, A の順)
+	Indexed, // パレット 256 * 4 バイト (RGBA) + width * height バイトのインデックス。パレットで表せないフレームは RGBA
+};
+
+// デコード済みフレームの書き出し先。write() は複数のネットワークスレッドから同時に呼ばれる
+class FrameSink {
+public:
+	virtual ~FrameSink() = default;
+
+	// fileIndex はバッチ内のファイルの番号、frameIndex はファイル内のフレームの番号。書き出せなければ false
+	virtual bool write(size_t fileIndex, size_t frameIndex, const IndexedImage& image,
+		std::optional<std::chrono::milliseconds> delay) = 0;
+	// すべてのファイルを書き終えたら呼ぶ。書き出しに失敗していれば false
+	virtual bool finish() { return true; }
+
+	// 書き出したバイト数
+	uint64_t bytesWritten() const { return m_bytes; }
+
+protected:
+	// image を format で buffer に並べ、実際に使った形式を返す
+	static FrameFormat encode(const IndexedImage& image, FrameFormat format, std::vector<uint8_t>& buffer);
+
+	std::atomic<uint64_t> m_bytes{ 0 };
+};
+
+// 1フレーム1ファイルで directory に書き出す。
+// ファイル名は <名前>_<フレーム番号>_<幅>x<高さ>.rgba または .idx
+class RawFrameSink : public FrameSink {
+public:
+	// names[fileIndex] がファイル名の <名前> になる
+	RawFrameSink(std::string directory, std::vector<std::string> names, FrameFormat format);
+
+	// 書ききれなかったフレームのファイルは消す
+	bool write(size_t fileIndex, size_t frameIndex, const IndexedImage& image,
+		std::optional<std::chrono::milliseconds> delay) override;
+
+private:
+	std::string m_directory;
+	std::vector<std::string> m_names;
+	FrameFormat m_format;
+};
+
+// すべてのフレームを1つのファイルにまとめる。データはできた順に追記し、finish() で末尾に索引を書く。
+//   "GIFPACK1"
+//   フレームのデータ ...
+//   PackEntry * entryCount
+//   ファイル名 * fileCount (uint32_t の長さ + UTF-8)
+//   PackFooter
+// 数値はすべてリトルエンディアン
+class PackFrameSink : public FrameSink {
+public:
+	static constexpr char Magic[8] = { 'G', 'I', 'F', 'P', 'A', 'C', 'K', '1' };
+
+	struct PackEntry {
+		uint32_t file;
+		uint32_t frame;
+		uint16_t width;
+		uint16_t height;
+		uint8_t format; // FrameFormat
+		uint8_t hasDelay;
+		uint16_t reserved;
+		uint32_t delayMs;
+		uint32_t reserved2;
+		uint64_t offset; // ファイル先頭から
+		uint64_t size;
+	};
+	static_assert(sizeof(PackEntry) == 40);
+
+	struct PackFooter {
+		uint64_t indexOffset;
+		uint32_t entryCount;
+		uint32_t fileCount;
+		char magic[8];
+	};
+	static_assert(sizeof(PackFooter) == 24);
+
+	// path を開けなければ ok() が false になり、書き込みは捨てられる。
+	// 途中で書き込みに失敗したら以降のフレームも捨て、finish() でファイルを消して false を返す
+	PackFrameSink(const char* path, std::vector<std::string> names, FrameFormat format);
+	~PackFrameSink() override;
+
+	PackFrameSink(const PackFrameSink&) = delete;
+	PackFrameSink& operator=(const PackFrameSink&) = delete;
+
+	bool ok() const { return m_file != nullptr; }
+
+	bool write(size_t fileIndex, size_t frameIndex, const IndexedImage& image,
+		std::optional<std::chrono::milliseconds> delay) override;
+	bool finish() override;
+
+private:
+	std::string m_path;
+	std::vector<std::string> m_names;
+	FrameFormat m_format;
+
+	std::mutex m_mutex; // 以下を守る
+	FILE* m_file;
+	bool m_failed = false;
+	uint64_t m_offset = 0;
+	std::vector<PackEntry> m_entries;
+};
@@ -1,121 +1,256 @@
-#include "gif.h"
-#include <stdexcept>
-
-#include <iostream>
-#include <vector>
-#include <unordered_map>
-#include <cstdint>
-#include <cassert>
-
-class GifLZWDecoder {
-public:
-	GifLZWDecoder(const std::vector<uint8_t>& input, int initCodeSize)
-		: data(input), initialCodeSize(initCodeSize)
-	{
-		dataPos = 0;
-		bitPos = 0;
-	}
-
-	std::vector<uint8_t> decode() {
-		std::vector<uint8_t> output;
-
-		initDictionary();
-
-		int codeSize = initialCodeSize + 1;
-		int clearCode = 1 << initialCodeSize;
-		int endCode = clearCode + 1;
-		int nextCode = endCode + 1;
-		int prevCode = -1;
-
-		while (true) {
-			int code = readCode(codeSize);
-			if (code == clearCode) {
-				initDictionary();
-				codeSize = initialCodeSize + 1;
-				nextCode = endCode + 1;
-				prevCode = -1;
-				continue;
-			}
-			else if (code == endCode) {
-				break;
-			}
-
-			std::vector<uint8_t> entry;
-
-			if (code < nextCode && dictionary.count(code)) {
-				entry = dictionary[code];
-			}
-			else if (code == nextCode && prevCode != -1) {
-				entry = dictionary[prevCode];
-				entry.push_back(entry.front());
-			}
-			else {
-				throw std::runtime_error("Invalid LZW code");
-			}
-
-			output.insert(output.end(), entry.begin(), entry.end());
-
-			if (prevCode != -1) {
-				std::vector<uint8_t> newEntry = dictionary[prevCode];
-				newEntry.push_back(entry.front());
-				dictionary[nextCode++] = newEntry;
-
-				if (nextCode == (1 << codeSize) && codeSize < 12) {
-					codeSize++;
-				}
-			}
-
-			prevCode = code;
-		}
-
-		return output;
-	}
-
-private:
-	const std::vector<uint8_t>& data;
-	int initialCodeSize;
-	size_t dataPos;
-	int bitPos;
-	std::unordered_map<int, std::vector<uint8_t>> dictionary;
-
-	void initDictionary() {
-		dictionary.clear();
-		int dictSize = 1 << initialCodeSize;
-		for (int i = 0; i < dictSize; ++i) {
-			dictionary[i] = { static_cast<uint8_t>(i) };
-		}
-	}
-
-	int readCode(int codeSize) {
-		int rawCode = 0;
-		int bitsRead = 0;
-
-		while (bitsRead < codeSize) {
-			if (dataPos >= data.size()) throw std::runtime_error("Unexpected end of data");
-			uint8_t byte = data[dataPos];
-
-			int availableBits = 8 - bitPos;
-			int bitsToRead = std::min(codeSize - bitsRead, availableBits);
-			int mask = ((1 << bitsToRead) - 1) << bitPos;
-
-			rawCode |= ((byte & mask) >> bitPos) << bitsRead;
-
-			bitsRead += bitsToRead;
-			bitPos += bitsToRead;
-
-			if (bitPos >= 8) {
-				bitPos = 0;
-				++dataPos;
-			}
-		}
-
-		return rawCode;
-	}
-};
-
-// LZWfR[hp̊֐
-std::vector<uint8_t> decodeLZW(const std::vector<uint8_t>& compressedData, uint8_t minCodeSize)
-{
-	GifLZWDecoder decoder(compressedData, minCodeSize);
-	return decoder.decode();
-}
+#include "gif.h"
+#include <stdexcept>
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cassert>
+
+size_t interlacedRowsThroughPass(int pass, size_t height)
+{
+	// 各パスの行数は (height + 7) / 8, (height + 3) / 8, (height + 1) / 4, height / 2
+	static constexpr size_t Add[4] = { 7, 3, 1, 0 };
+	static constexpr size_t Div[4] = { 8, 8, 4, 2 };
+	size_t rows = 0;
+	for (int i = 0; i <= pass && i < 4; ++i) {
+		rows += (height + Add[i]) / Div[i];
+	}
+	return rows;
+}
+
+size_t interlacedRowIndex(size_t y, size_t height)
+{
+	if (y % 8 == 0) {
+		return y / 8;
+	}
+	if (y % 8 == 4) {
+		return interlacedRowsThroughPass(0, height) + y / 8;
+	}
+	if (y % 4 == 2) {
+		return interlacedRowsThroughPass(1, height) + y / 4;
+	}
+	return interlacedRowsThroughPass(2, height) + y / 2;
+}
+
+namespace {
+
+inline void reserve(std::vector<uint8_t>& output, size_t outPos, size_t len)
+{
+	if (outPos + len + GifLZWDecoder::Slack > output.size()) {
+		output.resize(std::max(output.size() * 2, outPos + len + GifLZWDecoder::Slack));
+	}
+}
+
+// dst > src であること。dst の後ろ Slack バイトまでは書き潰してよい。
+inline void copyString(uint8_t* dst, const uint8_t* src, size_t len)
+{
+	size_t distance = dst - src;
+	if (distance >= 16) {
+		for (size_t i = 0; i < len; i += 16) {
+			memcpy(dst + i, src + i, 16);
+		}
+	}
+	else if (distance >= 8) {
+		for (size_t i = 0; i < len; i += 8) {
+			memcpy(dst + i, src + i, 8);
+		}
+	}
+	else {
+		for (size_t i = 0; i < len; ++i) {
+			dst[i] = src[i];
+		}
+	}
+}
+
+// 64bit のビットバッファに読み足す (GIF は LSB ファースト、リトルエンディアン前提)。読み進めた位置を返す
+inline const uint8_t* refill(const uint8_t* dataPos, const uint8_t* dataEnd, uint64_t& bitBuffer, int& bitCount)
+{
+	if (dataEnd - dataPos >= 8) {
+		uint64_t word;
+		memcpy(&word, dataPos, 8);
+		bitBuffer |= word << bitCount;
+		size_t bytes = (63 - bitCount) >> 3;
+		dataPos += bytes;
+		bitCount += static_cast<int>(bytes * 8);
+	}
+	else {
+		while (bitCount <= 56 && dataPos < dataEnd) {
+			bitBuffer |= static_cast<uint64_t>(*dataPos++) << bitCount;
+			bitCount += 8;
+		}
+	}
+	return dataPos;
+}
+
+}
+
+void GifLZWDecoder::reset(uint8_t minCodeSize, size_t maxOutputSize, std::vector<uint8_t>& output, size_t sizeHint)
+{
+	if (minCodeSize < 1 || minCodeSize > 11) {
+		throw std::runtime_error("Invalid LZW minimum code size");
+	}
+	m_output = &output;
+	m_minCodeSize = minCodeSize;
+	m_maxOutputSize = maxOutputSize;
+	m_outPos = 0;
+	m_inputSize = 0;
+	m_done = false;
+	m_bitBuffer = 0;
+	m_bitCount = 0;
+	m_codeSize = minCodeSize + 1;
+	m_nextCode = (1 << minCodeSize) + 2;
+	m_prevCode = -1;
+	m_prevPos = 0;
+	m_prevLen = 0;
+
+	// 呼び出し側のバッファをそのまま使う。容量が足りていれば確保しない
+	output.resize(std::min(std::max<size_t>(sizeHint, 4096), maxOutputSize) + Slack);
+}
+
+void GifLZWDecoder::feed(const uint8_t* data, size_t size)
+{
+	if (m_done) {
+		return;
+	}
+	m_dataPos = data;
+	m_dataEnd = data + size;
+	m_inputSize += size;
+	// ほとんどの GIF は最小コードサイズ 8 なので定数として展開した版を使う
+	if (m_minCodeSize == 8) {
+		decodeImpl<8>();
+	}
+	else {
+		decodeImpl<0>();
+	}
+}
+
+void GifLZWDecoder::finish()
+{
+	if (!m_done) {
+		throw std::runtime_error("Unexpected end of data");
+	}
+	m_output->resize(m_outPos);
+}
+
+template <int MinCodeSize>
+void GifLZWDecoder::decodeImpl()
+{
+	const int minCodeSize = MinCodeSize ? MinCodeSize : m_minCodeSize;
+	const int clearCode = 1 << minCodeSize;
+	const int endCode = clearCode + 1;
+
+	// 状態はループの間ローカルに置き、データを使い切ったら戻す。
+	// 出力への書き込みはメンバーを書き換えうるとみなされるので、ループ内ではメンバーを読まない
+	std::vector<uint8_t>& output = *m_output;
+	const size_t maxOutputSize = m_maxOutputSize;
+	uint32_t* const codeOffset = m_codeOffset;
+	uint16_t* const codeLength = m_codeLength;
+	const uint8_t* dataPos = m_dataPos;
+	const uint8_t* const dataEnd = m_dataEnd;
+	uint64_t bitBuffer = m_bitBuffer;
+	int bitCount = m_bitCount;
+	size_t outPos = m_outPos;
+	int codeSize = m_codeSize;
+	int codeMask = (1 << codeSize) - 1;
+	int nextCode = m_nextCode;
+	int prevCode = m_prevCode;
+	size_t prevPos = m_prevPos;
+	size_t prevLen = m_prevLen;
+
+	while (true) {
+		if (bitCount < codeSize) {
+			dataPos = refill(dataPos, dataEnd, bitBuffer, bitCount);
+			if (bitCount < codeSize) {
+				break; // 続きのサブブロックを待つ
+			}
+		}
+		int code = static_cast<int>(bitBuffer) & codeMask;
+		bitBuffer >>= codeSize;
+		bitCount -= codeSize;
+
+		if (code == clearCode) {
+			codeSize = minCodeSize + 1;
+			codeMask = (1 << codeSize) - 1;
+			nextCode = endCode + 1;
+			prevCode = -1;
+			continue;
+		}
+		else if (code == endCode) {
+			m_done = true;
+			break;
+		}
+
+		size_t pos = outPos;
+		size_t len;
+		if (code < clearCode) {
+			reserve(output, outPos, 1);
+			output[outPos] = static_cast<uint8_t>(code);
+			len = 1;
+		}
+		else if (code < nextCode) {
+			len = codeLength[code];
+			reserve(output, outPos, len);
+			copyString(output.data() + outPos, output.data() + codeOffset[code], len);
+		}
+		else if (code == nextCode && prevCode != -1) {
+			// 直前の文字列 + その先頭文字。コピー元と先が重なるが前から順に写せば成り立つ。
+			len = prevLen + 1;
+			reserve(output, outPos, len);
+			copyString(output.data() + outPos, output.data() + prevPos, len);
+		}
+		else {
+			throw std::runtime_error("Invalid LZW code");
+		}
+		outPos += len;
+		if (outPos >= maxOutputSize) {
+			outPos = maxOutputSize;
+			m_done = true;
+			break;
+		}
+
+		if (prevCode != -1 && nextCode < MaxCodes) {
+			// 新しいエントリは直前の文字列 + 今回の先頭文字で、出力上では prevPos から連続している
+			codeOffset[nextCode] = static_cast<uint32_t>(prevPos);
+			codeLength[nextCode] = static_cast<uint16_t>(prevLen + 1);
+			nextCode++;
+
+			if (nextCode == (1 << codeSize) && codeSize < 12) {
+				codeSize++;
+				codeMask = (1 << codeSize) - 1;
+			}
+		}
+
+		prevCode = code;
+		prevPos = pos;
+		prevLen = len;
+	}
+
+	m_dataPos = dataPos;
+	m_bitBuffer = bitBuffer;
+	m_bitCount = bitCount;
+	m_outPos = outPos;
+	m_codeSize = codeSize;
+	m_nextCode = nextCode;
+	m_prevCode = prevCode;
+	m_prevPos = prevPos;
+	m_prevLen = prevLen;
+}
+
+
+// LZWデコード用の関数
+std::vector<uint8_t> decodeLZW(const std::vector<uint8_t>& compressedData, uint8_t minCodeSize, size_t maxOutputSize)
+{
+	std::vector<uint8_t> output;
+	decodeLZW(compressedData, minCodeSize, maxOutputSize, output);
+	return output;
+}
+
+void decodeLZW(const std::vector<uint8_t>& compressedData, uint8_t minCodeSize, size_t maxOutputSize, std::vector<uint8_t>& output)
+{
+	GifLZWDecoder decoder;
+	decoder.reset(minCodeSize, maxOutputSize, output, compressedData.size() * 4);
+	decoder.feed(compressedData.data(), compressedData.size());
+	decoder.finish();
+}
@@ -1,51 +1,110 @@
-#pragma once
-
-#include <stdint.h>
-#include <vector>
-
-#ifdef _MSC_VER
-__pragma(pack(push, 1))
-#else
-#pragma pack(push, 1)
-#endif
-
-struct GIFHeader {
-	char signature[3]; // "GIF"
-	char version[3];   // "87a" or "89a"
-};
-static_assert(sizeof(GIFHeader) == 6);
-
-struct LogicalScreenDescriptor {
-	uint16_t width;
-	uint16_t height;
-	uint8_t packedFields;
-	uint8_t backgroundColorIndex;
-	uint8_t pixelAspectRatio;
-};
-static_assert(sizeof(LogicalScreenDescriptor) == 7);
-
-struct GraphicControlExtension {
-	uint8_t packedFields;
-	uint16_t delayTime;
-	uint8_t transparentColorIndex;
-};
-static_assert(sizeof(GraphicControlExtension) == 4);
-
-struct ImageDescriptor {
-	uint16_t left;
-	uint16_t top;
-	uint16_t width;
-	uint16_t height;
-	uint8_t packedFields;
-};
-static_assert(sizeof(ImageDescriptor) == 9);
-
-
-#ifdef _MSC_VER
-__pragma(pack(pop))
-#else
-#pragma pack(pop)
-#endif
-
-
-std::vector<uint8_t> decodeLZW(const std::vector<uint8_t>& compressedData, uint8_t minCodeSize);
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#ifdef _MSC_VER
+__pragma(pack(push, 1))
+#else
+#pragma pack(push, 1)
+#endif
+
+struct GIFHeader {
+	char signature[3]; // "GIF"
+	char version[3];   // "87a" or "89a"
+};
+static_assert(sizeof(GIFHeader) == 6);
+
+struct LogicalScreenDescriptor {
+	uint16_t width;
+	uint16_t height;
+	uint8_t packedFields;
+	uint8_t backgroundColorIndex;
+	uint8_t pixelAspectRatio;
+};
+static_assert(sizeof(LogicalScreenDescriptor) == 7);
+
+struct GraphicControlExtension {
+	uint8_t packedFields;
+	uint16_t delayTime;
+	uint8_t transparentColorIndex;
+};
+static_assert(sizeof(GraphicControlExtension) == 4);
+
+struct ImageDescriptor {
+	uint16_t left;
+	uint16_t top;
+	uint16_t width;
+	uint16_t height;
+	uint8_t packedFields;
+};
+static_assert(sizeof(ImageDescriptor) == 9);
+
+
+#ifdef _MSC_VER
+__pragma(pack(pop))
+#else
+#pragma pack(pop)
+#endif
+
+
+// インターレースの GIF は 8行おき、8行おき (4行目から)、4行おき (2行目から)、2行おき (1行目から) の
+// 4つのパスで行が並ぶ。pass 番目 (0 から) のパスまでで届いている行数
+size_t interlacedRowsThroughPass(int pass, size_t height);
+// 上から y 行目がデータの何行目にあるか
+size_t interlacedRowIndex(size_t y, size_t height);
+
+// サブブロックを届いた順に渡して少しずつ展開する LZW デコーダー。
+// 辞書の文字列は展開済みのデータを指すので、展開が終わるまで output には触らないこと (読むのはよい)。
+class GifLZWDecoder {
+public:
+	static constexpr int MaxCodes = 4096;
+	// 出力バッファの末尾の余白。文字列コピーは 8/16 バイト単位で書くのではみ出す分を確保しておく。
+	static constexpr size_t Slack = 16;
+
+	// output に展開し直す。maxOutputSize を超える分の出力は捨てる (フレームの画素数を渡す)。
+	// sizeHint は最初に確保する大きさの目安。minCodeSize が不正なら例外
+	void reset(uint8_t minCodeSize, size_t maxOutputSize, std::vector<uint8_t>& output, size_t sizeHint = 4096);
+	// data を続きとして展開する。done() のあとに渡したデータは捨てる。不正なコードなら例外
+	void feed(const uint8_t* data, size_t size);
+	// 終端コードを読んだか、maxOutputSize まで展開した
+	bool done() const { return m_done; }
+	// 展開済みのバイト数。output の先頭からこの長さは確定している
+	size_t size() const { return m_outPos; }
+	// これまでに渡した圧縮データのバイト数
+	size_t inputSize() const { return m_inputSize; }
+	// output を展開済みの長さに切り詰める。終端に達していなければ例外
+	void finish();
+
+private:
+	template <int MinCodeSize>
+	void decodeImpl();
+
+	std::vector<uint8_t>* m_output = nullptr;
+	int m_minCodeSize = 0;
+	size_t m_maxOutputSize = 0;
+	size_t m_outPos = 0;
+	size_t m_inputSize = 0;
+	bool m_done = false;
+
+	const uint8_t* m_dataPos = nullptr;
+	const uint8_t* m_dataEnd = nullptr;
+	uint64_t m_bitBuffer = 0;
+	int m_bitCount = 0;
+
+	int m_codeSize = 0;
+	int m_nextCode = 0;
+	int m_prevCode = -1;
+	size_t m_prevPos = 0;
+	size_t m_prevLen = 0;
+
+	// 辞書の各コードの文字列は出力済みデータのどこかに必ず現れるので、位置と長さだけを持つ
+	uint32_t m_codeOffset[MaxCodes];
+	uint16_t m_codeLength[MaxCodes];
+};
+
+// maxOutputSize を超える分の出力は捨てる (フレームの画素数を渡す)
+std::vector<uint8_t> decodeLZW(const std::vector<uint8_t>& compressedData, uint8_t minCodeSize, size_t maxOutputSize = SIZE_MAX);
+// output の容量を使い回す版。output の中身は置き換わる
+void decodeLZW(const std::vector<uint8_t>& compressedData, uint8_t minCodeSize, size_t maxOutputSize, std::vector<uint8_t>& output);
@@ -0,0 +1,369 @@
+#include "gif_encoder.h"
+#include "gif.h"
+
+#include <algorithm>
+#include <cstring>
+
+FileGifWriter::FileGifWriter(const char* path)
+	: m_path(path)
+{
+	m_file = fopen(path, "wb");
+	m_failed = m_file == nullptr;
+}
+
+FileGifWriter::~FileGifWriter()
+{
+	if (m_file) {
+		fclose(m_file);
+		remove(m_path.c_str());
+	}
+}
+
+void FileGifWriter::write(const void* data, size_t size)
+{
+	if (m_file && !m_failed && fwrite(data, 1, size, m_file) != size) {
+		m_failed = true;
+	}
+}
+
+bool FileGifWriter::close()
+{
+	if (!m_file) {
+		return false;
+	}
+	// fclose() で書き出す分も失敗しうる
+	if (fclose(m_file) != 0) {
+		m_failed = true;
+	}
+	m_file = nullptr;
+	if (m_failed) {
+		remove(m_path.c_str());
+	}
+	return !m_failed;
+}
+
+namespace {
+
+// 出力したコードをビット列にまとめ、255 バイトたまるたびにサブブロックとして書き出す
+class LZWBitWriter {
+public:
+	explicit LZWBitWriter(GifWriter& writer) : m_writer(writer) {}
+
+	void put(int code, int codeSize)
+	{
+		m_bitBuffer |= static_cast<uint32_t>(code) << m_bitCount;
+		m_bitCount += codeSize;
+		while (m_bitCount >= 8) {
+			m_block[1 + m_blockSize++] = static_cast<uint8_t>(m_bitBuffer);
+			m_bitBuffer >>= 8;
+			m_bitCount -= 8;
+			if (m_blockSize == 255) {
+				flushBlock();
+			}
+		}
+	}
+
+	void finish()
+	{
+		if (m_bitCount > 0) {
+			m_block[1 + m_blockSize++] = static_cast<uint8_t>(m_bitBuffer);
+			m_bitBuffer = 0;
+			m_bitCount = 0;
+			if (m_blockSize == 255) {
+				flushBlock();
+			}
+		}
+		flushBlock();
+		uint8_t terminator = 0;
+		m_writer.write(&terminator, 1);
+	}
+
+private:
+	void flushBlock()
+	{
+		if (m_blockSize == 0) {
+			return;
+		}
+		m_block[0] = static_cast<uint8_t>(m_blockSize);
+		m_writer.write(m_block, m_blockSize + 1);
+		m_blockSize = 0;
+	}
+
+	GifWriter& m_writer;
+	uint32_t m_bitBuffer = 0;
+	int m_bitCount = 0;
+	uint8_t m_block[256];
+	size_t m_blockSize = 0;
+};
+
+}
+
+void encodeLZW(GifWriter& writer, const uint8_t* indices, size_t count, uint8_t minCodeSize)
+{
+	constexpr int MaxCodes = 4096;
+	// (prefix << 8 | 次の文字) -> コード の開番地法ハッシュ。辞書がいっぱいでも半分しか埋まらない大きさにする。
+	// キーは上位ビットに偏るので、掛け算で混ぜてから上位ビットを使う
+	constexpr int HashBits = 13;
+	constexpr size_t HashSize = size_t(1) << HashBits;
+	static thread_local int32_t hashKeys[HashSize];
+	static thread_local uint16_t hashCodes[HashSize];
+
+	const int clearCode = 1 << minCodeSize;
+	const int endCode = clearCode + 1;
+
+	LZWBitWriter bits(writer);
+	int codeSize = minCodeSize + 1;
+	int nextCode = endCode + 1;
+	std::fill(std::begin(hashKeys), std::end(hashKeys), -1);
+	bits.put(clearCode, codeSize);
+
+	if (count == 0) {
+		bits.put(endCode, codeSize);
+		bits.finish();
+		return;
+	}
+
+	int prefix = indices[0];
+	for (size_t i = 1; i < count; ++i) {
+		const int c = indices[i];
+		const int32_t key = (prefix << 8) | c;
+		size_t h = (static_cast<uint32_t>(key) * 2654435761u) >> (32 - HashBits);
+		while (hashKeys[h] != -1 && hashKeys[h] != key) {
+			h = (h + 1) & (HashSize - 1);
+		}
+		if (hashKeys[h] == key) {
+			prefix = hashCodes[h];
+			continue;
+		}
+
+		bits.put(prefix, codeSize);
+		if (nextCode < MaxCodes) {
+			hashKeys[h] = key;
+			hashCodes[h] = static_cast<uint16_t>(nextCode++);
+			// デコーダは1コード遅れて辞書に追加するので、それに合わせてコード長を伸ばす
+			if (nextCode - 1 == (1 << codeSize) && codeSize < 12) {
+				codeSize++;
+			}
+		}
+		else {
+			bits.put(clearCode, codeSize);
+			codeSize = minCodeSize + 1;
+			nextCode = endCode + 1;
+			std::fill(std::begin(hashKeys), std::end(hashKeys), -1);
+		}
+		prefix = c;
+	}
+	bits.put(prefix, codeSize);
+	bits.put(endCode, codeSize);
+	bits.finish();
+}
+
+GifEncoder::GifEncoder(GifWriter& writer, int width, int height, uint16_t loopCount)
+	: m_counter(writer)
+	, m_width(width)
+	, m_height(height)
+	, m_previous(static_cast<size_t>(width) * height)
+{
+	GIFHeader header = { { 'G', 'I', 'F' }, { '8', '9', 'a' } };
+	m_counter.write(&header, sizeof(header));
+
+	// グローバルカラーテーブルは持たず、フレームごとにローカルカラーテーブルを付ける
+	LogicalScreenDescriptor lsd = {};
+	lsd.width = static_cast<uint16_t>(width);
+	lsd.height = static_cast<uint16_t>(height);
+	lsd.packedFields = 0x70; // 色解像度 8bit
+	m_counter.write(&lsd, sizeof(lsd));
+
+	const uint8_t netscape[] = {
+		0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+		0x03, 0x01, static_cast<uint8_t>(loopCount & 0xFF), static_cast<uint8_t>(loopCount >> 8), 0x00,
+	};
+	m_counter.write(netscape, sizeof(netscape));
+}
+
+bool GifEncoder::buildExactPalette(const uint32_t* canvas, int left, int top, int right, int bottom, bool transparent)
+{
+	std::fill(std::begin(m_colorKeys), std::end(m_colorKeys), NoColor);
+	m_colors.clear();
+	m_transparentIndex = -1;
+	if (transparent) {
+		m_transparentIndex = 0;
+		m_colors.push_back(0);
+	}
+
+	uint8_t* dst = m_indices.data();
+	for (int y = top; y < bottom; ++y) {
+		const uint32_t* src = canvas + static_cast<size_t>(y) * m_width;
+		const uint32_t* previous = m_previous.data() + static_cast<size_t>(y) * m_width;
+		for (int x = left; x < right; ++x) {
+			const uint32_t rgb = src[x] & 0xFFFFFF;
+			if (transparent && rgb == previous[x]) {
+				*dst++ = static_cast<uint8_t>(m_transparentIndex);
+				continue;
+			}
+			size_t h = (rgb * 0x9E3779B1u) >> (32 - ColorHashBits);
+			while (m_colorKeys[h] != NoColor && m_colorKeys[h] != rgb) {
+				h = (h + 1) & (ColorHashSize - 1);
+			}
+			if (m_colorKeys[h] == NoColor) {
+				if (m_colors.size() == 256) {
+					return false;
+				}
+				m_colorKeys[h] = rgb;
+				m_colorValues[h] = static_cast<uint8_t>(m_colors.size());
+				m_colors.push_back(rgb);
+			}
+			*dst++ = m_colorValues[h];
+		}
+	}
+	return true;
+}
+
+void GifEncoder::buildCubePalette(const uint32_t* canvas, int left, int top, int right, int bottom, bool transparent)
+{
+	// 6x7x6 = 252 色。透明色を足しても 256 に収まる
+	m_colors.clear();
+	for (int r = 0; r < 6; ++r) {
+		for (int g = 0; g < 7; ++g) {
+			for (int b = 0; b < 6; ++b) {
+				m_colors.push_back((r * 255 / 5) << 16 | (g * 255 / 6) << 8 | (b * 255 / 5));
+			}
+		}
+	}
+	m_transparentIndex = -1;
+	if (transparent) {
+		m_transparentIndex = static_cast<int>(m_colors.size());
+		m_colors.push_back(0);
+	}
+
+	uint8_t* dst = m_indices.data();
+	for (int y = top; y < bottom; ++y) {
+		const uint32_t* src = canvas + static_cast<size_t>(y) * m_width;
+		const uint32_t* previous = m_previous.data() + static_cast<size_t>(y) * m_width;
+		for (int x = left; x < right; ++x) {
+			const uint32_t rgb = src[x] & 0xFFFFFF;
+			if (transparent && rgb == previous[x]) {
+				*dst++ = static_cast<uint8_t>(m_transparentIndex);
+				continue;
+			}
+			const int r = ((rgb >> 16) & 0xFF) * 5 + 127;
+			const int g = ((rgb >> 8) & 0xFF) * 6 + 127;
+			const int b = (rgb & 0xFF) * 5 + 127;
+			*dst++ = static_cast<uint8_t>((r / 255) * 42 + (g / 255) * 6 + (b / 255));
+		}
+	}
+}
+
+void GifEncoder::addFrame(const uint32_t* canvas, uint16_t delay)
+{
+	if (m_finished) {
+		return;
+	}
+
+	// 前のフレームから変わった矩形を求める。最初のフレームは全体
+	int left = 0;
+	int top = 0;
+	int right = m_width;
+	int bottom = m_height;
+	const bool delta = (m_frames > 0);
+	if (delta) {
+		left = m_width;
+		top = m_height;
+		right = 0;
+		bottom = 0;
+		for (int y = 0; y < m_height; ++y) {
+			const uint32_t* src = canvas + static_cast<size_t>(y) * m_width;
+			const uint32_t* previous = m_previous.data() + static_cast<size_t>(y) * m_width;
+			int x0 = 0;
+			while (x0 < m_width && (src[x0] & 0xFFFFFF) == previous[x0]) {
+				x0++;
+			}
+			if (x0 == m_width) {
+				continue;
+			}
+			int x1 = m_width;
+			while ((src[x1 - 1] & 0xFFFFFF) == previous[x1 - 1]) {
+				x1--;
+			}
+			left = std::min(left, x0);
+			right = std::max(right, x1);
+			top = std::min(top, y);
+			bottom = y + 1;
+		}
+		if (left >= right) {
+			// 何も変わっていなくても表示時間のために透明な 1x1 のフレームを出す
+			left = 0;
+			top = 0;
+			right = 1;
+			bottom = 1;
+		}
+	}
+
+	const int rectWidth = right - left;
+	const int rectHeight = bottom - top;
+	m_indices.resize(static_cast<size_t>(rectWidth) * rectHeight);
+	if (!buildExactPalette(canvas, left, top, right, bottom, delta)) {
+		buildCubePalette(canvas, left, top, right, bottom, delta);
+	}
+
+	// 表示される結果を覚えておく (近似したときは近似後の色)
+	const uint8_t* index = m_indices.data();
+	for (int y = top; y < bottom; ++y) {
+		uint32_t* previous = m_previous.data() + static_cast<size_t>(y) * m_width;
+		for (int x = left; x < right; ++x, ++index) {
+			if (*index != m_transparentIndex) {
+				previous[x] = m_colors[*index];
+			}
+		}
+	}
+
+	int tableBits = 1;
+	while ((size_t(1) << tableBits) < m_colors.size()) {
+		tableBits++;
+	}
+
+	// グラフィック制御拡張。破棄方法 1 (そのまま残す) で、次のフレームは差分だけ重ねる
+	const uint8_t gceHeader[] = { 0x21, 0xF9, 0x04 };
+	m_counter.write(gceHeader, sizeof(gceHeader));
+	GraphicControlExtension gce;
+	gce.packedFields = (1 << 2) | (m_transparentIndex >= 0 ? 0x01 : 0x00);
+	gce.delayTime = delay;
+	gce.transparentColorIndex = static_cast<uint8_t>(m_transparentIndex >= 0 ? m_transparentIndex : 0);
+	m_counter.write(&gce, sizeof(gce));
+	const uint8_t terminator = 0;
+	m_counter.write(&terminator, 1);
+
+	const uint8_t separator = 0x2C;
+	m_counter.write(&separator, 1);
+	ImageDescriptor descriptor;
+	descriptor.left = static_cast<uint16_t>(left);
+	descriptor.top = static_cast<uint16_t>(top);
+	descriptor.width = static_cast<uint16_t>(rectWidth);
+	descriptor.height = static_cast<uint16_t>(rectHeight);
+	descriptor.packedFields = static_cast<uint8_t>(0x80 | (tableBits - 1));
+	m_counter.write(&descriptor, sizeof(descriptor));
+
+	uint8_t colorTable[256 * 3] = {};
+	for (size_t i = 0; i < m_colors.size(); ++i) {
+		colorTable[i * 3 + 0] = static_cast<uint8_t>(m_colors[i] >> 16);
+		colorTable[i * 3 + 1] = static_cast<uint8_t>(m_colors[i] >> 8);
+		colorTable[i * 3 + 2] = static_cast<uint8_t>(m_colors[i]);
+	}
+	m_counter.write(colorTable, (size_t(1) << tableBits) * 3);
+
+	const uint8_t minCodeSize = static_cast<uint8_t>(std::max(2, tableBits));
+	m_counter.write(&minCodeSize, 1);
+	encodeLZW(m_counter, m_indices.data(), m_indices.size(), minCodeSize);
+
+	m_frames++;
+}
+
+void GifEncoder::finish()
+{
+	if (m_finished) {
+		return;
+	}
+	const uint8_t trailer = 0x3B;
+	m_counter.write(&trailer, 1);
+	m_finished = true;
+}
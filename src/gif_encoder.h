@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// GIF の出力先。ファイル全体をメモリに持たず、できた順に書き出す
+class GifWriter {
+public:
+	virtual ~GifWriter() = default;
+	virtual void write(const void* data, size_t size) = 0;
+	// ここまでの書き込みがすべて成功していれば true
+	virtual bool ok() const { return true; }
+	// 書き終わったら呼ぶ。閉じるところまで成功していれば true
+	virtual bool close() { return ok(); }
+};
+
+class FileGifWriter : public GifWriter {
+public:
+	// path を開けなければ ok() が false になり、書き込みは捨てられる
+	explicit FileGifWriter(const char* path);
+	// close() が成功しないまま破棄されたら (ストリームが途中で終わったら)、終端のないファイルを残さないように消す
+	~FileGifWriter() override;
+
+	FileGifWriter(const FileGifWriter&) = delete;
+	FileGifWriter& operator=(const FileGifWriter&) = delete;
+
+	bool ok() const override { return !m_failed; }
+	void write(const void* data, size_t size) override;
+	bool close() override;
+
+private:
+	std::string m_path;
+	FILE* m_file;
+	bool m_failed = false; // 開けなかったか、書き込みに失敗した
+};
+
+// indices を GIF の LZW で圧縮し、255 バイトごとのサブブロックにして終端の 0 まで書き出す。
+// 最小コードサイズのバイトは含まない。
+void encodeLZW(GifWriter& writer, const uint8_t* indices, size_t count, uint8_t minCodeSize);
+
+// デコード済みのフレーム (ARGB のキャンバス) を受け取って GIF に再エンコードする。
+// 前のフレームから変わった矩形だけを出力し、その中で変わっていない画素は透明にする。
+// アルファは見ない (RGB が同じなら同じ色)。
+class GifEncoder {
+public:
+	// ヘッダーと論理画面記述子、ループ回数 (0 なら無限) をすぐに書き出す
+	GifEncoder(GifWriter& writer, int width, int height, uint16_t loopCount = 0);
+
+	// canvas は width * height。delay は 1/100 秒単位
+	void addFrame(const uint32_t* canvas, uint16_t delay);
+
+	// 終端を書き出す。以降 addFrame() は呼ばないこと
+	void finish();
+
+	size_t bytesWritten() const { return m_counter.m_bytes; }
+	size_t frames() const { return m_frames; }
+
+private:
+	// 書いたバイト数を数えて下流に渡す
+	struct CountingWriter : GifWriter {
+		explicit CountingWriter(GifWriter& writer) : m_writer(writer) {}
+		void write(const void* data, size_t size) override
+		{
+			m_bytes += size;
+			m_writer.write(data, size);
+		}
+		GifWriter& m_writer;
+		size_t m_bytes = 0;
+	};
+
+	// 矩形の色を m_colors/m_indices にする。transparent なら前と同じ画素は透明にする。256 色を超えたら false
+	bool buildExactPalette(const uint32_t* canvas, int left, int top, int right, int bottom, bool transparent);
+	// 256 色に収まらないときは固定パレット (6x7x6 の色立方体) で近似する
+	void buildCubePalette(const uint32_t* canvas, int left, int top, int right, int bottom, bool transparent);
+
+	CountingWriter m_counter;
+	int m_width;
+	int m_height;
+	size_t m_frames = 0;
+	bool m_finished = false;
+
+	std::vector<uint32_t> m_previous; // 前のフレームまでで表示されている RGB
+	std::vector<uint8_t> m_indices;
+	std::vector<uint32_t> m_colors;
+	int m_transparentIndex = -1;
+
+	// RGB -> パレット番号の開番地法ハッシュ (256 色に対して十分な大きさ)
+	static constexpr int ColorHashBits = 10;
+	static constexpr size_t ColorHashSize = size_t(1) << ColorHashBits;
+	static constexpr uint32_t NoColor = 0xFFFFFFFF;
+	uint32_t m_colorKeys[ColorHashSize];
+	uint8_t m_colorValues[ColorHashSize];
+};
@@ -0,0 +1,148 @@
+#include "indexed_image.h"
+
+#include <algorithm>
+#include <cstring>
+
+PalettePool& PalettePool::instance()
+{
+	static PalettePool pool;
+	return pool;
+}
+
+std::shared_ptr<const Palette> PalettePool::intern(const uint32_t (&colors)[256])
+{
+	// FNV-1a
+	size_t hash = 1469598103934665603ull;
+	for (uint32_t color : colors) {
+		hash = (hash ^ color) * 1099511628211ull;
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto range = m_palettes.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (auto palette = it->second.lock()) {
+			if (memcmp(palette->colors, colors, sizeof(colors)) == 0) {
+				return palette;
+			}
+		}
+	}
+
+	auto palette = std::make_shared<Palette>();
+	memcpy(palette->colors, colors, sizeof(colors));
+	palette->hash = hash;
+	m_palettes.emplace(hash, palette);
+
+	// 使われなくなったものをときどき掃除する
+	if (++m_internCount % 256 == 0) {
+		sweep();
+	}
+	return palette;
+}
+
+size_t PalettePool::size()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	sweep();
+	return m_palettes.size();
+}
+
+void PalettePool::sweep()
+{
+	for (auto it = m_palettes.begin(); it != m_palettes.end();) {
+		if (it->second.expired()) {
+			it = m_palettes.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+IndexedImage::IndexedImage(int width, int height)
+	: m_width(width)
+	, m_height(height)
+{
+	m_indices.assign(pixelCount(), EmptyIndex);
+}
+
+IndexedImage::IndexedImage(const IndexedImage& rhs)
+{
+	*this = rhs;
+}
+
+IndexedImage& IndexedImage::operator=(const IndexedImage& rhs)
+{
+	if (this == &rhs) {
+		return *this;
+	}
+	m_width = rhs.m_width;
+	m_height = rhs.m_height;
+	m_indexed = rhs.m_indexed;
+	m_palette = rhs.m_palette;
+	if (m_indexed) {
+		m_indices.assign(rhs.m_indices.data(), pixelCount());
+	}
+	else {
+		m_argb.assign(rhs.m_argb.data(), pixelCount());
+	}
+	return *this;
+}
+
+void IndexedImage::reset(int width, int height)
+{
+	m_width = width;
+	m_height = height;
+	m_indexed = true;
+	m_palette.reset();
+	m_indices.assign(pixelCount(), EmptyIndex);
+}
+
+void IndexedImage::setPalette(std::shared_ptr<const Palette> palette)
+{
+	m_palette = std::move(palette);
+}
+
+void IndexedImage::convertToARGB()
+{
+	if (!indexed()) {
+		return;
+	}
+	// インデックス側はそのまま残るので、展開先は別のバッファになる
+	m_argb.resize(pixelCount());
+	toARGB(m_argb.data());
+	m_indexed = false;
+	m_palette.reset();
+}
+
+void IndexedImage::convertToIndexed(std::shared_ptr<const Palette> palette)
+{
+	m_indices.resize(pixelCount());
+	m_indexed = true;
+	m_palette = std::move(palette);
+}
+
+void IndexedImage::toARGB(uint32_t* dst) const
+{
+	const size_t count = pixelCount();
+	if (!indexed()) {
+		memcpy(dst, m_argb.data(), count * sizeof(uint32_t));
+		return;
+	}
+	if (!m_palette) {
+		// まだ何も描かれていない
+		std::fill(dst, dst + count, 0);
+		return;
+	}
+	const uint32_t* colors = m_palette->colors;
+	const uint8_t* indices = m_indices.data();
+	for (size_t i = 0; i < count; ++i) {
+		dst[i] = colors[indices[i]];
+	}
+}
+
+std::vector<uint32_t> IndexedImage::toARGB() const
+{
+	std::vector<uint32_t> argb(pixelCount());
+	toARGB(argb.data());
+	return argb;
+}
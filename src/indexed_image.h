@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "canvas_pool.h"
+
+// 256 色のパレット。PalettePool で共有するので作ったあとは変更しない
+struct Palette {
+	uint32_t colors[256];
+	size_t hash;
+};
+
+// 同じ内容のパレットをフレームやストリームをまたいで1つにまとめる。
+// 同じパレットは同じポインタになるので、比較はポインタで済む。
+class PalettePool {
+public:
+	static PalettePool& instance();
+
+	std::shared_ptr<const Palette> intern(const uint32_t (&colors)[256]);
+
+	// 生きているパレットの数
+	size_t size();
+
+private:
+	void sweep();
+
+	std::mutex m_mutex;
+	std::unordered_multimap<size_t, std::weak_ptr<const Palette>> m_palettes;
+	size_t m_internCount = 0;
+};
+
+// 8bit インデックス + 共有パレットの画像。パレットで表せないときは ARGB で持つ。
+// ARGB への展開は使う側が toARGB() を呼んだときにだけ行う。
+// 表現を切り替えても使わなくなった側のバッファは解放しないので、同じ画像を使い回す間は確保が起きない。
+// バッファは CanvasPool から取るので、画像を作り直してもストリームをまたいで使い回される。
+class IndexedImage {
+public:
+	// パレットの最後の要素は「まだ何も描かれていない」画素 (ARGB で 0) に使う
+	static constexpr uint8_t EmptyIndex = 255;
+
+	IndexedImage() = default;
+	// EmptyIndex で埋めたインデックス画像として作る (パレットは未定)
+	IndexedImage(int width, int height);
+
+	// コピーは使っている側の表現だけを写す。コピー先のバッファは容量が足りれば使い回す
+	IndexedImage(const IndexedImage& rhs);
+	IndexedImage& operator=(const IndexedImage& rhs);
+	IndexedImage(IndexedImage&&) = default;
+	IndexedImage& operator=(IndexedImage&&) = default;
+
+	// (width, height) の EmptyIndex で埋めたインデックス画像に戻す。バッファは使い回す
+	void reset(int width, int height);
+
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+	bool indexed() const { return m_indexed; }
+
+	uint8_t* indices() { return m_indices.data(); }
+	const uint8_t* indices() const { return m_indices.data(); }
+	const std::shared_ptr<const Palette>& palette() const { return m_palette; }
+	uint32_t* argb() { return m_argb.data(); }
+	const uint32_t* argb() const { return m_argb.data(); }
+
+	// インデックスのまま解釈するパレットを差し替える (画素はそのまま)
+	void setPalette(std::shared_ptr<const Palette> palette);
+
+	// 以降は ARGB で持つ
+	void convertToARGB();
+	// 以降はインデックスで持つ。画素は呼び出し側がすべて書き直すこと
+	void convertToIndexed(std::shared_ptr<const Palette> palette);
+
+	// dst は width * height
+	void toARGB(uint32_t* dst) const;
+	std::vector<uint32_t> toARGB() const;
+
+	size_t memoryUsage() const { return m_indices.capacity() + m_argb.capacity() * sizeof(uint32_t); }
+
+private:
+	size_t pixelCount() const { return static_cast<size_t>(m_width) * m_height; }
+
+	int m_width = 0;
+	int m_height = 0;
+	bool m_indexed = true;
+	std::shared_ptr<const Palette> m_palette;
+	CanvasBuffer<uint8_t> m_indices;
+	CanvasBuffer<uint32_t> m_argb;
+};
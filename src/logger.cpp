@@ -0,0 +1,101 @@
+#include "logger.h"
+
+#include <chrono>
+#include <thread>
+
+Logger::Logger()
+{
+	std::thread{ [this]() { run(); } }.detach();
+}
+
+Logger& Logger::instance()
+{
+	static Logger* logger = new Logger();
+	return *logger;
+}
+
+Logger::Ring& Logger::threadRing()
+{
+	// スレッド終了時にリングを閉じる。未出力のレコードは出力してから破棄される。
+	struct Holder {
+		Holder() : m_ring(instance().addRing()) {}
+		~Holder() { m_ring->m_closed.store(true, std::memory_order_release); }
+		Ring* m_ring;
+	};
+	thread_local Holder holder;
+	return *holder.m_ring;
+}
+
+Logger::Ring* Logger::addRing()
+{
+	std::lock_guard<std::mutex> lock(m_ringsMutex);
+	m_rings.push_back(std::make_unique<Ring>());
+	return m_rings.back().get();
+}
+
+void Logger::flush()
+{
+	instance().drain();
+	fflush(stdout);
+}
+
+size_t Logger::drain()
+{
+	std::lock_guard<std::mutex> lock(m_ringsMutex);
+	size_t written = 0;
+	for (auto it = m_rings.begin(); it != m_rings.end();) {
+		Ring& ring = **it;
+		bool closed = ring.m_closed.load(std::memory_order_acquire);
+		size_t head = ring.m_head.load(std::memory_order_relaxed);
+		size_t tail = ring.m_tail.load(std::memory_order_acquire);
+		for (; head != tail; ++head) {
+			const Record& record = ring.m_records[head & (Ring::Capacity - 1)];
+			record.m_formatter(stdout, record.m_format, record.m_args);
+			++written;
+		}
+		ring.m_head.store(head, std::memory_order_release);
+
+		size_t dropped = ring.m_dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped > 0) {
+			fprintf(stdout, "[logger] %zu messages dropped\n", dropped);
+		}
+
+		if (closed) {
+			it = m_rings.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	return written;
+}
+
+bool Logger::pending()
+{
+	std::lock_guard<std::mutex> lock(m_ringsMutex);
+	for (auto& ring : m_rings) {
+		if (ring->m_head.load(std::memory_order_relaxed) != ring->m_tail.load(std::memory_order_acquire)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Logger::run()
+{
+	while (true) {
+		if (drain() > 0) {
+			continue;
+		}
+		fflush(stdout);
+
+		// 書き込み側は m_sleeping が立っているときだけ起こしに来る
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!pending()) {
+			m_cond.wait_for(lock, std::chrono::milliseconds(100));
+		}
+		m_sleeping.store(false, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE  4
+
+// コンパイル時のログレベル。これより低いレベルのログは引数の評価も含めて消える。
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOGD(...) Logger::log(__VA_ARGS__)
+#else
+#define LOGD(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOGI(...) Logger::log(__VA_ARGS__)
+#else
+#define LOGI(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOGW(...) Logger::log(__VA_ARGS__)
+#else
+#define LOGW(...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOGE(...) Logger::log(__VA_ARGS__)
+#else
+#define LOGE(...) ((void)0)
+#endif
+
+// 文字列の引数。容量はレコードの引数の領域のうち、ほかの引数が使わない分を文字列の数で分けたもの
+template <size_t Size>
+struct LogString {
+	char m_text[Size];
+};
+
+// ログ引数をレコードに格納する型。文字列はポインタの寿命が保証できないのでコピーする。
+template <class T>
+struct LogArg {
+	static_assert(std::is_trivially_copyable_v<T>, "log arguments must be trivially copyable");
+	static constexpr bool IsString = false;
+	template <size_t StringSize>
+	using Stored = T;
+	template <size_t StringSize>
+	static Stored<StringSize> store(T value) { return value; }
+	static T load(const T& stored) { return stored; }
+};
+
+template <>
+struct LogArg<const char*> {
+	static constexpr bool IsString = true;
+	template <size_t StringSize>
+	using Stored = LogString<StringSize>;
+	// 入りきらなければ末尾を "..." にして切ったことが分かるようにする
+	template <size_t StringSize>
+	static Stored<StringSize> store(const char* value)
+	{
+		Stored<StringSize> stored;
+		size_t i = 0;
+		for (; value && value[i] && i < StringSize - 1; ++i) {
+			stored.m_text[i] = value[i];
+		}
+		stored.m_text[i] = '\0';
+		if (value && value[i]) {
+			for (size_t j = StringSize - 4; j < StringSize - 1; ++j) {
+				stored.m_text[j] = '.';
+			}
+		}
+		return stored;
+	}
+	template <size_t StringSize>
+	static const char* load(const Stored<StringSize>& stored) { return stored.m_text; }
+};
+
+template <>
+struct LogArg<char*> : LogArg<const char*> {};
+
+// 各スレッドのログをバイナリのままリングに積み、バックグラウンドスレッドで整形して出力する。
+class Logger {
+public:
+	using Formatter = void (*)(FILE* out, const char* format, const void* args);
+
+	struct Record {
+		Formatter m_formatter;
+		const char* m_format;
+		alignas(8) unsigned char m_args[112];
+	};
+	static_assert(sizeof(Record) == 128);
+
+	// 書き込みスレッド1つ、読み出しスレッド1つのロックフリーリング
+	class Ring {
+	public:
+		static constexpr size_t Capacity = 1024;
+		static_assert((Capacity & (Capacity - 1)) == 0);
+
+		Record* acquire()
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) == Capacity) {
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+			return &m_records[tail & (Capacity - 1)];
+		}
+
+		void commit()
+		{
+			m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+	private:
+		friend class Logger;
+
+		Record m_records[Capacity];
+		alignas(64) std::atomic<size_t> m_head{ 0 };
+		alignas(64) std::atomic<size_t> m_tail{ 0 };
+		std::atomic<size_t> m_dropped{ 0 };
+		std::atomic<bool> m_closed{ false };
+	};
+
+	// Args のレコードでの並び。文字列以外を 8 バイト単位で置いた残りを文字列で等分する
+	template <class... Args>
+	struct Layout {
+		static constexpr size_t StringCount = (size_t(0) + ... + (LogArg<Args>::IsString ? 1 : 0));
+		static constexpr size_t FixedSize = (size_t(0) + ... + (LogArg<Args>::IsString ? 0 : (sizeof(Args) + 7) / 8 * 8));
+		static_assert(FixedSize <= sizeof(Record::m_args), "too many log arguments");
+		static constexpr size_t StringSize = StringCount ? (sizeof(Record::m_args) - FixedSize) / StringCount / 8 * 8 : 0;
+		static_assert(StringCount == 0 || StringSize >= 8, "too many log arguments");
+		using Stored = std::tuple<typename LogArg<Args>::template Stored<StringSize>...>;
+		static_assert(sizeof(Stored) <= sizeof(Record::m_args), "too many log arguments");
+		static_assert(alignof(Stored) <= 8);
+	};
+
+	template <class... Args>
+	static void log(const char* format, Args... args)
+	{
+		using Stored = typename Layout<Args...>::Stored;
+		constexpr size_t StringSize = Layout<Args...>::StringSize;
+
+		Ring& ring = threadRing();
+		Record* record = ring.acquire();
+		if (!record) {
+			return;
+		}
+		record->m_formatter = &formatRecord<Args...>;
+		record->m_format = format;
+		new (record->m_args) Stored{ LogArg<Args>::template store<StringSize>(args)... };
+		ring.commit();
+		instance().notify();
+	}
+
+	// 溜まっているログを呼び出し元のスレッドで出力する
+	static void flush();
+
+	static Logger& instance();
+
+private:
+	Logger();
+
+	template <class... Args>
+	static void formatRecord(FILE* out, const char* format, const void* args)
+	{
+		auto& stored = *static_cast<const typename Layout<Args...>::Stored*>(args);
+		std::apply([&](const auto&... a) {
+			fprintf(out, format, LogArg<Args>::load(a)...);
+		}, stored);
+	}
+
+	static Ring& threadRing();
+
+	void notify()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_sleeping.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_cond.notify_one();
+		}
+	}
+
+	Ring* addRing();
+	size_t drain();
+	bool pending();
+	void run();
+
+	std::mutex m_ringsMutex;
+	std::vector<std::unique_ptr<Ring>> m_rings;
+
+	std::mutex m_sleepMutex;
+	std::condition_variable m_cond;
+	std::atomic<bool> m_sleeping{ false };
+};
@@ -1,42 +1,60 @@
-#include <unifex/sync_wait.hpp>
-#include <unifex/task.hpp>
-#include <coroutine>
-#include <memory>
-#include "workqueue.h"
-#include "curl_workqueue.h"
-#include "gif.h"
-
-Workqueue* g_mainWQ;
-
-void platform_init();
-
-void enqueueCoroutine(std::coroutine_handle<> handle)
-{
-	g_mainWQ->enqueue(handle);
-}
-
-void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule)
-{
-	g_mainWQ->enqueue(handle, schedule);
-}
-
-unifex::task<void> main_task();
-
-void SetImage(const std::vector<uint32_t>& image, int width, int height, int index)
-{
-	// Do nothing
-}
-
-int main()
-{
-	platform_init();
-
-	g_mainWQ = new Workqueue();
-
-	std::thread{ []() {
-		unifex::sync_wait(main_task());
-	} }.detach();
-
-	g_mainWQ->run();
-	return 0;
+#include <unifex/sync_wait.hpp>
+#include <unifex/task.hpp>
+#include <coroutine>
+#include <memory>
+#include "workqueue.h"
+#include "curl_workqueue.h"
+#include "gif.h"
+#include "thread_topology.h"
+#include "indexed_image.h"
+
+Workqueue* g_mainWQ;
+
+void platform_init();
+
+void enqueueWork(Workqueue::Node& node)
+{
+	g_mainWQ->enqueue(node);
+}
+
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule, Priority priority)
+{
+	g_mainWQ->enqueue(handle, schedule, priority);
+}
+
+bool cancelCoroutine(std::coroutine_handle<> handle)
+{
+	return g_mainWQ->cancel(handle);
+}
+
+WorkqueueClock& mainWQClock()
+{
+	return g_mainWQ->clock();
+}
+
+unifex::task<void> main_task();
+
+void SetImage(const IndexedImage& image, int index)
+{
+	// Do nothing
+}
+
+bool GetTargetImageSize(int index, int& width, int& height)
+{
+	return false;
+}
+
+int main()
+{
+	platform_init();
+
+	g_mainWQ = new Workqueue();
+
+	std::thread{ []() {
+		unifex::sync_wait(main_task());
+	} }.detach();
+
+	ThreadTopology::instance().enter(ThreadRole::Main, 0, "main");
+	g_mainWQ->run();
+	return 0;
 }
\ No newline at end of file
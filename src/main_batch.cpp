@@ -0,0 +1,588 @@
+#include <unifex/sync_wait.hpp>
+#include <unifex/task.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "workqueue.h"
+#include "mainwq.h"
+#include "curl_workqueue_pool.h"
+#include "app.h"
+#include "canvas_pool.h"
+#include "frame_sink.h"
+#include "gif_encoder.h"
+#include "indexed_image.h"
+#include "logger.h"
+#include "memory_budget.h"
+#include "thread_topology.h"
+#include "trace.h"
+#ifdef __linux__
+#include "uring_file_source.h"
+#endif
+
+// ローカルの GIF をまとめてデコードし、フレームをファイルに書き出すコマンドラインツール。
+// デコードは表示と同じ経路 (CurlReader + decodeLZW) をネットワークスレッドで並列に走らせる。
+// Linux ではファイルを curl を通さずに io_uring でまとめて読む (-i で切り替えられる)。
+// 書き出しにかかる時間も含めたスループットを表示するので、デコード全体のベンチマークにも使える。
+// --probe ではデコードせずに probe_gif() でブロック構造だけをたどり、ファイルごとの概要を表示する。
+
+extern CurlWorkqueuePool* g_curlPool;
+
+Workqueue* g_mainWQ;
+
+void enqueueWork(Workqueue::Node& node)
+{
+	g_mainWQ->enqueue(node);
+}
+
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule, Priority priority)
+{
+	g_mainWQ->enqueue(handle, schedule, priority);
+}
+
+bool cancelCoroutine(std::coroutine_handle<> handle)
+{
+	return g_mainWQ->cancel(handle);
+}
+
+WorkqueueClock& mainWQClock()
+{
+	return g_mainWQ->clock();
+}
+
+void SetImage(const IndexedImage& image, int index)
+{
+	// フレームは decode_gif() のコールバックで受け取るので使わない
+}
+
+bool GetTargetImageSize(int index, int& width, int& height)
+{
+	return false;
+}
+
+namespace {
+
+namespace fs = std::filesystem;
+
+// ファイルの読み方
+enum class InputMode {
+	Curl,  // curl の file://
+	Uring, // io_uring (使えなければ pread)
+	Pread, // pread
+};
+
+class FileAdmission;
+
+struct BatchJob {
+	std::vector<fs::path> inputs;
+	std::vector<std::string> urls;
+	FrameSink* sink = nullptr; // なければフレームは書き出さない
+	InputMode input = InputMode::Curl;
+	// あれば、デコードしたフレームを GIF に再エンコードしてこのディレクトリに書き出す
+	const char* encodeDirectory = nullptr;
+	std::vector<std::string> names;
+	bool probe = false;
+	std::vector<std::optional<GifInfo>> probes; // --probe で調べた結果。終わってからファイルの順に表示する
+
+	std::atomic<size_t> next{ 0 };
+	std::mutex mutex; // 以下の3つを守る
+	size_t active = 0; // デコード中のファイル
+	size_t starting = 0; // メモリの上限があるときに、始めたがまだ最初のフレームを出していないファイル
+	std::vector<FileAdmission*> waiters; // 始めるのを待っているファイル (来た順)
+	std::atomic<size_t> frames{ 0 };
+	std::atomic<size_t> failed{ 0 };
+	std::atomic<uint64_t> bytesRead{ 0 };
+	std::atomic<uint64_t> bytesEncoded{ 0 };
+};
+
+// co_await するとファイルを始めてよくなるまで待つ。メモリの上限に収まらない間は、ほかのファイルが終わって空くまで始めない。
+// 使用量はキャンバスを確保するまで分からないので、前に始めたファイルが最初のフレームを出すまでも始めない。
+// ほかに走っているものがなければ上限を超えても始める。
+// 待つ間は job.waiters に並び、ほかのファイルが started() か finished() を呼んだときにメインスレッドで再開する
+class FileAdmission {
+public:
+	FileAdmission(BatchJob& job, MemoryBudget::Account& memory)
+		: m_job(job)
+		, m_memory(memory)
+		// 断られた数はファイルごとに1回だけ数え、待ったあとの予約は数えない
+		, m_reserved(MemoryBudget::instance().admit(memory))
+	{
+	}
+
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> handle)
+	{
+		std::lock_guard<std::mutex> lock(m_job.mutex);
+		if (tryStart()) {
+			return false;
+		}
+		m_handle = handle;
+		m_job.waiters.push_back(this);
+		return true;
+	}
+	void await_resume() {}
+
+	// 始めたファイルが最初のフレームを出した (か、出さずに終わった)
+	static void started(BatchJob& job)
+	{
+		std::lock_guard<std::mutex> lock(job.mutex);
+		--job.starting;
+		wake(job);
+	}
+
+	// ファイルのデコードが終わった
+	static void finished(BatchJob& job)
+	{
+		std::lock_guard<std::mutex> lock(job.mutex);
+		--job.active;
+		wake(job);
+	}
+
+private:
+	// 待っているファイルのうち始められるものを、来た順に再開させる。job.mutex を持って呼ぶ
+	static void wake(BatchJob& job)
+	{
+		for (auto it = job.waiters.begin(); it != job.waiters.end();) {
+			FileAdmission* waiter = *it;
+			if (!waiter->tryStart()) {
+				++it;
+				continue;
+			}
+			it = job.waiters.erase(it);
+			waiter->m_node = Workqueue::Node{ &Workqueue::Work::resumeCoroutine, waiter->m_handle.address(), Priority::Foreground };
+			enqueueWork(waiter->m_node);
+		}
+	}
+
+	// 始めてよければ active と starting に数えて true。job.mutex を持って呼ぶ
+	bool tryStart()
+	{
+		MemoryBudget& budget = MemoryBudget::instance();
+		if (m_job.active > 0) {
+			if (m_job.starting > 0 || (!m_reserved && !(m_reserved = budget.reserve(m_memory)))) {
+				return false;
+			}
+		}
+		else if (!m_reserved) {
+			m_reserved = budget.reserve(m_memory, true);
+		}
+		++m_job.active;
+		if (budget.limit() != 0) {
+			++m_job.starting;
+		}
+		return true;
+	}
+
+	BatchJob& m_job;
+	MemoryBudget::Account& m_memory;
+	bool m_reserved;
+	std::coroutine_handle<> m_handle;
+	Workqueue::Node m_node;
+};
+
+// 再エンコードした GIF をファイルに書き出し、書いたバイト数を bytes に足していく
+class CountingGifWriter : public FileGifWriter {
+public:
+	CountingGifWriter(const char* path, std::atomic<uint64_t>& bytes)
+		: FileGifWriter(path)
+		, m_bytes(bytes)
+	{
+	}
+
+	void write(const void* data, size_t size) override
+	{
+		FileGifWriter::write(data, size);
+		if (ok()) {
+			m_bytes += size;
+		}
+	}
+
+private:
+	std::atomic<uint64_t>& m_bytes;
+};
+
+void usage()
+{
+	fprintf(stderr,
+		"usage: gifbatch [options] <file or directory>...\n"
+		"  -o <dir>              write one file per frame into <dir>\n"
+		"  -p <file>             write all frames into a single pack file with an offset index\n"
+		"  -e <dir>              re-encode each file into <dir>/<name>.gif\n"
+		"  --probe               print size, frames, duration and loop count of each file without decoding\n"
+		"  -f rgba|indexed       frame format (default: rgba)\n"
+		"  -j <threads>          decode threads (default: hardware threads)\n"
+		"  -n <files>            files decoded at once; bounds memory in flight (default: 2 * threads)\n"
+		"  -a <topology>         pin threads to CPUs, e.g. \"main=0 network=1-7\" (default: $TKF25_THREADS)\n"
+		"  -b <bytes>            memory budget, e.g. 512M; new files wait until it has room (default: $TKF25_MEMORY_BUDGET)\n"
+		"  -c <pool>             canvas pool, e.g. \"limit=64M hugepages=explicit\" (default: $TKF25_CANVAS_POOL)\n"
+#ifdef __linux__
+		"  -i curl|uring|pread   how files are read (default: uring)\n"
+#endif
+		);
+}
+
+// curl に渡せるように、パス区切りと英数字以外をエスケープする
+std::string fileUrl(const fs::path& path)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string generic = fs::absolute(path).generic_string();
+	std::string url = generic.empty() || generic[0] != '/' ? "file:///" : "file://";
+	for (unsigned char c : generic) {
+		if (isalnum(c) || strchr("/-._~:", c)) {
+			url += static_cast<char>(c);
+		}
+		else {
+			url += '%';
+			url += hex[c >> 4];
+			url += hex[c & 0x0F];
+		}
+	}
+	return url;
+}
+
+bool isGif(const fs::path& path)
+{
+	std::string ext = path.extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+	return ext == ".gif";
+}
+
+// ディレクトリは再帰的にたどって .gif だけを拾う。順番は決まるように並べる
+std::vector<fs::path> collectInputs(const std::vector<const char*>& args)
+{
+	std::vector<fs::path> inputs;
+	for (const char* arg : args) {
+		std::error_code ec;
+		if (fs::is_directory(arg, ec)) {
+			std::vector<fs::path> found;
+			for (const auto& entry : fs::recursive_directory_iterator(arg, ec)) {
+				if (entry.is_regular_file() && isGif(entry.path())) {
+					found.push_back(entry.path());
+				}
+			}
+			std::sort(found.begin(), found.end());
+			inputs.insert(inputs.end(), found.begin(), found.end());
+		}
+		else if (fs::is_regular_file(arg, ec)) {
+			inputs.emplace_back(arg);
+		}
+		else {
+			LOGW("Skipping %s: not a file or directory\n", arg);
+		}
+	}
+	return inputs;
+}
+
+// 出力ファイル名の元になる名前。別のディレクトリの同じ名前は番号で区別する
+std::vector<std::string> outputNames(const std::vector<fs::path>& inputs)
+{
+	std::vector<std::string> names;
+	std::unordered_set<std::string> used;
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		std::string name = inputs[i].stem().string();
+		if (!used.insert(name).second) {
+			name += "_" + std::to_string(i);
+			used.insert(name);
+		}
+		names.push_back(std::move(name));
+	}
+	return names;
+}
+
+// job.input に合わせてファイルの読み方を決める。curl で読むなら空
+std::function<std::unique_ptr<ByteSource>(const char*)> fileSource(const BatchJob& job)
+{
+#ifdef __linux__
+	if (job.input != InputMode::Curl) {
+		bool usePread = job.input == InputMode::Pread;
+		return [usePread](const char*) { return std::make_unique<UringFileSource>(usePread); };
+	}
+#endif
+	return {};
+}
+
+// job のファイルを1つずつ取ってデコードする。同時に走らせる数がメモリに載るファイルの数になる
+unifex::task<void> decode_files(BatchJob& job)
+{
+	for (size_t index; (index = job.next++) < job.urls.size();) {
+		MemoryBudget::Account memory("file", static_cast<int>(index));
+		co_await FileAdmission(job, memory);
+		// 上限があれば、最初のフレームを出すまで starting に数えられている
+		const bool throttled = MemoryBudget::instance().limit() != 0;
+		size_t frameIndex = 0;
+		bool written = true; // 書き出し先に全部のフレームを書けた
+		std::function<std::unique_ptr<GifWriter>(int)> openOutput;
+		if (job.encodeDirectory) {
+			openOutput = [&job](int taskIndex) -> std::unique_ptr<GifWriter> {
+				fs::path path = fs::path(job.encodeDirectory) / (job.names[taskIndex] + ".gif");
+				auto writer = std::make_unique<CountingGifWriter>(path.string().c_str(), job.bytesEncoded);
+				if (!writer->ok()) {
+					LOGE("Failed to open %s\n", path.string().c_str());
+					return nullptr;
+				}
+				return writer;
+			};
+		}
+		bool complete = co_await decode_gif(job.urls[index].c_str(), static_cast<int>(index),
+			[&job, index, &frameIndex, &written, throttled](const IndexedImage& image, std::optional<std::chrono::milliseconds> delay) {
+				if (frameIndex == 0 && throttled) {
+					FileAdmission::started(job);
+				}
+				if (job.sink && !job.sink->write(index, frameIndex, image, delay)) {
+					written = false;
+				}
+				++frameIndex;
+			}, fileSource(job), &memory, std::move(openOutput));
+		if (frameIndex == 0 && throttled) {
+			FileAdmission::started(job);
+		}
+		FileAdmission::finished(job);
+		job.frames += frameIndex;
+		if (!complete) {
+			LOGW("Failed to decode %s\n", job.inputs[index].string().c_str());
+			++job.failed;
+		}
+		else if (!written) {
+			LOGW("Failed to write the frames of %s\n", job.inputs[index].string().c_str());
+			++job.failed;
+		}
+		std::error_code ec;
+		job.bytesRead += fs::file_size(job.inputs[index], ec);
+	}
+}
+
+// job のファイルを1つずつ取って、デコードせずに構造だけを調べる。キャンバスを持たないのでメモリの上限は見ない
+unifex::task<void> probe_files(BatchJob& job)
+{
+	for (size_t index; (index = job.next++) < job.urls.size();) {
+		std::optional<GifInfo> info = co_await probe_gif(job.urls[index].c_str(), ProbeMode::Full,
+			std::chrono::seconds(10), fileSource(job));
+		if (!info || !info->complete) {
+			LOGW("Failed to probe %s\n", job.inputs[index].string().c_str());
+			++job.failed;
+		}
+		if (info) {
+			job.frames += info->frameCount;
+		}
+		job.probes[index] = std::move(info);
+		std::error_code ec;
+		job.bytesRead += fs::file_size(job.inputs[index], ec);
+	}
+}
+
+void printProbe(const fs::path& input, const std::optional<GifInfo>& info)
+{
+	if (!info) {
+		printf("%s: not a GIF\n", input.string().c_str());
+		return;
+	}
+	std::string loop = !info->loopCount ? "plays once"
+		: *info->loopCount == 0 ? "loops forever"
+		: "loops " + std::to_string(*info->loopCount) + " times";
+	printf("%s: %dx%d, %zu frames, %lld ms, %s%s\n", input.string().c_str(), info->width, info->height,
+		info->frameCount, static_cast<long long>(info->duration.count()), loop.c_str(),
+		info->complete ? "" : " (incomplete)");
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	const char* outputDirectory = nullptr;
+	const char* packPath = nullptr;
+	const char* encodeDirectory = nullptr;
+	FrameFormat format = FrameFormat::RGBA;
+	bool probe = false;
+	size_t threads = 0;
+	size_t inFlight = 0;
+#ifdef __linux__
+	InputMode input = InputMode::Uring;
+#else
+	InputMode input = InputMode::Curl;
+#endif
+	std::vector<const char*> args;
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-o") == 0 && hasValue) {
+			outputDirectory = argv[++i];
+		}
+		else if (strcmp(arg, "-p") == 0 && hasValue) {
+			packPath = argv[++i];
+		}
+		else if (strcmp(arg, "-e") == 0 && hasValue) {
+			encodeDirectory = argv[++i];
+		}
+		else if (strcmp(arg, "--probe") == 0) {
+			probe = true;
+		}
+		else if (strcmp(arg, "-f") == 0 && hasValue) {
+			const char* value = argv[++i];
+			if (strcmp(value, "rgba") == 0) {
+				format = FrameFormat::RGBA;
+			}
+			else if (strcmp(value, "indexed") == 0) {
+				format = FrameFormat::Indexed;
+			}
+			else {
+				usage();
+				return 2;
+			}
+		}
+		else if (strcmp(arg, "-j") == 0 && hasValue) {
+			threads = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(arg, "-n") == 0 && hasValue) {
+			inFlight = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(arg, "-a") == 0 && hasValue) {
+			if (!ThreadTopology::instance().configure(argv[++i])) {
+				Logger::instance().flush();
+				return 2;
+			}
+		}
+		else if (strcmp(arg, "-b") == 0 && hasValue) {
+			if (!MemoryBudget::instance().configure(argv[++i])) {
+				Logger::instance().flush();
+				return 2;
+			}
+		}
+		else if (strcmp(arg, "-c") == 0 && hasValue) {
+			if (!CanvasPool::instance().configure(argv[++i])) {
+				Logger::instance().flush();
+				return 2;
+			}
+		}
+#ifdef __linux__
+		else if (strcmp(arg, "-i") == 0 && hasValue) {
+			const char* value = argv[++i];
+			if (strcmp(value, "curl") == 0) {
+				input = InputMode::Curl;
+			}
+			else if (strcmp(value, "uring") == 0) {
+				input = InputMode::Uring;
+			}
+			else if (strcmp(value, "pread") == 0) {
+				input = InputMode::Pread;
+			}
+			else {
+				usage();
+				return 2;
+			}
+		}
+#endif
+		else if (arg[0] == '-') {
+			usage();
+			return 2;
+		}
+		else {
+			args.push_back(arg);
+		}
+	}
+	// --probe は何も書き出さない
+	const bool writes = outputDirectory || packPath || encodeDirectory;
+	if (args.empty() || (outputDirectory && packPath) || probe == writes) {
+		usage();
+		return 2;
+	}
+
+	BatchJob job;
+	job.input = input;
+	job.inputs = collectInputs(args);
+	for (const fs::path& input : job.inputs) {
+		job.urls.push_back(fileUrl(input));
+	}
+	job.names = outputNames(job.inputs);
+	job.probe = probe;
+	job.probes.resize(job.inputs.size());
+	if (encodeDirectory) {
+		std::error_code ec;
+		fs::create_directories(encodeDirectory, ec);
+		job.encodeDirectory = encodeDirectory;
+	}
+
+	std::unique_ptr<FrameSink> sink;
+	if (packPath) {
+		auto pack = std::make_unique<PackFrameSink>(packPath, job.names, format);
+		if (!pack->ok()) {
+			LOGE("Failed to open %s\n", packPath);
+			Logger::instance().flush();
+			return 1;
+		}
+		sink = std::move(pack);
+	}
+	else if (outputDirectory) {
+		std::error_code ec;
+		fs::create_directories(outputDirectory, ec);
+		sink = std::make_unique<RawFrameSink>(outputDirectory, job.names, format);
+	}
+	job.sink = sink.get();
+
+	// 表示がないのですべてのコアでデコードする
+	if (threads == 0) {
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	if (inFlight == 0) {
+		inFlight = threads * 2;
+	}
+	inFlight = std::min(inFlight, std::max<size_t>(job.urls.size(), 1));
+
+	g_mainWQ = new Workqueue();
+	std::thread{ []() {
+		ThreadTopology::instance().enter(ThreadRole::Main, 0, "main");
+		g_mainWQ->run();
+	} }.detach();
+	g_curlPool = new CurlWorkqueuePool(threads);
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> lanes;
+	for (size_t i = 0; i < inFlight; ++i) {
+		lanes.emplace_back([&job]() {
+			unifex::sync_wait(job.probe ? probe_files(job) : decode_files(job));
+		});
+	}
+	for (std::thread& lane : lanes) {
+		lane.join();
+	}
+	// パックは索引を書けなければ全体が読めないので、ファイルごとの失敗とは別に終了コードに出す
+	const bool finished = !sink || sink->finish();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	ThreadTopology::instance().report();
+	MemoryBudget::instance().report();
+	CanvasPool::instance().report();
+#ifdef ENABLE_TRACE
+	// レーンが全部終わってから書くので、最後のファイルのイベントまで入る
+	Tracer::write("trace.json");
+#endif
+	g_curlPool->stop();
+
+	const size_t files = job.urls.size();
+	const double megabytesRead = job.bytesRead / (1024.0 * 1024.0);
+	const double megabytesWritten = sink ? sink->bytesWritten() / (1024.0 * 1024.0) : 0.0;
+	Logger::instance().flush();
+	if (probe) {
+		for (size_t i = 0; i < job.inputs.size(); ++i) {
+			printProbe(job.inputs[i], job.probes[i]);
+		}
+	}
+	printf("%zu files (%zu failed), %zu frames in %.2f s\n", files, job.failed.load(), job.frames.load(), seconds);
+	printf("%.1f files/s, %.1f frames/s, read %.1f MB/s, wrote %.1f MB/s\n",
+		files / seconds, job.frames / seconds, megabytesRead / seconds, megabytesWritten / seconds);
+	if (encodeDirectory) {
+		const double megabytesEncoded = job.bytesEncoded / (1024.0 * 1024.0);
+		printf("re-encoded %.1f MB of GIF, %.1f MB/s\n", megabytesEncoded, megabytesEncoded / seconds);
+	}
+	return job.failed == 0 && finished ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+#include <unifex/sync_wait.hpp>
+#include <unifex/task.hpp>
+#include <pthread.h>
+#include <signal.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include "workqueue.h"
+#include "mainwq.h"
+#include "canvas_pool.h"
+#include "frame_export.h"
+#include "indexed_image.h"
+#include "logger.h"
+#include "memory_budget.h"
+#include "thread_topology.h"
+#include "trace.h"
+
+// ウィンドウを持たない Linux 用のフロントエンド。main_task() のストリームを再生し、
+// 表示するフレームを共有メモリに書き出す。描画は別のプロセス (shmclient など) がつないで行う
+
+unifex::task<void> main_task();
+void StopStreams();
+
+Workqueue* g_mainWQ;
+
+namespace {
+
+std::unique_ptr<SharedFrameExporter> g_exporter;
+int g_targetWidth = 1024;
+int g_targetHeight = 1024;
+
+void usage()
+{
+	fprintf(stderr,
+		"usage: gifshm [options]\n"
+		"  -s <path>             socket to accept frame clients on (default: /tmp/tkf25-frames.sock)\n"
+		"  -m <width>x<height>   largest frame; bigger GIFs are scaled down to fit (default: 1024x1024)\n"
+		"  -k <slots>            frames kept per stream (default: 3)\n"
+		"  -a <topology>         pin threads to CPUs, e.g. \"main=0 network=1-3\" (default: $TKF25_THREADS)\n"
+		"  -b <bytes>            memory budget, e.g. 256M; throttles transfers while exceeded (default: $TKF25_MEMORY_BUDGET)\n"
+		"  -c <pool>             canvas pool, e.g. \"limit=64M hugepages=explicit\" (default: $TKF25_CANVAS_POOL)\n");
+}
+
+}
+
+void enqueueWork(Workqueue::Node& node)
+{
+	g_mainWQ->enqueue(node);
+}
+
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule, Priority priority)
+{
+	g_mainWQ->enqueue(handle, schedule, priority);
+}
+
+bool cancelCoroutine(std::coroutine_handle<> handle)
+{
+	return g_mainWQ->cancel(handle);
+}
+
+WorkqueueClock& mainWQClock()
+{
+	return g_mainWQ->clock();
+}
+
+// メインスレッドで呼ばれる。共有メモリへの書き込みはストリームごとに1スレッドなのでロックはいらない
+void SetImage(const IndexedImage& image, int index)
+{
+	g_exporter->publish(index, image);
+}
+
+// スロットに収まる大きさまで縮小して合成させる。縦横比が変わらないように幅と高さを同じ比率で縮める
+bool GetTargetImageSize(int index, int& width, int& height)
+{
+	if (width <= g_targetWidth && height <= g_targetHeight) {
+		return false;
+	}
+	if (static_cast<int64_t>(width) * g_targetHeight > static_cast<int64_t>(height) * g_targetWidth) {
+		height = std::max(1, static_cast<int>(static_cast<int64_t>(height) * g_targetWidth / width));
+		width = g_targetWidth;
+	}
+	else {
+		width = std::max(1, static_cast<int>(static_cast<int64_t>(width) * g_targetHeight / height));
+		height = g_targetHeight;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	const char* socketPath = "/tmp/tkf25-frames.sock";
+	uint32_t slotCount = SharedFrameExporter::DefaultSlotCount;
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-s") == 0 && hasValue) {
+			socketPath = argv[++i];
+		}
+		else if (strcmp(arg, "-m") == 0 && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &g_targetWidth, &g_targetHeight) != 2 || g_targetWidth <= 0 || g_targetHeight <= 0) {
+				usage();
+				return 2;
+			}
+		}
+		else if (strcmp(arg, "-k") == 0 && hasValue) {
+			slotCount = strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(arg, "-a") == 0 && hasValue) {
+			if (!ThreadTopology::instance().configure(argv[++i])) {
+				Logger::instance().flush();
+				return 2;
+			}
+		}
+		else if (strcmp(arg, "-b") == 0 && hasValue) {
+			if (!MemoryBudget::instance().configure(argv[++i])) {
+				Logger::instance().flush();
+				return 2;
+			}
+		}
+		else if (strcmp(arg, "-c") == 0 && hasValue) {
+			if (!CanvasPool::instance().configure(argv[++i])) {
+				Logger::instance().flush();
+				return 2;
+			}
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	// シグナルは下の sigwait() だけで受ける。以降に作るスレッド (書き出しの待ち受けも含む) にも引き継がれる
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	// main_win.cpp と同じく 4x2 のタイル分
+	g_exporter = std::make_unique<SharedFrameExporter>(socketPath, 8, g_targetWidth, g_targetHeight, slotCount);
+	if (!g_exporter->ok()) {
+		Logger::instance().flush();
+		return 1;
+	}
+
+	g_mainWQ = new Workqueue();
+	std::thread{ []() {
+		ThreadTopology::instance().enter(ThreadRole::Main, 0, "main");
+		g_mainWQ->run();
+	} }.detach();
+
+	std::thread streams([]() {
+		unifex::sync_wait(main_task());
+	});
+	std::thread{ [signals]() {
+		int signal;
+		sigwait(&signals, &signal);
+		LOGI("Stopping streams\n");
+		StopStreams();
+	} }.detach();
+	streams.join();
+	ThreadTopology::instance().report();
+	MemoryBudget::instance().report();
+	CanvasPool::instance().report();
+
+#ifdef ENABLE_TRACE
+	Tracer::write("trace.json");
+#endif
+	g_exporter.reset();
+	Logger::instance().flush();
+	return 0;
+}
@@ -7,79 +7,119 @@
 #include <unifex/task.hpp>
 #include "workqueue.h"
 #include "mainwq.h"
+#include "canvas_pool.h"
 #include "gif.h"
+#include "indexed_image.h"
+#include "logger.h"
+#include "memory_budget.h"
+#include "thread_topology.h"
+#include "trace.h"
 #include <windows.h>
 
 unifex::task<void> main_task();
+void StopStreams();
 
 HWND g_hwnd;
+// main_task() が終わったら送る
+constexpr UINT WM_MAIN_TASK_DONE = WM_USER + 1;
+bool g_closing = false;      // ウィンドウが閉じられてストリームの終了を待っている
+bool g_mainTaskDone = false; // WM_MAIN_TASK_DONE を受け取った
 
 class WinWorkqueue : public Workqueue {
 public:
 	void execute(HWND hwnd)
 	{
 		::KillTimer(hwnd, 0);
+		// これ以降に積まれたものは新しく WM_USER を送ってもらう
+		m_posted.store(false);
 		auto nextSchedule = executeExpired(false);
 		if (nextSchedule) {
-			auto now = Workqueue::Work::Clock::now();
+			auto now = clock().now();
 			if (now < *nextSchedule) {
 				auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(*nextSchedule - now);
 				::SetTimer(hwnd, 0, delay.count(), NULL);
 			}
 			else {
-				::PostMessage(hwnd, WM_USER, 0, 0);
+				wakeup();
 			}
 		}
 	}
 
+	// WM_USER がまだ処理されていなければ送らない
 	virtual void wakeup() override
 	{
-		::PostMessage(g_hwnd, WM_USER, 0, 0);
+		if (!m_posted.exchange(true)) {
+			::PostMessage(g_hwnd, WM_USER, 0, 0);
+		}
 	}
+
+private:
+	std::atomic<bool> m_posted{ false };
 };
 
 WinWorkqueue* g_mainWQ = nullptr;
 
-void enqueueCoroutine(std::coroutine_handle<> handle)
+void enqueueWork(Workqueue::Node& node)
 {
-	g_mainWQ->enqueue(handle);
+	g_mainWQ->enqueue(node);
 }
 
-void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule)
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule, Priority priority)
 {
-	g_mainWQ->enqueue(handle, schedule);
+	g_mainWQ->enqueue(handle, schedule, priority);
 }
 
-struct Image {
-	std::vector<uint32_t> image;
-	int width = 0;
-	int height = 0;
-};
-Image g_images[4 * 2];
+bool cancelCoroutine(std::coroutine_handle<> handle)
+{
+	return g_mainWQ->cancel(handle);
+}
 
-void SetImage(const std::vector<uint32_t>& image, int width, int height, int index) {
-	g_images[index].image = image;
-	g_images[index].width = width;
-	g_images[index].height = height;
+WorkqueueClock& mainWQClock()
+{
+	return g_mainWQ->clock();
+}
+
+// 表示中のフレームはインデックスのまま持ち、描画するときだけ ARGB に展開する
+IndexedImage g_images[4 * 2];
+std::vector<uint32_t> g_paintBuffer;
+MemoryBudget::Account g_displayMemory("display");
+
+void SetImage(const IndexedImage& image, int index) {
+	g_images[index] = image;
+	size_t bytes = g_paintBuffer.capacity() * sizeof(uint32_t);
+	for (const IndexedImage& displayed : g_images) {
+		bytes += displayed.memoryUsage();
+	}
+	g_displayMemory.update(MemoryCategory::Display, bytes);
 
-	// EBhEĕ`
+	// ウィンドウを再描画
 	InvalidateRect(g_hwnd, nullptr, TRUE);
 }
 
+// 各画像は 200x200 のタイルに縮小して描画するので、それより大きくは合成しない
+bool GetTargetImageSize(int index, int& width, int& height) {
+	width = 200;
+	height = 200;
+	return true;
+}
+
 void Paint(HWND hwnd) {
 	PAINTSTRUCT ps;
 	HDC hdc = BeginPaint(hwnd, &ps);
 
 	for (int i = 0; i < sizeof(g_images) / sizeof(g_images[0]); ++i) {
-		if (g_images[i].width > 0 && g_images[i].height > 0) {
-			// 摜`
-			int x = i % 4 * 200; // 4ɕĔzu
-			int y = i / 4 * 200; // 2sɕĔzu
-			HBITMAP hBitmap = CreateBitmap(g_images[i].width, g_images[i].height, 1, 32, g_images[i].image.data());
+		const IndexedImage& image = g_images[i];
+		if (image.width() > 0 && image.height() > 0) {
+			// 画像を描画
+			int x = i % 4 * 200; // 4列に分けて配置
+			int y = i / 4 * 200; // 2行に分けて配置
+			g_paintBuffer.resize(static_cast<size_t>(image.width()) * image.height());
+			image.toARGB(g_paintBuffer.data());
+			HBITMAP hBitmap = CreateBitmap(image.width(), image.height(), 1, 32, g_paintBuffer.data());
 			HDC hMemDC = CreateCompatibleDC(hdc);
 			SelectObject(hMemDC, hBitmap);
 			StretchBlt(hdc, x, y, 200, 200,
-				hMemDC, 0, 0, g_images[i].width, g_images[i].height,
+				hMemDC, 0, 0, image.width(), image.height(),
 				SRCCOPY);
 			DeleteObject(hBitmap);
 			DeleteDC(hMemDC);
@@ -89,32 +129,58 @@ void Paint(HWND hwnd) {
 	EndPaint(hwnd, &ps);
 }
 
-// EBhEvV[W
+// ウィンドウプロシージャ
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 	switch (uMsg) {
 	case WM_CREATE:
-		// Workqueue
+		// Workqueueを初期化
 		g_mainWQ = new WinWorkqueue();
 		break;
 
 	case WM_TIMER:
-		printf("WM_TIMER\n");
+		LOGD("WM_TIMER\n");
 		g_mainWQ->execute(hwnd);
 		break;
 
 	case WM_USER:
-		printf("WM_USER\n");
+		LOGD("WM_USER\n");
 		g_mainWQ->execute(hwnd);
 		break;
 
 	case WM_PAINT:
-		printf("WM_PAINT\n");
-		// EBhE̍ĕ`
+		LOGD("WM_PAINT\n");
+		// ウィンドウの再描画
 		Paint(hwnd);
 		break;
 
+	case WM_CLOSE:
+		// 止めたストリームはメインスレッドで後始末をするので、main_task() が終わるまで
+		// ウィンドウを残してメインキューを回し続ける
+		if (g_mainTaskDone) {
+			DestroyWindow(hwnd);
+		}
+		else if (!g_closing) {
+			g_closing = true;
+			ShowWindow(hwnd, SW_HIDE);
+			StopStreams();
+		}
+		break;
+
+	case WM_MAIN_TASK_DONE:
+		g_mainTaskDone = true;
+		if (g_closing) {
+			DestroyWindow(hwnd);
+		}
+		break;
+
 	case WM_DESTROY:
-		delete g_mainWQ;
+		ThreadTopology::instance().report();
+		MemoryBudget::instance().report();
+		CanvasPool::instance().report();
+#ifdef ENABLE_TRACE
+		Tracer::write("trace.json");
+#endif
+		// ネットワークスレッドは止めるだけで終わりを待たないので、メインキューは破棄しない
 		PostQuitMessage(0);
 		break;
 	default:
@@ -123,7 +189,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 	return 0;
 }
 
-// EBhE쐬֐
+// ウィンドウを作成する関数
 HWND CreateMainWindow(HINSTANCE hInstance, int width, int height) {
 	const TCHAR* CLASS_NAME = TEXT("GIF Viewer");
 
@@ -135,12 +201,12 @@ HWND CreateMainWindow(HINSTANCE hInstance, int width, int height) {
 	RegisterClass(&wc);
 
 	HWND hwnd = CreateWindowEx(
-		0,                              // gX^C
-		CLASS_NAME,                     // EBhENX
-		TEXT("GIF Viewer"),             // EBhE^Cg
-		WS_OVERLAPPEDWINDOW,            // EBhEX^C
-		CW_USEDEFAULT, CW_USEDEFAULT,   // ʒu
-		width, height,                  // TCY
+		0,                              // 拡張スタイル
+		CLASS_NAME,                     // ウィンドウクラス名
+		TEXT("GIF Viewer"),             // ウィンドウタイトル
+		WS_OVERLAPPEDWINDOW,            // ウィンドウスタイル
+		CW_USEDEFAULT, CW_USEDEFAULT,   // 初期位置
+		width, height,                  // 初期サイズ
 		nullptr, nullptr, hInstance, nullptr);
 
 	if (!hwnd) {
@@ -153,12 +219,12 @@ HWND CreateMainWindow(HINSTANCE hInstance, int width, int height) {
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
 	if (false) {
-		AllocConsole(); // R\[EBhE쐬
+		AllocConsole(); // コンソールウィンドウを作成
 
-		// WóE͂R\[ɃoCh
+		// 標準出力・入力をコンソールにバインド
 		FILE* fp;
-		freopen_s(&fp, "CONOUT$", "w", stdout);  // printf p
-		freopen_s(&fp, "CONOUT$", "w", stderr);  // fprintf(stderr) p
+		freopen_s(&fp, "CONOUT$", "w", stdout);  // printf 用
+		freopen_s(&fp, "CONOUT$", "w", stderr);  // fprintf(stderr) 用
 	}
 
 	HWND hwnd = CreateMainWindow(hInstance, 800, 400);
@@ -166,12 +232,14 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, LPSTR, int nCmdShow) {
 		return -1;
 	}
 	g_hwnd = hwnd;
+	ThreadTopology::instance().enter(ThreadRole::Main, 0, "main");
 
 	std::thread{ []() {
 		unifex::sync_wait(main_task());
+		::PostMessage(g_hwnd, WM_MAIN_TASK_DONE, 0, 0);
 	} }.detach();
 
-	// bZ[W[v
+	// メッセージループ
 	MSG msg = {};
 	while (GetMessage(&msg, nullptr, 0, 0)) {
 		TranslateMessage(&msg);
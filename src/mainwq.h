@@ -1,42 +1,137 @@
-#pragma once
-
-#include <chrono>
-#include <coroutine>
-
-void enqueueCoroutine(std::coroutine_handle<> handle);
-void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule);
-
-[[nodiscard]]
-auto sheduleOnMainWQ()
-{
-	struct Awaitable {
-		bool await_ready() { return false; }
-		bool await_suspend(std::coroutine_handle<> h)
-		{
-			enqueueCoroutine(h);
-			return true;
-		}
-		void await_resume() {}
-	};
-
-	return Awaitable{};
-}
-
-template <class _Rep, class _Period>
-[[nodiscard]]
-auto sheduleOnMainWQ(const std::chrono::duration<_Rep, _Period>& timeout)
-{
-	struct Awaitable {
-		bool await_ready() { return false; }
-		bool await_suspend(std::coroutine_handle<> h)
-		{
-			enqueueCoroutine(h, schedule);
-			return true;
-		}
-		void await_resume() {}
-
-		std::chrono::steady_clock::time_point schedule;
-	};
-
-	return Awaitable{ std::chrono::steady_clock::now() + timeout };
-}
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <mutex>
+#include <optional>
+#include <unifex/inplace_stop_token.hpp>
+#include "workqueue.h"
+
+// すぐに再開させるものはこれで node の優先度のレーンに入れる。node は実行されるまで動かさないこと
+void enqueueWork(Workqueue::Node& node);
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule,
+	Priority priority = Priority::Foreground);
+// まだ再開されていなければキューから取り除いて true を返す
+bool cancelCoroutine(std::coroutine_handle<> handle);
+// メインの Workqueue のクロック。表示のタイミングはこれで測る
+WorkqueueClock& mainWQClock();
+
+[[nodiscard]]
+inline auto sheduleOnMainWQ(Priority priority = Priority::Foreground)
+{
+	struct Awaitable {
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			node = Workqueue::Node{ &Workqueue::Work::resumeCoroutine, h.address(), priority };
+			enqueueWork(node);
+			return true;
+		}
+		void await_resume() {}
+
+		Priority priority;
+		Workqueue::Node node;
+	};
+
+	return Awaitable{ priority };
+}
+
+template <class _Rep, class _Period>
+[[nodiscard]]
+auto sheduleOnMainWQ(const std::chrono::duration<_Rep, _Period>& timeout)
+{
+	struct Awaitable {
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			enqueueCoroutine(h, schedule);
+			return true;
+		}
+		void await_resume() {}
+
+		std::chrono::steady_clock::time_point schedule;
+	};
+
+	return Awaitable{ mainWQClock().now() + timeout };
+}
+
+// ストップ要求が来たら timeout を待たずにメインスレッドで再開する。再開後に stopToken を見て打ち切ること
+template <class _Rep, class _Period>
+[[nodiscard]]
+auto sheduleOnMainWQ(const std::chrono::duration<_Rep, _Period>& timeout, unifex::inplace_stop_token stopToken,
+	Priority priority = Priority::Foreground)
+{
+	struct Awaitable {
+		struct OnStop {
+			void operator()() noexcept
+			{
+				std::lock_guard<std::mutex> lock(awaitable->mutex);
+				if (!awaitable->enqueued) {
+					// まだキューに入れていないので await_suspend 側ですぐに再開させる
+					awaitable->stopped = true;
+				}
+				else if (cancelCoroutine(awaitable->handle)) {
+					awaitable->resumeNow();
+				}
+			}
+			Awaitable* awaitable;
+		};
+
+		Awaitable(std::chrono::steady_clock::time_point schedule, unifex::inplace_stop_token stopToken, Priority priority)
+			: schedule(schedule)
+			, stopToken(stopToken)
+			, priority(priority)
+		{
+		}
+		// co_await に渡すときに移動される。中断前なので状態は持ち越さなくてよい
+		Awaitable(Awaitable&& rhs) noexcept
+			: Awaitable(rhs.schedule, rhs.stopToken, rhs.priority)
+		{
+		}
+
+		bool await_ready() { return stopToken.stop_requested(); }
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			// 登録時にすでに止まっていればその場で呼ばれる
+			callback.emplace(stopToken, OnStop{ this });
+
+			// キューに入れた時点で別スレッドで再開されうるので、ロックを放すまで this を保たせる
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopped) {
+				resumeNow();
+			}
+			else {
+				enqueueCoroutine(h, schedule, priority);
+			}
+			enqueued = true;
+			return true;
+		}
+		void await_resume()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+			}
+			callback.reset();
+		}
+
+		// 期限を待たずに、同じ優先度ですぐに再開させる。mutex を持って呼ぶ
+		void resumeNow()
+		{
+			node = Workqueue::Node{ &Workqueue::Work::resumeCoroutine, handle.address(), priority };
+			enqueueWork(node);
+		}
+
+		std::chrono::steady_clock::time_point schedule;
+		unifex::inplace_stop_token stopToken;
+		Priority priority;
+		std::coroutine_handle<> handle;
+		std::mutex mutex;
+		bool enqueued = false;
+		bool stopped = false;
+		std::optional<unifex::inplace_stop_token::callback_type<OnStop>> callback;
+		Workqueue::Node node;
+	};
+
+	return Awaitable{ mainWQClock().now() + timeout, stopToken, priority };
+}
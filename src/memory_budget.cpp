@@ -0,0 +1,243 @@
+#include "memory_budget.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+constexpr double MB = 1024.0 * 1024.0;
+
+// value を超えていれば peak を上げる
+void raise(std::atomic<int64_t>& peak, int64_t value)
+{
+	int64_t current = peak.load(std::memory_order_relaxed);
+	while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+}
+
+}
+
+bool parseByteSize(const char* spec, size_t& bytes)
+{
+	char* end;
+	double value = strtod(spec, &end);
+	if (end == spec || value < 0) {
+		return false;
+	}
+	switch (*end) {
+	case 'K': case 'k': value *= 1024; ++end; break;
+	case 'M': case 'm': value *= MB; ++end; break;
+	case 'G': case 'g': value *= MB * 1024; ++end; break;
+	default: break;
+	}
+	if (*end != '\0') {
+		return false;
+	}
+	bytes = static_cast<size_t>(value);
+	return true;
+}
+
+MemoryBudget::Account::Account(const char* name, int index)
+	: m_name(name)
+	, m_index(index)
+{
+	MemoryBudget& budget = MemoryBudget::instance();
+	std::lock_guard<std::mutex> lock(budget.m_mutex);
+	budget.m_accounts.push_back(this);
+}
+
+MemoryBudget::Account::~Account()
+{
+	MemoryBudget& budget = MemoryBudget::instance();
+	int64_t peak;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::fill(std::begin(m_bytes), std::end(m_bytes), 0);
+		m_total = 0;
+		m_reserved = 0;
+		charge();
+		peak = m_peak;
+	}
+	if (m_index >= 0) {
+		budget.m_finishedPeaks.fetch_add(peak, std::memory_order_relaxed);
+		++budget.m_finishedStreams;
+		LOGI("Memory peak of %s %d: %.1f MB (reader %.1f, decode %.1f, canvas %.1f, queue %.1f MB)\n", m_name, m_index,
+			peak / MB,
+			m_peaks[static_cast<size_t>(MemoryCategory::Reader)] / MB,
+			m_peaks[static_cast<size_t>(MemoryCategory::Decode)] / MB,
+			m_peaks[static_cast<size_t>(MemoryCategory::Canvas)] / MB,
+			m_peaks[static_cast<size_t>(MemoryCategory::Queue)] / MB);
+	}
+	budget.remove(this);
+}
+
+void MemoryBudget::Account::update(MemoryCategory category, size_t bytes)
+{
+	const size_t i = static_cast<size_t>(category);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int64_t delta = static_cast<int64_t>(bytes) - m_bytes[i];
+	if (delta == 0) {
+		return;
+	}
+	m_bytes[i] = static_cast<int64_t>(bytes);
+	m_peaks[i] = std::max(m_peaks[i], m_bytes[i]);
+	m_total += delta;
+	m_peak = std::max(m_peak, m_total);
+	charge();
+}
+
+size_t MemoryBudget::Account::bytes()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return static_cast<size_t>(m_total);
+}
+
+size_t MemoryBudget::Account::peak()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return static_cast<size_t>(m_peak);
+}
+
+void MemoryBudget::Account::charge()
+{
+	int64_t charged = std::max(m_total, m_reserved);
+	if (charged != m_charged) {
+		MemoryBudget::instance().add(charged - m_charged);
+		m_charged = charged;
+	}
+}
+
+MemoryBudget& MemoryBudget::instance()
+{
+	// 静的な Account の破棄より先に消えないように破棄しない
+	static MemoryBudget* budget = new MemoryBudget();
+	return *budget;
+}
+
+MemoryBudget::MemoryBudget()
+{
+	if (const char* spec = getenv("TKF25_MEMORY_BUDGET")) {
+		configure(spec);
+	}
+}
+
+bool MemoryBudget::configure(const char* spec)
+{
+	size_t limit;
+	if (!parseByteSize(spec, limit)) {
+		LOGE("Invalid memory budget: %s\n", spec);
+		return false;
+	}
+	m_limit.store(limit, std::memory_order_relaxed);
+	if (limit != 0) {
+		LOGI("Memory budget: %.1f MB\n", limit / MB);
+	}
+	return true;
+}
+
+bool MemoryBudget::admit(Account& account)
+{
+	if (reserve(account)) {
+		return true;
+	}
+	++m_rejected;
+	return false;
+}
+
+bool MemoryBudget::reserve(Account& account, bool force)
+{
+	const int64_t limit = static_cast<int64_t>(this->limit());
+	if (limit == 0) {
+		return true;
+	}
+
+	// 同時に始めようとしたストリームがどれもまだ使っていない状態で通らないように、見込みの分を先に数える
+	const int64_t expected = static_cast<int64_t>(expectedStreamBytes());
+	int64_t used = m_used.load(std::memory_order_relaxed);
+	do {
+		if (!force && used + expected > limit) {
+			return false;
+		}
+	} while (!m_used.compare_exchange_weak(used, used + expected, std::memory_order_relaxed));
+	raise(m_peak, used + expected);
+
+	std::lock_guard<std::mutex> lock(account.m_mutex);
+	account.m_reserved = expected;
+	// 予約は used に足してあるので、使用量との差だけを charge() で合わせる
+	account.m_charged += expected;
+	account.charge();
+	return true;
+}
+
+size_t MemoryBudget::expectedStreamBytes()
+{
+	int64_t streams = m_finishedStreams.load(std::memory_order_relaxed);
+	if (streams != 0) {
+		return static_cast<size_t>(m_finishedPeaks.load(std::memory_order_relaxed) / streams);
+	}
+
+	// ループし続けるストリームは終わらないので、まだ終わったものがなければ動いているストリームのこれまでの最大を使う
+	int64_t peaks = 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (Account* account : m_accounts) {
+		if (account->m_index < 0) {
+			continue;
+		}
+		std::lock_guard<std::mutex> accountLock(account->m_mutex);
+		if (account->m_peak > 0) {
+			peaks += account->m_peak;
+			++streams;
+		}
+	}
+	return streams != 0 ? static_cast<size_t>(peaks / streams) : 0;
+}
+
+void MemoryBudget::add(int64_t delta)
+{
+	raise(m_peak, m_used.fetch_add(delta, std::memory_order_relaxed) + delta);
+}
+
+void MemoryBudget::remove(Account* account)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_accounts.erase(std::remove(m_accounts.begin(), m_accounts.end(), account), m_accounts.end());
+}
+
+std::vector<MemoryBudget::AccountStats> MemoryBudget::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<AccountStats> result;
+	for (Account* account : m_accounts) {
+		std::lock_guard<std::mutex> accountLock(account->m_mutex);
+		AccountStats stats;
+		stats.name = account->m_name;
+		stats.index = account->m_index;
+		stats.bytes = static_cast<size_t>(account->m_total);
+		stats.peak = static_cast<size_t>(account->m_peak);
+		for (size_t i = 0; i < MemoryCategoryCount; ++i) {
+			stats.peaks[i] = static_cast<size_t>(account->m_peaks[i]);
+		}
+		result.push_back(stats);
+	}
+	return result;
+}
+
+void MemoryBudget::report()
+{
+	if (limit() != 0) {
+		LOGI("Memory: %.1f MB in use, peak %.1f MB of %.1f MB budget, %llu admissions refused\n",
+			used() / MB, peak() / MB, limit() / MB, static_cast<unsigned long long>(m_rejected.load()));
+	}
+	else {
+		LOGI("Memory: %.1f MB in use, peak %.1f MB (no budget)\n", used() / MB, peak() / MB);
+	}
+	for (const AccountStats& stats : this->stats()) {
+		if (stats.index >= 0) {
+			LOGI("Memory of %s %d: %.1f MB, peak %.1f MB\n", stats.name, stats.index, stats.bytes / MB, stats.peak / MB);
+		}
+		else {
+			LOGI("Memory of %s: %.1f MB, peak %.1f MB\n", stats.name, stats.bytes / MB, stats.peak / MB);
+		}
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// メモリを使っているもの
+enum class MemoryCategory {
+	Reader,  // CurlReader の受信バッファ
+	Decode,  // カラーテーブル、圧縮データ、LZW の辞書と出力、インターレースの並べ替え
+	Canvas,  // 合成先の画像、途中のパスの画像、縮小の対応表、再エンコード用の ARGB
+	Queue,   // 表示を待っているフレーム (FrameQueue)
+	Cache,   // FrameCache
+	Display, // 表示側が持っているフレームの写し
+};
+constexpr size_t MemoryCategoryCount = 6;
+
+// "512M" や "1G" をバイト数にする (K/M/G を付けられる)
+bool parseByteSize(const char* spec, size_t& bytes);
+
+// プロセス全体のメモリの使用量を、ストリームやサブシステムごとの Account に分けて数える。
+// 確保のたびに数えるのではなく、持ち主がバッファの容量を区切り (フレームごとや受信バッファの確保し直し) で報告する。
+// 上限を設定すると、新しいストリームは expectedStreamBytes() を予約できなければ断り (admit())、
+// 超えている間は受信バッファに読まれていないデータが溜まった転送を止める (CurlReader)。
+// 上限は "512M" のようにバイト数で指定する (K/M/G を付けられる)。環境変数 TKF25_MEMORY_BUDGET があれば最初に読む
+class MemoryBudget {
+public:
+	// 1ストリームか1つのサブシステムの分。作ると登録され、破棄すると使用量が返る。
+	// update() はどのスレッドから呼んでもよい
+	class Account {
+	public:
+		// name は静的な文字列であること。ストリームなら index にその番号を渡す
+		explicit Account(const char* name, int index = -1);
+		~Account();
+
+		Account(const Account&) = delete;
+		Account& operator=(const Account&) = delete;
+
+		// category の使用量を bytes にする
+		void update(MemoryCategory category, size_t bytes);
+
+		size_t bytes();
+		size_t peak();
+
+	private:
+		friend class MemoryBudget;
+
+		// 全体に数える量 (使用量と予約の大きい方) を合わせる。m_mutex を持って呼ぶ
+		void charge();
+
+		const char* m_name;
+		const int m_index;
+
+		std::mutex m_mutex; // 以下を守る
+		int64_t m_bytes[MemoryCategoryCount] = {};
+		int64_t m_peaks[MemoryCategoryCount] = {};
+		int64_t m_total = 0;
+		int64_t m_peak = 0;
+		int64_t m_reserved = 0; // admit() で予約した分。使用量がこれに届くまでは予約の分を数える
+		int64_t m_charged = 0;  // 全体に数えている分
+	};
+
+	struct AccountStats {
+		const char* name;
+		int index;
+		size_t bytes;
+		size_t peak;
+		size_t peaks[MemoryCategoryCount]; // カテゴリーごとの最大 (同時とは限らない)
+	};
+
+	static MemoryBudget& instance();
+
+	// spec を読んで上限にする ("0" なら上限なし)。書式が正しくなければ何も変えずに false
+	bool configure(const char* spec);
+
+	size_t limit() const { return m_limit.load(std::memory_order_relaxed); }
+	size_t used() const { return static_cast<size_t>(m_used.load(std::memory_order_relaxed)); }
+	size_t peak() const { return static_cast<size_t>(m_peak.load(std::memory_order_relaxed)); }
+	// 上限を超えている
+	bool exceeded() const
+	{
+		size_t limit = this->limit();
+		return limit != 0 && used() > limit;
+	}
+
+	// account のストリームを始めてよいか。始めてよければ見込みの使用量を予約して true。
+	// 上限がなければ常に true。断った数は report() に出る
+	bool admit(Account& account);
+	// admit() と同じように予約するが、断っても数えない (一度断られたストリームが空くのを待って試し直すとき)。
+	// force なら上限を超えていても予約する
+	bool reserve(Account& account, bool force = false);
+	// ストリームの見込みの使用量 (終わったストリームの最大使用量の平均)。
+	// まだ終わったものがなければ、動いているストリームのこれまでの最大使用量の平均
+	size_t expectedStreamBytes();
+
+	// 登録中の Account の統計
+	std::vector<AccountStats> stats();
+	// 全体と stats() をログに出す
+	void report();
+
+private:
+	MemoryBudget();
+	void add(int64_t delta);
+	void remove(Account* account);
+
+	std::atomic<size_t> m_limit{ 0 };
+	std::atomic<int64_t> m_used{ 0 };
+	std::atomic<int64_t> m_peak{ 0 };
+	std::atomic<uint64_t> m_rejected{ 0 };
+	std::atomic<int64_t> m_finishedPeaks{ 0 }; // 終わったストリームの最大使用量の合計
+	std::atomic<int64_t> m_finishedStreams{ 0 };
+
+	std::mutex m_mutex; // 以下を守る
+	std::vector<Account*> m_accounts;
+};
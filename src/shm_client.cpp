@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "frame_export.h"
+#include "indexed_image.h"
+#include "logger.h"
+
+// 共有メモリのフレームを読むクライアント。書かれてから読めるまでの遅延を測って1秒ごとに表示する。
+// -l ではこのプロセスの中で合成したフレームを書き出し、同じ経路 (ソケット、memfd、eventfd) で読む
+
+namespace {
+
+void usage()
+{
+	fprintf(stderr,
+		"usage: shmclient [options]\n"
+		"  -s <path>             socket to connect to (default: /tmp/tkf25-frames.sock)\n"
+		"  -n <frames>           exit after reading this many frames\n"
+		"  -l                    loopback: publish synthetic frames from this process and read them back\n"
+		"  -r <fps>              loopback frame rate per stream (default: 60)\n"
+		"  -m <width>x<height>   loopback frame size (default: 400x400)\n");
+}
+
+int64_t nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 画素を実際に読む。表示側がテクスチャに送る代わり
+volatile uint64_t g_touched;
+
+uint64_t touch(const SharedFrameClient::FrameView& view)
+{
+	size_t size = static_cast<size_t>(view.width) * view.height;
+	if (view.format == SharedFrameFormat::ARGB) {
+		size *= sizeof(uint32_t);
+	}
+	uint64_t sum = 0;
+	for (size_t i = 0; i < size; i += 64) {
+		sum += view.pixels[i];
+	}
+	return sum;
+}
+
+struct LatencyReport {
+	std::vector<int64_t> samplesNs;
+	uint64_t frames = 0;
+	uint64_t skipped = 0; // 読む前に次のフレームで上書きされた数
+	uint64_t torn = 0;    // 読んでいる間に上書きされた数
+
+	void print(double seconds)
+	{
+		if (samplesNs.empty()) {
+			printf("no frames\n");
+			return;
+		}
+		std::sort(samplesNs.begin(), samplesNs.end());
+		int64_t total = 0;
+		for (int64_t sample : samplesNs) {
+			total += sample;
+		}
+		auto percentile = [this](double p) {
+			return samplesNs[std::min(samplesNs.size() - 1, static_cast<size_t>(samplesNs.size() * p))] / 1000.0;
+		};
+		printf("%.1f frames/s, latency avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us (skipped %llu, torn %llu)\n",
+			frames / seconds, total / 1000.0 / samplesNs.size(), percentile(0.5), percentile(0.99),
+			samplesNs.back() / 1000.0, static_cast<unsigned long long>(skipped), static_cast<unsigned long long>(torn));
+		fflush(stdout);
+		*this = LatencyReport{};
+	}
+};
+
+}
+
+int main(int argc, char** argv)
+{
+	std::string socketPath = "/tmp/tkf25-frames.sock";
+	uint64_t frameLimit = 0;
+	bool loopback = false;
+	int fps = 60;
+	int width = 400;
+	int height = 400;
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-s") == 0 && hasValue) {
+			socketPath = argv[++i];
+		}
+		else if (strcmp(arg, "-n") == 0 && hasValue) {
+			frameLimit = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(arg, "-l") == 0) {
+			loopback = true;
+		}
+		else if (strcmp(arg, "-r") == 0 && hasValue) {
+			fps = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(arg, "-m") == 0 && hasValue) {
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+				usage();
+				return 2;
+			}
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	// ループバックでは 4 ストリームぶんを fps ごとに書く
+	std::unique_ptr<SharedFrameExporter> exporter;
+	std::atomic<bool> publishing{ true };
+	std::thread publisher;
+	if (loopback) {
+		socketPath = "/tmp/tkf25-loopback-" + std::to_string(getpid()) + ".sock";
+		exporter = std::make_unique<SharedFrameExporter>(socketPath.c_str(), 4, width, height);
+		if (!exporter->ok()) {
+			Logger::instance().flush();
+			return 1;
+		}
+		publisher = std::thread([&exporter, &publishing, width, height, fps]() {
+			IndexedImage image(width, height);
+			const auto interval = std::chrono::nanoseconds(1000000000 / fps);
+			auto next = std::chrono::steady_clock::now();
+			for (uint8_t value = 0; publishing; ++value) {
+				memset(image.indices(), value, static_cast<size_t>(width) * height);
+				for (uint32_t stream = 0; stream < 4; ++stream) {
+					exporter->publish(stream, image);
+				}
+				next += interval;
+				std::this_thread::sleep_until(next);
+			}
+		});
+	}
+
+	SharedFrameClient client(socketPath.c_str());
+	if (!client.ok()) {
+		publishing = false;
+		if (publisher.joinable()) {
+			publisher.join();
+		}
+		Logger::instance().flush();
+		return 1;
+	}
+	const SharedFrameHeader& header = client.header();
+	printf("connected: %u streams, %u slots, up to %ux%u\n", header.streamCount, header.slotCount, header.maxWidth, header.maxHeight);
+
+	std::vector<uint64_t> lastFrames(header.streamCount, 0);
+	LatencyReport report;
+	uint64_t totalFrames = 0;
+	auto reportBegin = std::chrono::steady_clock::now();
+	while (frameLimit == 0 || totalFrames < frameLimit) {
+		if (!client.wait(1000)) {
+			printf("disconnected\n");
+			break;
+		}
+		for (uint32_t stream = 0; stream < header.streamCount; ++stream) {
+			auto view = client.latest(stream, lastFrames[stream]);
+			if (!view) {
+				continue;
+			}
+			// 遅延は画素を読み始める前、新しいフレームに気づいた時点で測る
+			int64_t latency = nowNs() - view->publishNs;
+			g_touched = touch(*view);
+			if (!client.validate(*view)) {
+				++report.torn;
+				continue;
+			}
+			if (lastFrames[stream] != 0 && view->frame > lastFrames[stream] + 1) {
+				report.skipped += view->frame - lastFrames[stream] - 1;
+			}
+			lastFrames[stream] = view->frame;
+			report.samplesNs.push_back(latency);
+			++report.frames;
+			++totalFrames;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - reportBegin >= std::chrono::seconds(1)) {
+			report.print(std::chrono::duration<double>(now - reportBegin).count());
+			reportBegin = now;
+		}
+	}
+	if (!report.samplesNs.empty()) {
+		report.print(std::chrono::duration<double>(std::chrono::steady_clock::now() - reportBegin).count());
+	}
+
+	publishing = false;
+	if (publisher.joinable()) {
+		publisher.join();
+	}
+	Logger::instance().flush();
+	return 0;
+}
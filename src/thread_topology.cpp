@@ -0,0 +1,300 @@
+#include "thread_topology.h"
+#include "logger.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char* const RoleNames[ThreadRoleCount] = { "main", "network" };
+
+// "0-3,8" を CPU 番号の並びにする
+bool parseCpuList(const char* begin, const char* end, std::vector<int>& cpus)
+{
+	cpus.clear();
+	while (begin < end) {
+		char* next;
+		long first = strtol(begin, &next, 10);
+		if (next == begin || first < 0) {
+			return false;
+		}
+		long last = first;
+		if (next < end && *next == '-') {
+			begin = next + 1;
+			last = strtol(begin, &next, 10);
+			if (next == begin || last < first) {
+				return false;
+			}
+		}
+		for (long cpu = first; cpu <= last; ++cpu) {
+			cpus.push_back(static_cast<int>(cpu));
+		}
+		if (next < end && *next != ',') {
+			return false;
+		}
+		begin = next < end ? next + 1 : end;
+	}
+	return !cpus.empty();
+}
+
+std::string formatCpuList(const std::vector<int>& cpus)
+{
+	std::string text;
+	for (size_t i = 0; i < cpus.size();) {
+		size_t j = i;
+		while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+			++j;
+		}
+		if (!text.empty()) {
+			text += ',';
+		}
+		text += std::to_string(cpus[i]);
+		if (j > i) {
+			text += '-' + std::to_string(cpus[j]);
+		}
+		i = j + 1;
+	}
+	return text;
+}
+
+// 呼んだスレッドを cpus に固定する
+bool pinCurrentThread(const std::vector<int>& cpus)
+{
+#ifdef _WIN32
+	DWORD_PTR mask = 0;
+	for (int cpu : cpus) {
+		if (cpu < static_cast<int>(sizeof(mask) * 8)) {
+			mask |= DWORD_PTR(1) << cpu;
+		}
+	}
+	return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+}
+
+struct ThreadTopology::Entry {
+	const char* name = nullptr;
+	ThreadRole role = ThreadRole::Main;
+	std::string affinity;
+#ifdef _WIN32
+	HANDLE handle = nullptr;
+#else
+	pthread_t thread;
+	pid_t tid = 0;
+#endif
+
+	// スレッドが終わるときに登録を外す
+	~Entry()
+	{
+		if (name) {
+			ThreadTopology::instance().leave(this);
+		}
+	}
+
+	double cpuSeconds() const
+	{
+#ifdef _WIN32
+		FILETIME creation, exit, kernel, user;
+		if (!GetThreadTimes(handle, &creation, &exit, &kernel, &user)) {
+			return 0;
+		}
+		auto ticks = [](const FILETIME& time) {
+			return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+		};
+		return (ticks(kernel) + ticks(user)) / 1e7;
+#else
+		clockid_t clock;
+		timespec time;
+		if (pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &time) != 0) {
+			return 0;
+		}
+		return time.tv_sec + time.tv_nsec / 1e9;
+#endif
+	}
+
+	// CPU 間の移動回数と最後に動いた CPU。取れなければ -1
+	void scheduling(int64_t& migrations, int& cpu) const
+	{
+		migrations = -1;
+		cpu = -1;
+#ifndef _WIN32
+		char path[64];
+		char line[256];
+		snprintf(path, sizeof(path), "/proc/self/task/%d/sched", static_cast<int>(tid));
+		if (FILE* file = fopen(path, "r")) {
+			// カーネルが SCHED_DEBUG 付きでなければこのファイルはない
+			while (fgets(line, sizeof(line), file)) {
+				if (strncmp(line, "se.nr_migrations", 16) == 0) {
+					if (const char* colon = strchr(line, ':')) {
+						migrations = strtoll(colon + 1, nullptr, 10);
+					}
+					break;
+				}
+			}
+			fclose(file);
+		}
+		snprintf(path, sizeof(path), "/proc/self/task/%d/stat", static_cast<int>(tid));
+		if (FILE* file = fopen(path, "r")) {
+			// スレッド名に空白が入りうるので、最後の ')' のあとから数える。processor は 39 番目の項目
+			if (fgets(line, sizeof(line), file)) {
+				const char* field = strrchr(line, ')');
+				for (int i = 2; field && i < 39; ++i) {
+					field = strchr(field + 1, ' ');
+				}
+				if (field) {
+					cpu = atoi(field + 1);
+				}
+			}
+			fclose(file);
+		}
+#endif
+	}
+};
+
+ThreadTopology& ThreadTopology::instance()
+{
+	// 切り離したスレッドが終わるときにも登録を外しに来るので破棄しない
+	static ThreadTopology* topology = new ThreadTopology();
+	return *topology;
+}
+
+ThreadTopology::ThreadTopology()
+{
+	if (const char* spec = getenv("TKF25_THREADS")) {
+		configure(spec);
+	}
+}
+
+bool ThreadTopology::configure(const char* spec)
+{
+	std::vector<int> cpus[ThreadRoleCount];
+	const char* p = spec;
+	while (*p) {
+		if (*p == ' ' || *p == ';') {
+			++p;
+			continue;
+		}
+		const char* end = p + strcspn(p, " ;");
+		const char* equals = static_cast<const char*>(memchr(p, '=', end - p));
+		size_t role = ThreadRoleCount;
+		for (size_t i = 0; equals && i < ThreadRoleCount; ++i) {
+			if (static_cast<size_t>(equals - p) == strlen(RoleNames[i]) && strncmp(p, RoleNames[i], equals - p) == 0) {
+				role = i;
+			}
+		}
+		if (role == ThreadRoleCount || !parseCpuList(equals + 1, end, cpus[role])) {
+			LOGE("Invalid thread topology: %s\n", spec);
+			return false;
+		}
+		p = end;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < ThreadRoleCount; ++i) {
+		m_cpus[i] = std::move(cpus[i]);
+		if (!m_cpus[i].empty()) {
+			LOGI("Thread topology: %s on CPU %s\n", RoleNames[i], formatCpuList(m_cpus[i]).c_str());
+		}
+	}
+	return true;
+}
+
+void ThreadTopology::enter(ThreadRole role, size_t index, const char* name)
+{
+	TRACE_THREAD_NAME(name);
+
+	thread_local Entry entry;
+	if (entry.name) {
+		return; // 同じスレッドを2度登録しない
+	}
+
+	std::vector<int> cpus;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		cpus = m_cpus[static_cast<size_t>(role)];
+	}
+	if (role == ThreadRole::Network && !cpus.empty()) {
+		cpus = { cpus[index % cpus.size()] };
+	}
+
+	entry.name = name;
+	entry.role = role;
+#ifdef _WIN32
+	entry.handle = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, GetCurrentThreadId());
+#else
+	entry.thread = pthread_self();
+	entry.tid = gettid();
+#endif
+	if (!cpus.empty()) {
+		if (pinCurrentThread(cpus)) {
+			entry.affinity = formatCpuList(cpus);
+		}
+		else {
+			LOGW("Failed to pin %s to CPU %s\n", name, formatCpuList(cpus).c_str());
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.push_back(&entry);
+}
+
+void ThreadTopology::leave(Entry* entry)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_entries.erase(std::remove(m_entries.begin(), m_entries.end(), entry), m_entries.end());
+	}
+#ifdef _WIN32
+	if (entry->handle) {
+		CloseHandle(entry->handle);
+	}
+#endif
+}
+
+std::vector<ThreadTopology::ThreadStats> ThreadTopology::stats()
+{
+	// 終わりかけのスレッドは leave() でこのロックを待つので、読んでいる間に消えることはない
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<ThreadStats> result;
+	for (const Entry* entry : m_entries) {
+		ThreadStats stats;
+		stats.name = entry->name;
+		stats.role = entry->role;
+		stats.cpuSeconds = entry->cpuSeconds();
+		entry->scheduling(stats.migrations, stats.cpu);
+		stats.affinity = entry->affinity;
+		result.push_back(std::move(stats));
+	}
+	return result;
+}
+
+void ThreadTopology::report()
+{
+	for (const ThreadStats& stats : this->stats()) {
+		LOGI("Thread %s: %.3f s CPU, %lld migrations, last on CPU %d, pinned to %s\n", stats.name, stats.cpuSeconds,
+			static_cast<long long>(stats.migrations), stats.cpu, stats.affinity.empty() ? "-" : stats.affinity.c_str());
+	}
+}
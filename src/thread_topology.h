@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// スレッドの役割。デコードはストリームを受け持つネットワークスレッドで行うので Network に含まれる
+enum class ThreadRole {
+	Main,    // メインの Workqueue (表示)
+	Network, // CurlWorkqueuePool のシャード
+};
+constexpr size_t ThreadRoleCount = 2;
+
+// 役割ごとにスレッドを置く CPU を決め、置いたスレッドの CPU 時間と CPU 間の移動回数を集める。
+// 設定は "main=0 network=2-5,8" のように役割ごとに CPU の番号を並べる (; でも区切れる)。
+//   main    集合全体に固定する
+//   network シャード i を i 番目の CPU (集合の数で折り返す) 1つに固定する
+// 設定のない役割は OS に任せる。環境変数 TKF25_THREADS があれば最初に読む。
+// バッファはそれを使うスレッドで確保する (StreamContext はネットワークスレッドで作る) ので、
+// 固定したスレッドの最初の書き込みで NUMA ノードの近いメモリに載る
+class ThreadTopology {
+public:
+	struct ThreadStats {
+		const char* name;
+		ThreadRole role;
+		double cpuSeconds;
+		int64_t migrations; // 取れなければ -1
+		int cpu;            // 最後に動いた CPU。取れなければ -1
+		std::string affinity; // 固定した CPU (固定していなければ空)
+	};
+
+	static ThreadTopology& instance();
+
+	// spec を読んで以降に enter() するスレッドに使う。書式が正しくなければ何も変えずに false
+	bool configure(const char* spec);
+
+	// 呼んだスレッドを role の index 番目として登録し、設定があれば CPU に固定する。
+	// name はトレースにも使うので静的な文字列であること。スレッドが終わると登録も消える
+	void enter(ThreadRole role, size_t index, const char* name);
+
+	// 登録中のスレッドの統計
+	std::vector<ThreadStats> stats();
+	// stats() をログに出す
+	void report();
+
+private:
+	struct Entry;
+
+	ThreadTopology();
+	void leave(Entry* entry);
+
+	std::mutex m_mutex; // 以下を守る
+	std::vector<int> m_cpus[ThreadRoleCount];
+	std::vector<Entry*> m_entries;
+};
@@ -0,0 +1,140 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+class ThreadBuffer {
+public:
+	static constexpr size_t Capacity = 1 << 16;
+
+	explicit ThreadBuffer(uint32_t tid)
+		: m_tid(tid)
+		, m_events(Capacity)
+	{
+	}
+
+	void push(const Tracer::Event& event)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_events[m_count % Capacity] = event;
+		m_count++;
+	}
+
+	uint32_t m_tid;
+	const char* m_name = nullptr;
+	std::mutex m_mutex;
+	std::vector<Tracer::Event> m_events;
+	uint64_t m_count = 0;
+};
+
+std::mutex g_buffersMutex;
+std::vector<std::shared_ptr<ThreadBuffer>> g_buffers;
+
+const auto g_origin = std::chrono::steady_clock::now();
+
+ThreadBuffer& threadBuffer()
+{
+	// スレッドが終了してもバッファは書き出し用に残しておく
+	thread_local std::shared_ptr<ThreadBuffer> buffer = []() {
+		std::lock_guard<std::mutex> lock(g_buffersMutex);
+		auto buffer = std::make_shared<ThreadBuffer>(static_cast<uint32_t>(g_buffers.size() + 1));
+		g_buffers.push_back(buffer);
+		return buffer;
+	}();
+	return *buffer;
+}
+
+void writeEscaped(FILE* fp, const char* s)
+{
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') {
+			fputc('\\', fp);
+		}
+		fputc(*s, fp);
+	}
+}
+
+}
+
+uint64_t Tracer::now()
+{
+	auto elapsed = std::chrono::steady_clock::now() - g_origin;
+	return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void Tracer::complete(const char* name, uint64_t begin)
+{
+	uint64_t end = now();
+	threadBuffer().push({ name, 'X', begin, end - begin, 0 });
+}
+
+void Tracer::flowBegin(const void* id)
+{
+	threadBuffer().push({ "hop", 's', now(), 0, reinterpret_cast<uintptr_t>(id) });
+}
+
+void Tracer::flowEnd(const void* id)
+{
+	threadBuffer().push({ "hop", 'f', now(), 0, reinterpret_cast<uintptr_t>(id) });
+}
+
+void Tracer::setThreadName(const char* name)
+{
+	threadBuffer().m_name = name;
+}
+
+bool Tracer::write(const char* path)
+{
+	FILE* fp = fopen(path, "w");
+	if (!fp) {
+		return false;
+	}
+
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	{
+		std::lock_guard<std::mutex> lock(g_buffersMutex);
+		buffers = g_buffers;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (auto& buffer : buffers) {
+		std::lock_guard<std::mutex> lock(buffer->m_mutex);
+		if (buffer->m_name) {
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"",
+				first ? "" : ",\n", buffer->m_tid);
+			writeEscaped(fp, buffer->m_name);
+			fprintf(fp, "\"}}");
+			first = false;
+		}
+
+		// リングが一周している場合は最も古いものから書き出す
+		uint64_t begin = buffer->m_count > ThreadBuffer::Capacity ? buffer->m_count - ThreadBuffer::Capacity : 0;
+		for (uint64_t i = begin; i < buffer->m_count; ++i) {
+			const Event& event = buffer->m_events[i % ThreadBuffer::Capacity];
+			fprintf(fp, "%s{\"name\":\"", first ? "" : ",\n");
+			writeEscaped(fp, event.m_name);
+			fprintf(fp, "\",\"cat\":\"tkf\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%llu",
+				event.m_phase, buffer->m_tid, static_cast<unsigned long long>(event.m_timestamp));
+			if (event.m_phase == 'X') {
+				fprintf(fp, ",\"dur\":%llu", static_cast<unsigned long long>(event.m_duration));
+			}
+			else {
+				fprintf(fp, ",\"id\":\"0x%llx\"", static_cast<unsigned long long>(event.m_id));
+				if (event.m_phase == 'f') {
+					fprintf(fp, ",\"bp\":\"e\"");
+				}
+			}
+			fprintf(fp, "}");
+			first = false;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	return true;
+}
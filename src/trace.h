@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+
+// ENABLE_TRACE を定義すると、スパンとコルーチンのスレッド間移動を Chrome trace 形式で記録する。
+// 記録はスレッドごとのリングに最新のものだけが残り、Tracer::write() で JSON に書き出す。
+// chrome://tracing または https://ui.perfetto.dev で開ける。
+
+#ifdef ENABLE_TRACE
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__){ name }
+#define TRACE_NOW() Tracer::now()
+#define TRACE_COMPLETE(name, begin) Tracer::complete(name, begin)
+#define TRACE_FLOW_BEGIN(id) Tracer::flowBegin(id)
+#define TRACE_FLOW_END(id) Tracer::flowEnd(id)
+#define TRACE_THREAD_NAME(name) Tracer::setThreadName(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_NOW() uint64_t(0)
+#define TRACE_COMPLETE(name, begin) ((void)0)
+#define TRACE_FLOW_BEGIN(id) ((void)0)
+#define TRACE_FLOW_END(id) ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+
+#endif
+
+class Tracer {
+public:
+	struct Event {
+		const char* m_name;
+		char m_phase;
+		uint64_t m_timestamp; // us
+		uint64_t m_duration;  // us
+		uint64_t m_id;
+	};
+
+	static uint64_t now();
+
+	// begin から現在までのスパンを記録する
+	static void complete(const char* name, uint64_t begin);
+
+	// コルーチンの中断 (flowBegin) と別スレッドでの再開 (flowEnd) を id で結ぶ
+	static void flowBegin(const void* id);
+	static void flowEnd(const void* id);
+
+	// name は静的な文字列であること
+	static void setThreadName(const char* name);
+
+	static bool write(const char* path);
+};
+
+class TraceScope {
+public:
+	explicit TraceScope(const char* name)
+		: m_name(name)
+		, m_begin(Tracer::now())
+	{
+	}
+	~TraceScope()
+	{
+		Tracer::complete(m_name, m_begin);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* m_name;
+	uint64_t m_begin;
+};
@@ -0,0 +1,406 @@
+#include "uring_file_source.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// liburing は使わずにシステムコールを直接呼ぶ
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned count)
+{
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// ネットワークスレッドごとの io_uring。スロットごとに登録済みのバッファを1つ持ち、
+// 1つのスロットで1つの読み込みを受け持つ。スロットが空いていない間はソースを待たせる
+class FileRing : public CurlWorkqueue::EventSource {
+public:
+	static constexpr unsigned SlotCount = 32;
+
+	// 呼んだネットワークスレッドの ring。io_uring が使えなければ nullptr
+	static FileRing* forCurrentThread(CurlWorkqueue& wq);
+
+	~FileRing() override;
+
+	// source の m_fd の m_offset から読む。完了すると process() の中で source->complete() が呼ばれる
+	void read(UringFileSource* source);
+	// source の読み込みをやめる。読み込み中なら完了を捨てる
+	void cancel(UringFileSource* source);
+
+	// io_uring の fd は完了キューが空でなければ読めるようになる
+	int fd() const override { return m_ringFd; }
+	bool process() override;
+
+private:
+	struct Slot {
+		UringFileSource* source = nullptr; // nullptr なら完了を捨てる
+		iovec iov;
+		bool busy = false;
+	};
+
+	FileRing() = default;
+	bool init();
+	void prepare(int slot, UringFileSource* source);
+	void submit();
+
+	int m_ringFd = -1;
+	void* m_sqRing = MAP_FAILED;
+	size_t m_sqRingSize = 0;
+	void* m_cqRing = MAP_FAILED;
+	size_t m_cqRingSize = 0;
+	io_uring_sqe* m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t m_sqesSize = 0;
+
+	unsigned* m_sqTail = nullptr;
+	unsigned m_sqMask = 0;
+	unsigned* m_sqArray = nullptr;
+	unsigned* m_cqHead = nullptr;
+	unsigned* m_cqTail = nullptr;
+	unsigned m_cqMask = 0;
+	io_uring_cqe* m_cqes = nullptr;
+	unsigned m_tail = 0;     // 次に書く SQ の位置
+	unsigned m_toSubmit = 0; // 書いたがまだ io_uring_enter() していない数
+
+	uint8_t* m_buffers = nullptr;
+	bool m_fixed = false; // バッファを登録できた (READ_FIXED を使う)
+	Slot m_slots[SlotCount];
+	std::vector<int> m_freeSlots;
+	std::deque<UringFileSource*> m_backlog; // スロットが空くのを待っている
+};
+
+namespace {
+
+thread_local std::unique_ptr<FileRing> t_ring;
+thread_local bool t_ringFailed = false;
+
+// file:// の URL ならパスに戻す (%XX を元に戻す)。それ以外はそのままパスとして扱う
+std::string pathFromUrl(const char* url)
+{
+	if (strncmp(url, "file://", 7) != 0) {
+		return url;
+	}
+	const char* p = url + 7;
+	if (strncmp(p, "localhost/", 10) == 0) {
+		p += 9;
+	}
+	std::string path;
+	for (; *p; ++p) {
+		if (p[0] == '%' && isxdigit(static_cast<unsigned char>(p[1])) && isxdigit(static_cast<unsigned char>(p[2]))) {
+			char hex[3] = { p[1], p[2], '\0' };
+			path += static_cast<char>(strtol(hex, nullptr, 16));
+			p += 2;
+		}
+		else {
+			path += *p;
+		}
+	}
+	return path;
+}
+
+}
+
+FileRing* FileRing::forCurrentThread(CurlWorkqueue& wq)
+{
+	if (t_ring) {
+		return t_ring.get();
+	}
+	if (t_ringFailed) {
+		return nullptr;
+	}
+	std::unique_ptr<FileRing> ring(new FileRing());
+	if (!ring->init()) {
+		LOGW("io_uring unavailable (%s), reading files with pread\n", strerror(errno));
+		t_ringFailed = true;
+		return nullptr;
+	}
+	wq.addEventSource(ring.get());
+	t_ring = std::move(ring);
+	return t_ring.get();
+}
+
+bool FileRing::init()
+{
+	io_uring_params params = {};
+	m_ringFd = io_uring_setup(SlotCount, &params);
+	if (m_ringFd < 0) {
+		return false;
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+	}
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		return false;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cqRing = m_sqRing;
+	}
+	else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			return false;
+		}
+	}
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		m_ringFd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED) {
+		return false;
+	}
+
+	auto sq = static_cast<uint8_t*>(m_sqRing);
+	auto cq = static_cast<uint8_t*>(m_cqRing);
+	m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	m_tail = *m_sqTail;
+
+	// 読み込み先は固定にして登録しておく。登録できなければ (memlock の上限など) READV で読む
+	m_buffers = static_cast<uint8_t*>(aligned_alloc(4096, SlotCount * UringFileSource::ChunkSize));
+	if (!m_buffers) {
+		return false;
+	}
+	for (unsigned i = 0; i < SlotCount; ++i) {
+		m_slots[i].iov = { m_buffers + i * UringFileSource::ChunkSize, UringFileSource::ChunkSize };
+	}
+	iovec iovs[SlotCount];
+	for (unsigned i = 0; i < SlotCount; ++i) {
+		iovs[i] = m_slots[i].iov;
+	}
+	m_fixed = io_uring_register(m_ringFd, IORING_REGISTER_BUFFERS, iovs, SlotCount) == 0;
+	for (int i = SlotCount - 1; i >= 0; --i) {
+		m_freeSlots.push_back(i);
+	}
+	LOGI("io_uring file reader: %u slots of %zu KB%s\n", SlotCount, UringFileSource::ChunkSize / 1024,
+		m_fixed ? ", registered buffers" : "");
+	return true;
+}
+
+FileRing::~FileRing()
+{
+	if (m_ringFd >= 0) {
+		close(m_ringFd);
+	}
+	if (m_sqes != MAP_FAILED) {
+		munmap(m_sqes, m_sqesSize);
+	}
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing != MAP_FAILED) {
+		munmap(m_sqRing, m_sqRingSize);
+	}
+	free(m_buffers);
+}
+
+void FileRing::read(UringFileSource* source)
+{
+	if (m_freeSlots.empty()) {
+		m_backlog.push_back(source);
+		return;
+	}
+	int slot = m_freeSlots.back();
+	m_freeSlots.pop_back();
+	prepare(slot, source);
+}
+
+void FileRing::cancel(UringFileSource* source)
+{
+	m_backlog.erase(std::remove(m_backlog.begin(), m_backlog.end(), source), m_backlog.end());
+	if (source->m_slot >= 0) {
+		m_slots[source->m_slot].source = nullptr;
+		source->m_slot = -1;
+	}
+}
+
+void FileRing::prepare(int slot, UringFileSource* source)
+{
+	Slot& s = m_slots[slot];
+	s.source = source;
+	s.busy = true;
+	source->m_slot = slot;
+
+	// 書くだけで、投げるのは process() でまとめて
+	unsigned index = m_tail & m_sqMask;
+	io_uring_sqe* sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = source->m_fd;
+	sqe->off = source->m_offset;
+	sqe->user_data = static_cast<uint64_t>(slot);
+	size_t size = std::min<uint64_t>(UringFileSource::ChunkSize, source->m_size - source->m_offset);
+	if (m_fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = reinterpret_cast<uint64_t>(s.iov.iov_base);
+		sqe->len = static_cast<uint32_t>(size);
+		sqe->buf_index = static_cast<uint16_t>(slot);
+	}
+	else {
+		s.iov.iov_len = size;
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr = reinterpret_cast<uint64_t>(&s.iov);
+		sqe->len = 1;
+	}
+	m_sqArray[index] = index;
+	++m_tail;
+	++m_toSubmit;
+}
+
+void FileRing::submit()
+{
+	if (m_toSubmit == 0) {
+		return;
+	}
+	std::atomic_ref<unsigned>(*m_sqTail).store(m_tail, std::memory_order_release);
+	int submitted = io_uring_enter(m_ringFd, m_toSubmit, 0, 0);
+	if (submitted < 0) {
+		// EAGAIN や EBUSY なら次の周回でもう一度投げる
+		if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+			LOGE("io_uring_enter failed: %s\n", strerror(errno));
+		}
+		return;
+	}
+	m_toSubmit -= std::min<unsigned>(submitted, m_toSubmit);
+}
+
+bool FileRing::process()
+{
+	bool progressed = false;
+	unsigned head = *m_cqHead;
+	unsigned tail = std::atomic_ref<unsigned>(*m_cqTail).load(std::memory_order_acquire);
+	for (; head != tail; ++head) {
+		const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+		int slot = static_cast<int>(cqe.user_data);
+		int result = cqe.res;
+		std::atomic_ref<unsigned>(*m_cqHead).store(head + 1, std::memory_order_release);
+
+		Slot& s = m_slots[slot];
+		UringFileSource* source = s.source;
+		s.source = nullptr;
+		s.busy = false;
+		if (source) {
+			// バッファを返す前に reader に写す。続きの読み込みは別のスロットになりうる
+			source->m_slot = -1;
+			source->complete(static_cast<const uint8_t*>(s.iov.iov_base), result);
+		}
+		m_freeSlots.push_back(slot);
+		progressed = true;
+	}
+
+	while (!m_backlog.empty() && !m_freeSlots.empty()) {
+		UringFileSource* source = m_backlog.front();
+		m_backlog.pop_front();
+		int slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+		prepare(slot, source);
+	}
+	submit();
+	return progressed;
+}
+
+UringFileSource::UringFileSource(bool usePread)
+	: m_usePread(usePread)
+{
+}
+
+UringFileSource::~UringFileSource()
+{
+	close();
+}
+
+void UringFileSource::close()
+{
+	if (m_ring) {
+		m_ring->cancel(this);
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+void UringFileSource::open(const char* url, CurlWorkqueue::CurlReader& reader)
+{
+	close();
+	m_reader = &reader;
+	m_offset = 0;
+	m_size = 0;
+
+	std::string path = pathFromUrl(url);
+	m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+		LOGE("Failed to open %s: %s\n", path.c_str(), strerror(errno));
+		reader.finish();
+		return;
+	}
+	m_size = st.st_size;
+	if (!m_usePread) {
+		m_ring = FileRing::forCurrentThread(reader.workqueue());
+	}
+	readNext();
+}
+
+void UringFileSource::readNext()
+{
+	if (m_offset >= m_size) {
+		m_reader->finish();
+		return;
+	}
+	if (m_ring) {
+		m_ring->read(this);
+		return;
+	}
+	// 1回に1チャンクずつ読み、ほかのストリームの処理をはさむ。reader のハンドルに紐づけて一緒に取り消されるようにする
+	CurlWorkqueue& wq = m_reader->workqueue();
+	wq.enqueue([](bool) { return false; }, &UringFileSource::preadNext, this, m_reader->handle(), wq.clock().now(),
+		m_reader->priority());
+}
+
+void UringFileSource::complete(const uint8_t* data, int result)
+{
+	if (result <= 0) {
+		// 0 なら読んでいる間にファイルが縮んだ
+		LOGE("Failed to read file: %s\n", result < 0 ? strerror(-result) : "unexpected end of file");
+		m_reader->finish();
+		return;
+	}
+	m_reader->deliver(data, result);
+	m_offset += result;
+	readNext();
+}
+
+void UringFileSource::preadNext(void* context)
+{
+	auto self = static_cast<UringFileSource*>(context);
+	thread_local std::vector<uint8_t> buffer(ChunkSize);
+	size_t size = std::min<uint64_t>(ChunkSize, self->m_size - self->m_offset);
+	ssize_t result = pread(self->m_fd, buffer.data(), size, self->m_offset);
+	self->complete(buffer.data(), result < 0 ? -errno : static_cast<int>(result));
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include "byte_source.h"
+
+class FileRing;
+
+// ローカルファイル (file:// の URL かパス) を curl を通さずに読む ByteSource (Linux 専用)。
+// ネットワークスレッドごとに1つの io_uring を共有し、登録済みのバッファに読んで reader に渡す。
+// 読み込み要求は周回ごとにまとめて投げるので、多くのファイルを同時に読むほど1回のシステムコールで済む。
+// 完了はネットワークスレッドのループで刈り取り、同じ周回で待機中の read() を再開させる。
+// io_uring が使えない (古いカーネルや seccomp で塞がれている) か usePread なら、pread で少しずつ読む
+class UringFileSource : public ByteSource {
+public:
+	explicit UringFileSource(bool usePread = false);
+	~UringFileSource() override;
+
+	void open(const char* url, CurlWorkqueue::CurlReader& reader) override;
+
+	// 1回に読む大きさ。io_uring の登録済みバッファの大きさでもある
+	static constexpr size_t ChunkSize = 128 * 1024;
+
+private:
+	friend class FileRing;
+
+	void close();
+	void readNext();
+	// io_uring の読み込みが終わった。result は読んだバイト数か -errno
+	void complete(const uint8_t* data, int result);
+	static void preadNext(void* context);
+
+	bool m_usePread;
+	CurlWorkqueue::CurlReader* m_reader = nullptr;
+	FileRing* m_ring = nullptr;
+	int m_fd = -1;
+	uint64_t m_offset = 0;
+	uint64_t m_size = 0;
+	int m_slot = -1; // 読み込み中の FileRing のスロット
+};
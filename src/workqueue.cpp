@@ -1,83 +1,172 @@
-#include "workqueue.h"
-
-void Workqueue::enqueue(Work::CoroutineHandle handle)
-{
-	std::unique_lock<std::mutex> lock(m_mutex);
-	m_queue.emplace(std::move(handle), Work::Clock::time_point::min());
-	wakeup();
-}
-
-void Workqueue::enqueue(Work::CoroutineHandle handle, Work::Clock::time_point schedule)
-{
-	std::unique_lock<std::mutex> lock(m_mutex);
-	bool needsReschedule = true;
-	if (!m_queue.empty()) {
-		needsReschedule = schedule < m_queue.top().m_schedule;
-	}
-	m_queue.emplace(std::move(handle), schedule);
-	if (needsReschedule) {
-		wakeup();
-	}
-}
-
-void Workqueue::wakeup()
-{
-	m_cond.notify_all();
-}
-
-void Workqueue::run()
-{
-	while (true) {
-		const bool wait = true;
-		executeExpired(wait);
-	}
-}
-
-std::optional<Workqueue::Work::Clock::time_point> Workqueue::executeExpired(bool wait)
-{
-	std::optional<Workqueue::Work::Clock::time_point> nextSchedule;
-	std::vector<Work> execQueue; // priority queue łȂ
-	{
-		std::unique_lock<std::mutex> lock(m_mutex);
-		if (wait) {
-			if (m_queue.empty()) {
-				// WorkȂ̂Ŗő҂
-				m_cond.wait(lock);
-			}
-			else {
-				// ߂ɃXPW[ꂽԂ܂ő҂
-				auto schedule = m_queue.top().m_schedule;
-				if (schedule > Work::Clock::now()) {
-					m_cond.wait_until(lock, schedule);
-				}
-			}
-		}
-
-		// XPW[ݎ߂Ă̂ execQueue ɈڂB
-		auto now = Work::Clock::now();
-		while (!m_queue.empty() && m_queue.top().m_schedule <= now) {
-			printf("shed %lld\n", m_queue.top().m_schedule.time_since_epoch().count());
-			execQueue.emplace_back(std::move(m_queue.top()));
-			m_queue.pop();
-		}
-
-		if (!m_queue.empty()) {
-			nextSchedule = m_queue.top().m_schedule;
-
-			auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(*nextSchedule - now);
-			printf("m_queue.size() = %zu, delay = %lld\n", m_queue.size(), delay.count());
-		}
-	}
-
-	// execQueue ̂̂s
-	for (auto& work : execQueue) {
-		work.m_handle.resume();
-	}
-
-	return nextSchedule;
-}
-
-Schedule shedule(Workqueue& wq)
-{
-	return Schedule{ wq };
+#include "workqueue.h"
+#include "logger.h"
+#include "trace.h"
+
+void Workqueue::enqueue(Work::CoroutineHandle handle)
+{
+	enqueue(&Work::resumeCoroutine, handle.address());
+}
+
+void Workqueue::enqueue(Work::CoroutineHandle handle, Work::Clock::time_point schedule, Priority priority)
+{
+	enqueue(&Work::resumeCoroutine, handle.address(), schedule, priority);
+}
+
+void Workqueue::enqueue(Node& node)
+{
+	TRACE_FLOW_BEGIN(node.m_context);
+	m_ready[static_cast<size_t>(node.m_priority)].push(node);
+	wakeup();
+}
+
+void Workqueue::enqueue(Work::Function function, void* context)
+{
+	// 埋め込む場所がないのでノードを確保する。頻繁に呼ぶところは enqueue(Node&) を使うこと
+	Node* node = new Node{ function, context };
+	node->m_owned = true;
+	enqueue(*node);
+}
+
+void Workqueue::enqueue(Work::Function function, void* context, Work::Clock::time_point schedule, Priority priority)
+{
+	TRACE_FLOW_BEGIN(context);
+	bool needsReschedule = true;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_queue.empty()) {
+			needsReschedule = schedule < m_queue.top().m_schedule;
+		}
+		m_queue.emplace(function, context, schedule, priority);
+	}
+	if (needsReschedule) {
+		wakeup();
+	}
+}
+
+bool Workqueue::cancel(void* context)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_queue.remove(context);
+}
+
+void Workqueue::wakeup()
+{
+	// 実行スレッドは寝る直前に m_sleeping を立ててからキューを見直すので、ここで見落としても取りこぼさない
+	if (m_sleeping.load()) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.notify_all();
+	}
+}
+
+bool Workqueue::readyEmpty() const
+{
+	for (auto& ready : m_ready) {
+		if (!ready.empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Workqueue::run()
+{
+	while (true) {
+		const bool wait = true;
+		executeExpired(wait);
+	}
+}
+
+std::optional<Workqueue::Work::Clock::time_point> Workqueue::executeExpired(bool wait)
+{
+	std::optional<Workqueue::Work::Clock::time_point> nextSchedule;
+	std::vector<Work> execQueue; // priority queue でない
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (wait) {
+			m_sleeping.store(true);
+			if (!readyEmpty()) {
+				// すぐに実行するものがあるので待たない
+			}
+			else if (m_queue.empty()) {
+				// Workがないので無条件で待つ
+				m_cond.wait(lock);
+			}
+			else {
+				// 直近にスケジュールされた時間まで待つ
+				auto schedule = m_queue.top().m_schedule;
+				if (schedule > m_clock->now()) {
+					m_clock->waitUntil(m_cond, lock, schedule);
+				}
+			}
+			m_sleeping.store(false, std::memory_order_relaxed);
+		}
+
+		// スケジュールが現在時刻を過ぎているものを execQueue に移す。
+		auto now = m_clock->now();
+		while (!m_queue.empty() && m_queue.top().m_schedule <= now) {
+			LOGD("shed %lld\n", m_queue.top().m_schedule.time_since_epoch().count());
+			execQueue.emplace_back(std::move(m_queue.top()));
+			m_queue.pop();
+		}
+
+		if (!m_queue.empty()) {
+			nextSchedule = m_queue.top().m_schedule;
+
+			auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(*nextSchedule - now);
+			LOGD("m_queue.size() = %zu, delay = %lld\n", m_queue.size(), delay.count());
+		}
+	}
+
+	// すぐに実行するものを先に、ReadyBatch 個までまとめて実行する。
+	// 優先度ごとのキューから ReadyWeights の個数ずつ順に取り出す
+	size_t count = 0;
+	bool progressed = true;
+	while (progressed && count < ReadyBatch) {
+		progressed = false;
+		for (size_t lane = 0; lane < PriorityCount; ++lane) {
+			for (size_t n = 0; n < ReadyWeights[lane] && count < ReadyBatch; ++n) {
+				Node* node = m_ready[lane].pop();
+				if (!node) {
+					break;
+				}
+				// 実行するとノードを持つ awaiter が破棄されうるので先に取り出しておく
+				Work::Function function = node->m_function;
+				void* context = node->m_context;
+				if (node->m_owned) {
+					delete node;
+				}
+				{
+					TRACE_SCOPE("main dispatch");
+					TRACE_FLOW_END(context);
+					function(context);
+				}
+				++count;
+				progressed = true;
+			}
+		}
+	}
+
+	// execQueue のものを実行。同時に期限が来たものは優先度の高いほうから
+	for (Priority priority : { Priority::Foreground, Priority::Background }) {
+		for (auto& work : execQueue) {
+			if (work.m_priority != priority) {
+				continue;
+			}
+			TRACE_SCOPE("main dispatch");
+			TRACE_FLOW_END(work.m_context);
+			work.execute();
+		}
+	}
+
+	if (!readyEmpty()) {
+		// 残っているものはすぐに実行してもらう
+		nextSchedule = m_clock->now();
+	}
+
+	return nextSchedule;
+}
+
+Schedule shedule(Workqueue& wq)
+{
+	return Schedule{ wq };
 }
\ No newline at end of file
@@ -1,86 +1,230 @@
-#pragma once
-
-#include <chrono>
-#include <condition_variable>
-#include <coroutine>
-#include <functional>
-#include <mutex>
-#include <queue>
-#include <optional>
-
-class Workqueue {
-public:
-	struct Work {
-		using Clock = std::chrono::steady_clock;
-		using CoroutineHandle = std::coroutine_handle<>;
-		Work(CoroutineHandle handle, Clock::time_point schedule)
-			: m_handle(handle)
-			, m_schedule(schedule)
-		{
-		}
-		Work(const Work& rhs) noexcept
-			: m_handle(rhs.m_handle)
-			, m_schedule(rhs.m_schedule)
-		{
-		}
-		Work& operator=(const Work& rhs) noexcept
-		{
-			m_handle = rhs.m_handle;
-			m_schedule = rhs.m_schedule;
-			return *this;
-		}
-
-		Work() = delete;
-
-		bool operator > (const Work& rhs) const { return m_schedule > rhs.m_schedule; }
-		CoroutineHandle m_handle;
-		Clock::time_point m_schedule;
-	};
-	using Queue = std::priority_queue<Work, std::vector<Work>, std::greater<Work> >;
-
-	Workqueue() = default;
-	~Workqueue() = default;
-
-	void enqueue(Work::CoroutineHandle handle);
-	void enqueue(Work::CoroutineHandle handle, Work::Clock::time_point schedule);
-	virtual void run();
-
-protected:
-	virtual void wakeup();
-	std::optional<Work::Clock::time_point> executeExpired(bool wait);
-
-	Queue m_queue;
-
-	std::mutex m_mutex;
-	std::condition_variable m_cond;
-};
-
-class Schedule {
-public:
-	bool await_ready() { return false; }
-	bool await_suspend(std::coroutine_handle<> h)
-	{
-		wq.enqueue(h, schedule);
-		return true;
-	}
-	void await_resume() {}
-
-	explicit Schedule(Workqueue& wq, Workqueue::Work::Clock::time_point schedule) : wq(wq), schedule(schedule) {}
-#ifdef min
-#undef min
-#endif
-	explicit Schedule(Workqueue& wq) : Schedule(wq, Workqueue::Work::Clock::time_point::min()) {}
-private:
-	Workqueue& wq;
-	Workqueue::Work::Clock::time_point schedule;
-};
-
-[[nodiscard]]
-Schedule shedule(Workqueue& wq);
-
-template <class _Rep, class _Period>
-[[nodiscard]]
-Schedule sleep(const std::chrono::duration<_Rep, _Period>& timeout, Workqueue& wq)
-{
-	return Schedule{ wq, Workqueue::Work::Clock::now() + timeout };
-}
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <optional>
+#include "clock.h"
+
+// 実行の優先度。Foreground は見えているストリームなど遅れると目立つもの。
+// 値はそのまま優先度ごとのキューの添字になる
+enum class Priority {
+	Foreground,
+	Background,
+};
+constexpr size_t PriorityCount = 2;
+
+class Workqueue {
+public:
+	struct Work {
+		using Clock = std::chrono::steady_clock;
+		using CoroutineHandle = std::coroutine_handle<>;
+		using Function = void (*)(void* context);
+		Work(Function function, void* context, Clock::time_point schedule, Priority priority = Priority::Foreground)
+			: m_function(function)
+			, m_context(context)
+			, m_schedule(schedule)
+			, m_priority(priority)
+		{
+		}
+		Work(const Work& rhs) noexcept
+			: m_function(rhs.m_function)
+			, m_context(rhs.m_context)
+			, m_schedule(rhs.m_schedule)
+			, m_priority(rhs.m_priority)
+		{
+		}
+		Work& operator=(const Work& rhs) noexcept
+		{
+			m_function = rhs.m_function;
+			m_context = rhs.m_context;
+			m_schedule = rhs.m_schedule;
+			m_priority = rhs.m_priority;
+			return *this;
+		}
+
+		Work() = delete;
+
+		void execute() const { m_function(m_context); }
+
+		// コルーチンは handle.address() を context として再開する
+		static void resumeCoroutine(void* address) { CoroutineHandle::from_address(address).resume(); }
+
+		bool operator > (const Work& rhs) const { return m_schedule > rhs.m_schedule; }
+		Function m_function;
+		void* m_context;
+		Clock::time_point m_schedule;
+		Priority m_priority; // 同時に期限が来たものの中での順番
+	};
+	class Queue : public std::priority_queue<Work, std::vector<Work>, std::greater<Work> > {
+	public:
+		// context が一致する Work を取り除く。取り除けたら true
+		bool remove(void* context)
+		{
+			auto it = std::find_if(c.begin(), c.end(), [context](const Work& work) { return work.m_context == context; });
+			if (it == c.end()) {
+				return false;
+			}
+			c.erase(it);
+			std::make_heap(c.begin(), c.end(), comp);
+			return true;
+		}
+	};
+
+	// すぐに実行する Work。待つ側 (awaiter など) に埋め込み、ロックもヒープも使わずにキューにつなぐ。
+	// キューにつないでから実行されるまでは動かしたり破棄したりしないこと。
+	struct Node {
+		Node() = default;
+		Node(Work::Function function, void* context, Priority priority = Priority::Foreground)
+			: m_function(function), m_context(context), m_priority(priority) {}
+		// キューにつなぐ前の awaiter を動かせるように、中身だけ写す
+		Node(const Node& rhs) noexcept : m_function(rhs.m_function), m_context(rhs.m_context), m_priority(rhs.m_priority) {}
+		Node& operator=(const Node& rhs) noexcept
+		{
+			m_function = rhs.m_function;
+			m_context = rhs.m_context;
+			m_priority = rhs.m_priority;
+			return *this;
+		}
+
+		std::atomic<Node*> m_next{ nullptr };
+		Work::Function m_function = nullptr;
+		void* m_context = nullptr;
+		Priority m_priority = Priority::Foreground;
+		bool m_owned = false; // enqueue(function, context) が確保したもの。実行時に解放する
+	};
+
+	// 複数スレッドから push、実行スレッドだけが pop する侵入型のロックフリーキュー (Vyukov 方式)
+	class ReadyQueue {
+	public:
+		ReadyQueue() : m_head(&m_stub), m_tail(&m_stub) {}
+
+		void push(Node& node)
+		{
+			node.m_next.store(nullptr, std::memory_order_relaxed);
+			// 実行スレッドの m_sleeping と突き合わせるので seq_cst にしておく
+			Node* prev = m_head.exchange(&node);
+			prev->m_next.store(&node, std::memory_order_release);
+		}
+
+		// 実行スレッド専用。push の途中のものがあると空でなくても nullptr を返すことがある
+		Node* pop()
+		{
+			Node* tail = m_tail;
+			Node* next = tail->m_next.load(std::memory_order_acquire);
+			if (tail == &m_stub) {
+				if (!next) {
+					return nullptr;
+				}
+				m_tail = next;
+				tail = next;
+				next = next->m_next.load(std::memory_order_acquire);
+			}
+			if (next) {
+				m_tail = next;
+				return tail;
+			}
+			if (tail != m_head.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			push(m_stub);
+			next = tail->m_next.load(std::memory_order_acquire);
+			if (next) {
+				m_tail = next;
+				return tail;
+			}
+			return nullptr;
+		}
+
+		// 実行スレッド専用
+		bool empty() const
+		{
+			return m_tail == &m_stub && m_head.load() == &m_stub;
+		}
+
+	private:
+		std::atomic<Node*> m_head;
+		Node* m_tail;
+		Node m_stub;
+	};
+
+	// executeExpired() 1回ですぐに実行する Work の上限。タイマーや Windows のメッセージを待たせすぎないため
+	static constexpr size_t ReadyBatch = 64;
+	// すぐに実行する Work を優先度ごとに交互に取り出すときの1巡あたりの個数。
+	// 後ろの優先度も必ず少しは進むので、Background が溜まっても止まりはしない
+	static constexpr size_t ReadyWeights[PriorityCount] = { 4, 1 };
+
+	// 時刻指定の Work は clock で見た時刻に実行する
+	explicit Workqueue(WorkqueueClock& clock = WorkqueueClock::system()) : m_clock(&clock) {}
+	~Workqueue() = default;
+
+	WorkqueueClock& clock() const { return *m_clock; }
+
+	void enqueue(Node& node);
+	void enqueue(Work::CoroutineHandle handle);
+	void enqueue(Work::CoroutineHandle handle, Work::Clock::time_point schedule, Priority priority = Priority::Foreground);
+	void enqueue(Work::Function function, void* context);
+	void enqueue(Work::Function function, void* context, Work::Clock::time_point schedule, Priority priority = Priority::Foreground);
+	// まだ実行されていない時刻指定の Work を取り除く。取り除けたら true (その場合 function は呼ばれない)
+	// すぐに実行する Work は取り除けない
+	bool cancel(void* context);
+	bool cancel(Work::CoroutineHandle handle) { return cancel(handle.address()); }
+	virtual void run();
+
+protected:
+	// 実行スレッドを起こす。寝ていなければ何もしない
+	virtual void wakeup();
+	std::optional<Work::Clock::time_point> executeExpired(bool wait);
+	// 実行スレッド専用
+	bool readyEmpty() const;
+
+	WorkqueueClock* m_clock;
+	ReadyQueue m_ready[PriorityCount];
+	Queue m_queue; // 時刻指定の Work だけを持つ
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::atomic<bool> m_sleeping{ false };
+};
+
+class Schedule {
+public:
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		if (schedule == (Workqueue::Work::Clock::time_point::min)()) {
+			node = Workqueue::Node{ &Workqueue::Work::resumeCoroutine, h.address() };
+			wq.enqueue(node);
+		}
+		else {
+			wq.enqueue(h, schedule);
+		}
+		return true;
+	}
+	void await_resume() {}
+
+	explicit Schedule(Workqueue& wq, Workqueue::Work::Clock::time_point schedule) : wq(wq), schedule(schedule) {}
+#ifdef min
+#undef min
+#endif
+	explicit Schedule(Workqueue& wq) : Schedule(wq, Workqueue::Work::Clock::time_point::min()) {}
+private:
+	Workqueue& wq;
+	Workqueue::Work::Clock::time_point schedule;
+	Workqueue::Node node;
+};
+
+[[nodiscard]]
+Schedule shedule(Workqueue& wq);
+
+template <class _Rep, class _Period>
+[[nodiscard]]
+Schedule sleep(const std::chrono::duration<_Rep, _Period>& timeout, Workqueue& wq)
+{
+	return Schedule{ wq, wq.clock().now() + timeout };
+}
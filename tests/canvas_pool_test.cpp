@@ -0,0 +1,68 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "canvas_pool.h"
+
+// CanvasPool が普通のヒープから取るか、サイズクラスから取るかの境目を確かめる。
+// allocate() と release() が同じ側を選ばないと、ヒープのブロックを OS に返したり、数えた量がずれたりする
+
+namespace {
+
+// bytes を確保して書き込み、返す。サイズクラスから取るはずなら pooled
+bool allocateAndRelease(size_t bytes, bool pooled)
+{
+	CanvasPool& pool = CanvasPool::instance();
+	const CanvasPool::Stats before = pool.stats();
+	size_t capacity = 0;
+	void* block = pool.allocate(bytes, capacity);
+	if (!block || capacity < bytes || reinterpret_cast<uintptr_t>(block) % CanvasPool::Alignment != 0) {
+		fprintf(stderr, "%zu bytes: got %zu bytes at %p\n", bytes, capacity, block);
+		return false;
+	}
+	memset(block, 0xA5, capacity);
+	const CanvasPool::Stats allocated = pool.stats();
+	pool.release(block, capacity);
+
+	if ((allocated.allocations != before.allocations) != pooled) {
+		fprintf(stderr, "%zu bytes: expected to come from %s\n", bytes, pooled ? "the pool" : "the heap");
+		return false;
+	}
+	// 取っておいたものも含めて、OS から確保した量と取っておいている量が合っている
+	const CanvasPool::Stats released = pool.stats();
+	if (released.systemBytes != released.pooledBytes) {
+		fprintf(stderr, "%zu bytes: %zu bytes mapped, %zu bytes pooled\n", bytes, released.systemBytes, released.pooledBytes);
+		return false;
+	}
+	return true;
+}
+
+}
+
+int main()
+{
+	CanvasPool& pool = CanvasPool::instance();
+	if (!pool.configure("limit=64M hugepages=none")) {
+		return 1;
+	}
+
+	int failed = 0;
+	const size_t min = CanvasPool::MinPooledBytes;
+	failed += !allocateAndRelease(1, false);
+	failed += !allocateAndRelease(min - CanvasPool::Alignment, false);
+	// 切り上げると MinPooledBytes になる
+	failed += !allocateAndRelease(min - CanvasPool::Alignment + 1, true);
+	failed += !allocateAndRelease(min - 1, true);
+	failed += !allocateAndRelease(min, true);
+	failed += !allocateAndRelease(min + 1, true);
+
+	// 取っておいたものを全部 OS に返すと何も残らない
+	pool.configure("limit=0");
+	const CanvasPool::Stats stats = pool.stats();
+	if (stats.systemBytes != 0 || stats.pooledBytes != 0) {
+		fprintf(stderr, "after trimming: %zu bytes mapped, %zu bytes pooled\n", stats.systemBytes, stats.pooledBytes);
+		++failed;
+	}
+
+	printf("canvas_pool_test: %d failed\n", failed);
+	return failed == 0 ? 0 : 1;
+}
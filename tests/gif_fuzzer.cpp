@@ -0,0 +1,66 @@
+#include <unifex/sync_wait.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "workqueue.h"
+#include "mainwq.h"
+#include "curl_workqueue_pool.h"
+#include "app.h"
+#include "byte_source.h"
+
+// 入力を 1 つのチャンクとして ReplaySource から curl_task_once() に流す libFuzzer のターゲット。
+// ヘッダやフレームの大きさの検査をすり抜けて合成やLZWが範囲外に触れないかを見る
+
+extern CurlWorkqueuePool* g_curlPool;
+
+Workqueue* g_mainWQ;
+
+void enqueueWork(Workqueue::Node& node)
+{
+	g_mainWQ->enqueue(node);
+}
+
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule, Priority priority)
+{
+	g_mainWQ->enqueue(handle, schedule, priority);
+}
+
+bool cancelCoroutine(std::coroutine_handle<> handle)
+{
+	return g_mainWQ->cancel(handle);
+}
+
+WorkqueueClock& mainWQClock()
+{
+	return g_mainWQ->clock();
+}
+
+void SetImage(const IndexedImage& image, int index)
+{
+}
+
+bool GetTargetImageSize(int index, int& width, int& height)
+{
+	return false;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	[[maybe_unused]] static bool started = [] {
+		g_mainWQ = new Workqueue();
+		std::thread{ []() { g_mainWQ->run(); } }.detach();
+		g_curlPool = new CurlWorkqueuePool(1);
+		return true;
+	}();
+
+	auto capture = std::make_shared<Capture>();
+	const std::byte* bytes = reinterpret_cast<const std::byte*>(data);
+	capture->push_back({ std::chrono::microseconds(0), std::vector<std::byte>(bytes, bytes + size) });
+	unifex::sync_wait(decode_gif("replay://fuzz", 0,
+		[](const IndexedImage&, std::optional<std::chrono::milliseconds>) {},
+		[capture](const char*) { return std::make_unique<ReplaySource>(capture); }));
+	return 0;
+}
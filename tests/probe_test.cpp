@@ -0,0 +1,157 @@
+#include <unifex/sync_wait.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "workqueue.h"
+#include "mainwq.h"
+#include "curl_workqueue_pool.h"
+#include "app.h"
+#include "byte_source.h"
+
+// probe_gif() を ReplaySource 越しに叩き、ブロック構造から読んだ概要と、
+// 途中で切れたり止まったりした転送で complete = false のままそこまでの値を返すことを確かめる
+
+extern CurlWorkqueuePool* g_curlPool;
+
+Workqueue* g_mainWQ;
+
+void enqueueWork(Workqueue::Node& node)
+{
+	g_mainWQ->enqueue(node);
+}
+
+void enqueueCoroutine(std::coroutine_handle<> handle, std::chrono::steady_clock::time_point schedule, Priority priority)
+{
+	g_mainWQ->enqueue(handle, schedule, priority);
+}
+
+bool cancelCoroutine(std::coroutine_handle<> handle)
+{
+	return g_mainWQ->cancel(handle);
+}
+
+WorkqueueClock& mainWQClock()
+{
+	return g_mainWQ->clock();
+}
+
+void SetImage(const IndexedImage& image, int index)
+{
+}
+
+bool GetTargetImageSize(int index, int& width, int& height)
+{
+	return false;
+}
+
+namespace {
+
+// 4x3 で 2 フレーム (遅延 10 と 20)、無限ループの GIF。画像データは読み捨てられるので中身は何でもよい
+std::vector<std::byte> testGif()
+{
+	const uint8_t bytes[] = {
+		'G', 'I', 'F', '8', '9', 'a', 4, 0, 3, 0, 0x80, 0, 0,
+		0, 0, 0, 0xFF, 0xFF, 0xFF, // グローバルカラーテーブル (2 色)
+		0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0,
+		0x21, 0xF9, 4, 0, 10, 0, 0, 0,
+		0x2C, 0, 0, 0, 0, 4, 0, 3, 0, 0, 2, 3, 0x8C, 0x2D, 0x05, 0,
+		0x21, 0xF9, 4, 0, 20, 0, 0, 0,
+		0x2C, 0, 0, 0, 0, 4, 0, 3, 0, 0x80, 0, 0, 0, 0xFF, 0xFF, 0xFF, // ローカルカラーテーブルつき
+		2, 2, 0x8C, 0x2D, 1, 0x05, 0,
+		0x3B,
+	};
+	return std::vector<std::byte>(reinterpret_cast<const std::byte*>(bytes), reinterpret_cast<const std::byte*>(bytes) + sizeof(bytes));
+}
+
+std::optional<GifInfo> probe(std::shared_ptr<const Capture> capture, ProbeMode mode,
+	std::chrono::milliseconds timeout = std::chrono::seconds(10))
+{
+	return *unifex::sync_wait(probe_gif("replay://probe", mode, timeout,
+		[capture](const char*) { return std::make_unique<ReplaySource>(capture); }));
+}
+
+bool check(bool condition, const char* name, const char* what)
+{
+	if (!condition) {
+		fprintf(stderr, "%s: %s\n", name, what);
+	}
+	return condition;
+}
+
+bool full()
+{
+	auto info = probe(ReplaySource::split(testGif(), 7, std::chrono::microseconds(0)), ProbeMode::Full);
+	return check(info.has_value(), "full", "not recognised as a GIF") &&
+		check(info->width == 4 && info->height == 3, "full", "wrong size") &&
+		check(info->frameCount == 2, "full", "wrong frame count") &&
+		check(info->duration == std::chrono::milliseconds(300), "full", "wrong duration") &&
+		check(info->loopCount == uint16_t(0), "full", "wrong loop count") &&
+		check(info->complete, "full", "not complete");
+}
+
+bool firstFrame()
+{
+	auto info = probe(ReplaySource::split(testGif(), 7, std::chrono::microseconds(0)), ProbeMode::FirstFrame);
+	return check(info.has_value(), "firstFrame", "not recognised as a GIF") &&
+		check(info->frameCount == 1, "firstFrame", "wrong frame count") &&
+		check(info->duration == std::chrono::milliseconds(100), "firstFrame", "wrong duration") &&
+		check(!info->complete, "firstFrame", "reported complete");
+}
+
+// 2 フレーム目の途中で転送が終わる
+bool truncated()
+{
+	std::vector<std::byte> data = testGif();
+	data.resize(data.size() - 5);
+	auto info = probe(ReplaySource::split(data, 7, std::chrono::microseconds(0)), ProbeMode::Full);
+	return check(info.has_value(), "truncated", "not recognised as a GIF") &&
+		check(info->frameCount == 1, "truncated", "wrong frame count") &&
+		check(!info->complete, "truncated", "reported complete");
+}
+
+// 終端の 1 バイトが届かないまま止まる。期限で戻ってそこまでの値を返す
+bool stalled()
+{
+	std::vector<std::byte> data = testGif();
+	auto capture = std::make_shared<Capture>();
+	capture->push_back({ std::chrono::microseconds(0), std::vector<std::byte>(data.begin(), data.end() - 1) });
+	capture->push_back({ std::chrono::minutes(10), std::vector<std::byte>(data.end() - 1, data.end()) });
+
+	auto start = std::chrono::steady_clock::now();
+	auto info = probe(capture, ProbeMode::Full, std::chrono::milliseconds(200));
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return check(elapsed < std::chrono::seconds(5), "stalled", "did not stop at the deadline") &&
+		check(info.has_value(), "stalled", "not recognised as a GIF") &&
+		check(info->frameCount == 2, "stalled", "wrong frame count") &&
+		check(!info->complete, "stalled", "reported complete");
+}
+
+bool notGif()
+{
+	std::vector<std::byte> data(64, std::byte{ 'x' });
+	auto info = probe(ReplaySource::split(data, 64, std::chrono::microseconds(0)), ProbeMode::Full);
+	return check(!info.has_value(), "notGif", "recognised as a GIF");
+}
+
+}
+
+int main()
+{
+	g_mainWQ = new Workqueue();
+	std::thread{ []() { g_mainWQ->run(); } }.detach();
+	g_curlPool = new CurlWorkqueuePool(1);
+
+	int failed = 0;
+	for (bool (*test)() : { full, firstFrame, truncated, stalled, notGif }) {
+		failed += !test();
+	}
+
+	g_curlPool->stop();
+	printf("probe_test: %d failed\n", failed);
+	return failed == 0 ? 0 : 1;
+}
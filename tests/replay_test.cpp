@@ -0,0 +1,89 @@
+#include <unifex/sync_wait.hpp>
+#include <unifex/task.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "curl_workqueue.h"
+#include "byte_source.h"
+
+// ReplaySource の再生中に reader を開き直したり破棄したりしても、
+// 前の再生の続きが新しい再生に混ざったり、破棄したあとに動いたりしないことを確かめる。
+// チャンクの間隔を 0 にして、前のチャンクの配信が読み込みの再開と同じ周回に並ぶようにする
+
+namespace {
+
+std::vector<std::byte> testData()
+{
+	std::vector<std::byte> data(1000);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<std::byte>(i * 7 + i / 256);
+	}
+	return data;
+}
+
+// 1 バイト読んだところで開き直し、最後まで読んだものが data と一致すれば true
+unifex::task<bool> reopenMidStream(CurlWorkqueue& wq, const std::vector<std::byte>& data)
+{
+	co_await shedule(wq);
+	CurlWorkqueue::CurlReader reader(wq);
+	reader.setSource(std::make_unique<ReplaySource>(ReplaySource::split(data, 10, std::chrono::microseconds(0))));
+	reader.open("replay://test");
+
+	uint8_t first;
+	if (co_await reader.read(&first, 1) != 1) {
+		fprintf(stderr, "reopen: failed to read the first byte\n");
+		co_return false;
+	}
+	reader.open("replay://test");
+
+	// 二重に届いていれば data より多く読める
+	std::vector<uint8_t> read(data.size() * 2);
+	size_t size = co_await reader.read(read.data(), read.size());
+	if (size != data.size() || memcmp(read.data(), data.data(), size) != 0) {
+		fprintf(stderr, "reopen: read %zu bytes, expected %zu\n", size, data.size());
+		co_return false;
+	}
+	co_return true;
+}
+
+// 1 バイト読んだところで破棄し、そのあともキューを回す (AddressSanitizer で破棄後の参照を見る)
+unifex::task<bool> destroyMidStream(CurlWorkqueue& wq, const std::vector<std::byte>& data)
+{
+	co_await shedule(wq);
+	{
+		CurlWorkqueue::CurlReader reader(wq);
+		reader.setSource(std::make_unique<ReplaySource>(ReplaySource::split(data, 10, std::chrono::microseconds(0))));
+		reader.open("replay://test");
+		uint8_t first;
+		if (co_await reader.read(&first, 1) != 1) {
+			fprintf(stderr, "destroy: failed to read the first byte\n");
+			co_return false;
+		}
+	}
+	co_await shedule(wq);
+	co_await shedule(wq);
+	co_return true;
+}
+
+}
+
+int main()
+{
+	CurlWorkqueue wq;
+	std::thread network([&wq]() { wq.run(); });
+
+	const std::vector<std::byte> data = testData();
+	int failed = 0;
+	for (int i = 0; i < 100; ++i) {
+		failed += !unifex::sync_wait(reopenMidStream(wq, data)).value_or(false);
+		failed += !unifex::sync_wait(destroyMidStream(wq, data)).value_or(false);
+	}
+
+	wq.stop();
+	network.join();
+	printf("replay_test: %d failed\n", failed);
+	return failed == 0 ? 0 : 1;
+}